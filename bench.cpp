@@ -0,0 +1,591 @@
+// throughput and latency benchmarks of simple_regex against std::regex (and
+// RE2 or PCRE2 when built with them) over a generated corpus, every timing is
+// the median of repeated runs so results can be compared between versions
+//
+// build: g++ -std=c++20 -O2 -o bench bench.cpp
+//   with RE2:   add -DBENCH_RE2 -lre2
+//   with PCRE2: add -DBENCH_PCRE2 -lpcre2-8
+// usage: bench [--csv | --json] [--size MiB] [--reps n] [--max-time s]
+//              [--corpus file] [--filter text]
+//   --csv, --json  one record per line instead of the table
+//   --size      MiB of each generated corpus (default 1)
+//   --reps      runs per timing at least (default 5)
+//   --max-time  seconds a timing may take before it stops at fewer runs
+//   --corpus    lines of this file instead of the generated ascii corpus
+//   --filter    only cases whose group or pattern contains text
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <regex>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "regex.hpp"
+
+#ifdef BENCH_RE2
+#include <re2/re2.h>
+#endif
+#ifdef BENCH_PCRE2
+#define PCRE2_CODE_UNIT_WIDTH 8
+#include <pcre2.h>
+#endif
+
+// a corpus and its lines (without the newline), what every engine runs over
+struct corpus {
+  std::string text;
+  std::vector<std::string_view> lines;
+
+  void split() {
+    lines.clear();
+    std::string_view rest = text;
+    while (rest.size()) {
+      const size_t nl = rest.find('\n');
+      const size_t len = (nl == rest.npos) ? rest.size() : nl;
+      lines.emplace_back(rest.substr(0, len));
+      rest.remove_prefix((nl == rest.npos) ? len : len + 1);
+    }
+  }
+};
+
+// log like lines: timestamps, levels, ids, key=value pairs and a little
+// prose, the same for a given size on every run
+corpus ascii_corpus(size_t bytes) {
+  static const char* levels[] = {"INFO", "INFO", "INFO", "DEBUG", "WARN",
+                                 "ERROR"};
+  static const char* words[] = {
+      "request", "served",   "cache",   "worker",  "queue",   "flushed",
+      "retry",   "upstream", "client",  "session", "closed",  "opened",
+      "Sherlock", "Holmes",  "Watson",  "said",    "asked",   "the",
+      "of",      "and",      "file",    "loaded",  "timeout", "connection"};
+  std::mt19937 rng(2024);
+  corpus c;
+  char buf[64];
+  // one draw per statement, argument order is unspecified
+  auto draw = [&](uint32_t m) { return static_cast<uint32_t>(rng() % m); };
+  while (c.text.size() < bytes) {
+    const uint32_t month = 1 + draw(12), day = 1 + draw(28), h = draw(24),
+                   min = draw(60), sec = draw(60);
+    std::snprintf(buf, sizeof(buf), "2024-%02u-%02u %02u:%02u:%02u ", month,
+                  day, h, min, sec);
+    c.text += buf;
+    c.text += levels[draw(6)];
+    const uint32_t worker = draw(64);
+    const uint32_t id = static_cast<uint32_t>(rng());
+    std::snprintf(buf, sizeof(buf), " worker-%u id=%08x ", worker, id);
+    c.text += buf;
+    const uint32_t n = 3 + draw(10);
+    for (uint32_t k = 0; k < n; ++k) {
+      c.text += words[draw(sizeof(words) / sizeof(words[0]))];
+      c.text += ' ';
+    }
+    const uint32_t status = draw(10) ? 200 : 500 + draw(4);
+    const uint32_t took = draw(2000);
+    std::snprintf(buf, sizeof(buf), "status=%u took=%ums\n", status, took);
+    c.text += buf;
+  }
+  c.split();
+  return c;
+}
+
+// the utf8 encoding of code point c
+std::string utf8(uint32_t c) {
+  std::string s;
+  if (c < 0x80) {
+    s += static_cast<char>(c);
+  } else if (c < 0x800) {
+    s += static_cast<char>(0xC0 | (c >> 6));
+    s += static_cast<char>(0x80 | (c & 63));
+  } else if (c < 0x10000) {
+    s += static_cast<char>(0xE0 | (c >> 12));
+    s += static_cast<char>(0x80 | ((c >> 6) & 63));
+    s += static_cast<char>(0x80 | (c & 63));
+  } else {
+    s += static_cast<char>(0xF0 | (c >> 18));
+    s += static_cast<char>(0x80 | ((c >> 12) & 63));
+    s += static_cast<char>(0x80 | ((c >> 6) & 63));
+    s += static_cast<char>(0x80 | (c & 63));
+  }
+  return s;
+}
+
+// mostly multi byte text: runs of cjk, kana, greek and cyrillic letters with
+// some ascii and emoji between them
+corpus utf8_corpus(size_t bytes) {
+  struct script {
+    uint32_t lo, hi;
+  };
+  static const script scripts[] = {{0x4E00, 0x9FFF}, {0x3041, 0x3096},
+                                   {0x03B1, 0x03C9}, {0x0430, 0x044F},
+                                   {0x61, 0x7A},     {0x1F600, 0x1F64F}};
+  std::mt19937 rng(2025);
+  corpus c;
+  while (c.text.size() < bytes) {
+    const uint32_t words = 4 + rng() % 12;
+    for (uint32_t w = 0; w < words; ++w) {
+      const auto& s = scripts[rng() % 6];
+      const uint32_t len = 1 + rng() % 6;
+      for (uint32_t k = 0; k < len; ++k) {
+        c.text += utf8(s.lo + rng() % (s.hi - s.lo + 1));
+      }
+      if (rng() % 8 == 0) {
+        c.text += utf8(0x3067) + utf8(0x3059);  // です
+      }
+      c.text += ' ';
+    }
+    c.text += '\n';
+  }
+  c.split();
+  return c;
+}
+
+// lines of n a's, what makes backtracking engines try every split
+corpus repeated_corpus(size_t bytes, uint32_t n) {
+  corpus c;
+  const std::string line = std::string(n, 'a') + '\n';
+  while (c.text.size() < bytes) {
+    c.text += line;
+  }
+  c.split();
+  return c;
+}
+
+enum corpus_id { ASCII, UTF8, REPEATED };
+
+struct bench_case {
+  const char* group;
+  std::string pattern;
+  corpus_id on;
+  // bytes the other engines get (0 all), they can take exponential time
+  size_t others_limit = 0;
+  bool byte_engines = true;  // std::regex is byte based, wrong on utf8
+};
+
+std::vector<bench_case> cases() {
+  return {
+      {"literal", "timeout", ASCII},
+      {"literal", "Sherlock Holmes", ASCII},
+      {"alternation", "ERROR|WARN|FATAL", ASCII},
+      {"alternation", "(Sherlock|Watson|Lestrade) (said|asked)", ASCII},
+      {"class", "[0-9]{4}-[0-9]{2}-[0-9]{2} 0[0-9]:", ASCII},
+      {"class", "id=[a-f0-9]+ [A-Z][a-z]+", ASCII},
+      {"class", "[^a-z ]{6}", ASCII},
+      {"dotstar", "f.*l ", ASCII},
+      {"dotstar", "ERROR.*timeout", ASCII},
+      {"dotstar", "status=5.*took=[0-9]{4}", ASCII},
+      {"utf8", "[一-鿿]+です", UTF8, 0, false},
+      {"utf8", "[α-ω]{3}[а-я]", UTF8, 0, false},
+      {"utf8", "😀.*[😀-🙏]", UTF8, 0, false},
+      {"utf8", "[^ -~]{8}", UTF8, 0, false},
+      {"pathological", "(a?){16}a{16}", REPEATED, 1 << 12},
+      {"pathological", "(a|aa)*b", REPEATED, 1 << 12},
+      {"pathological", "(.*)(.*)(.*)(.*)(.*)b", REPEATED, 1 << 12},
+  };
+}
+
+struct options {
+  enum { TABLE, CSV, JSON } format = TABLE;
+  size_t size = 1 << 20;
+  uint32_t reps = 5;
+  double max_time = 2.0;
+  std::string corpus_file;
+  std::string filter;
+};
+
+// median ns of f() over at least reps runs, fewer once max_time has passed
+// (never fewer than one), one unmeasured run first warms caches
+template <typename F>
+double median_ns(const options& opt, F&& f, bool warm = true) {
+  using clock = std::chrono::steady_clock;
+  if (warm) {
+    f();
+  }
+  std::vector<double> samples;
+  const auto start = clock::now();
+  while (samples.size() < opt.reps) {
+    const auto t0 = clock::now();
+    f();
+    const auto t1 = clock::now();
+    samples.push_back(
+        std::chrono::duration<double, std::nano>(t1 - t0).count());
+    if (std::chrono::duration<double>(t1 - start).count() > opt.max_time) {
+      break;
+    }
+  }
+  std::sort(samples.begin(), samples.end());
+  return samples[samples.size() / 2];
+}
+
+std::string quoted(std::string_view s, bool json) {
+  std::string ret = "\"";
+  for (char c : s) {
+    if (c == '"') {
+      ret += json ? "\\\"" : "\"\"";
+    } else if (json && (c == '\\')) {
+      ret += "\\\\";
+    } else {
+      ret += c;
+    }
+  }
+  return ret + '"';
+}
+
+// one timing, bytes 0 for latencies
+struct record {
+  std::string group;
+  std::string pattern;
+  std::string mode;
+  std::string engine;
+  size_t bytes;
+  double ns;
+  size_t matches;
+};
+
+void print(const options& opt, const record& r, size_t expected) {
+  const double mbs = r.bytes ? (r.bytes / 1048576.0) / (r.ns * 1e-9) : 0;
+  switch (opt.format) {
+    case options::CSV:
+      std::printf("%s,%s,%s,%s,%zu,%.0f,%.2f,%zu\n", r.group.c_str(),
+                  quoted(r.pattern, false).c_str(), r.mode.c_str(),
+                  r.engine.c_str(), r.bytes, r.ns, mbs, r.matches);
+      break;
+    case options::JSON:
+      std::printf(
+          "{\"group\":\"%s\",\"pattern\":%s,\"mode\":\"%s\",\"engine\":\"%s\","
+          "\"bytes\":%zu,\"ns\":%.0f,\"mb_per_s\":%.2f,\"matches\":%zu}\n",
+          r.group.c_str(), quoted(r.pattern, true).c_str(), r.mode.c_str(),
+          r.engine.c_str(), r.bytes, r.ns, mbs, r.matches);
+      break;
+    default:
+      if (r.bytes) {
+        // input size shown as the throughput of limited engines is over less
+        std::printf("%-13s %-42s %-10s %-13s %10.1f MB/s %7zu KiB %9zu%s\n",
+                    r.group.c_str(), r.pattern.c_str(), r.mode.c_str(),
+                    r.engine.c_str(), mbs, r.bytes >> 10, r.matches,
+                    (r.matches != expected) ? " (differs)" : "");
+      } else {
+        std::printf("%-13s %-42s %-10s %-13s %10.1f us\n", r.group.c_str(),
+                    r.pattern.c_str(), r.mode.c_str(), r.engine.c_str(),
+                    r.ns / 1000);
+      }
+      break;
+  }
+  std::fflush(stdout);
+}
+
+// the lines of c within its first limit bytes (all of them for 0)
+std::vector<std::string_view> prefix_lines(const corpus& c, size_t limit) {
+  if (!limit) {
+    return c.lines;
+  }
+  std::vector<std::string_view> ret;
+  size_t used = 0;
+  for (auto line : c.lines) {
+    if (used + line.size() + 1 > limit) {
+      break;
+    }
+    ret.push_back(line);
+    used += line.size() + 1;
+  }
+  return ret;
+}
+size_t bytes_of(const std::vector<std::string_view>& lines) {
+  size_t n = 0;
+  for (auto line : lines) {
+    n += line.size() + 1;
+  }
+  return n;
+}
+
+// a mode of an engine: the number of matches (lines for test and match, every
+// match for match_all) over lines
+using runner = std::function<size_t(const std::vector<std::string_view>&)>;
+struct engine_modes {
+  std::string engine;
+  runner test, match, match_all;
+};
+
+int main(int argc, char** argv) {
+  options opt;
+  for (int a = 1; a < argc; ++a) {
+    const std::string arg = argv[a];
+    const bool more = a + 1 < argc;
+    if (arg == "--csv") {
+      opt.format = options::CSV;
+    } else if (arg == "--json") {
+      opt.format = options::JSON;
+    } else if ((arg == "--size") && more) {
+      opt.size = static_cast<size_t>(std::atof(argv[++a]) * (1 << 20));
+    } else if ((arg == "--reps") && more) {
+      opt.reps = std::max(1, std::atoi(argv[++a]));
+    } else if ((arg == "--max-time") && more) {
+      opt.max_time = std::atof(argv[++a]);
+    } else if ((arg == "--corpus") && more) {
+      opt.corpus_file = argv[++a];
+    } else if ((arg == "--filter") && more) {
+      opt.filter = argv[++a];
+    } else {
+      std::cerr << "usage: bench [--csv | --json] [--size MiB] [--reps n] "
+                   "[--max-time s] [--corpus file] [--filter text]"
+                << std::endl;
+      return 2;
+    }
+  }
+  corpus corpora[3];
+  if (opt.corpus_file.size()) {
+    std::ifstream in(opt.corpus_file, std::ios::binary);
+    if (!in) {
+      std::cerr << "bench: can't read " << opt.corpus_file << std::endl;
+      return 2;
+    }
+    std::stringstream ss;
+    ss << in.rdbuf();
+    corpora[ASCII].text = ss.str();
+    corpora[ASCII].split();
+  } else {
+    corpora[ASCII] = ascii_corpus(opt.size);
+  }
+  corpora[UTF8] = utf8_corpus(opt.size);
+  corpora[REPEATED] = repeated_corpus(opt.size, 16);
+  if (opt.format == options::CSV) {
+    std::printf("group,pattern,mode,engine,bytes,ns,mb_per_s,matches\n");
+  }
+
+  for (const auto& bc : cases()) {
+    if (opt.filter.size() && (bc.pattern.find(opt.filter) == bc.pattern.npos) &&
+        (std::string(bc.group).find(opt.filter) == std::string::npos)) {
+      continue;
+    }
+    const corpus& c = corpora[bc.on];
+    const auto all = prefix_lines(c, 0);
+    const auto limited = prefix_lines(c, bc.others_limit);
+    auto row = [&](const std::string& mode, const std::string& engine,
+                   size_t bytes, double ns, size_t matches, size_t expected) {
+      print(opt, {bc.group, bc.pattern, mode, engine, bytes, ns, matches},
+            expected);
+    };
+
+    // compile latency
+    auto code = std::make_shared<const simple_regex::nfa_vm::program>(
+        bc.pattern);
+    row("compile", "simple_regex", 0, median_ns(opt, [&] {
+          simple_regex::nfa_vm::program p(bc.pattern);
+        }),
+        0, 0);
+
+    std::vector<engine_modes> engines;
+    {
+      auto vm = std::make_shared<simple_regex::nfa_vm>(code);
+      engines.push_back(
+          {"simple_regex",
+           [vm](const auto& lines) {
+             size_t n = 0;
+             for (auto line : lines) {
+               n += (*vm).test<true>(line);
+             }
+             return n;
+           },
+           [vm](const auto& lines) {
+             size_t n = 0;
+             for (auto line : lines) {
+               n += (*vm).match<true>(line);
+             }
+             return n;
+           },
+           [vm](const auto& lines) {
+             size_t n = 0;
+             for (auto line : lines) {
+               (*vm).match<true, false>(line);
+               n += (*vm).match_indices().size();
+             }
+             return n;
+           }});
+    }
+    if (bc.byte_engines) {
+      row("compile", "std::regex", 0, median_ns(opt, [&] {
+            std::regex re(bc.pattern);
+          }),
+          0, 0);
+      auto re = std::make_shared<std::regex>(bc.pattern);
+      engines.push_back(
+          {"std::regex",
+           [re](const auto& lines) {
+             size_t n = 0;
+             for (auto line : lines) {
+               n += std::regex_search(line.begin(), line.end(), *re);
+             }
+             return n;
+           },
+           [re](const auto& lines) {
+             size_t n = 0;
+             std::match_results<std::string_view::const_iterator> m;
+             for (auto line : lines) {
+               n += std::regex_search(line.begin(), line.end(), m, *re);
+             }
+             return n;
+           },
+           [re](const auto& lines) {
+             size_t n = 0;
+             for (auto line : lines) {
+               std::regex_iterator<std::string_view::const_iterator> it(
+                   line.begin(), line.end(), *re),
+                   end;
+               n += std::distance(it, end);
+             }
+             return n;
+           }});
+    }
+#ifdef BENCH_RE2
+    {
+      row("compile", "re2", 0, median_ns(opt, [&] {
+            RE2 re(bc.pattern);
+          }),
+          0, 0);
+      auto re = std::make_shared<RE2>(bc.pattern);
+      auto all_in = [re](std::string_view line) {
+        size_t n = 0;
+        re2::StringPiece in(line.data(), line.size());
+        re2::StringPiece m;
+        size_t at = 0;
+        while ((at <= line.size()) &&
+               (*re).Match(in, at, line.size(), RE2::UNANCHORED, &m, 1)) {
+          n += 1;
+          const size_t end = m.data() - line.data() + m.size();
+          at = m.size() ? end : end + 1;
+        }
+        return n;
+      };
+      engines.push_back({"re2",
+                         [re](const auto& lines) {
+                           size_t n = 0;
+                           for (auto line : lines) {
+                             n += RE2::PartialMatch(
+                                 re2::StringPiece(line.data(), line.size()),
+                                 *re);
+                           }
+                           return n;
+                         },
+                         [re](const auto& lines) {
+                           size_t n = 0;
+                           re2::StringPiece m;
+                           for (auto line : lines) {
+                             n += (*re).Match(
+                                 re2::StringPiece(line.data(), line.size()), 0,
+                                 line.size(), RE2::UNANCHORED, &m, 1);
+                           }
+                           return n;
+                         },
+                         [all_in](const auto& lines) {
+                           size_t n = 0;
+                           for (auto line : lines) {
+                             n += all_in(line);
+                           }
+                           return n;
+                         }});
+    }
+#endif
+#ifdef BENCH_PCRE2
+    {
+      auto compile = [&] {
+        int err;
+        PCRE2_SIZE off;
+        return pcre2_compile(
+            reinterpret_cast<PCRE2_SPTR>(bc.pattern.data()), bc.pattern.size(),
+            PCRE2_UTF, &err, &off, nullptr);
+      };
+      row("compile", "pcre2", 0, median_ns(opt, [&] {
+            pcre2_code_free(compile());
+          }),
+          0, 0);
+      auto re = std::shared_ptr<pcre2_code>(compile(), pcre2_code_free);
+      pcre2_jit_compile(re.get(), PCRE2_JIT_COMPLETE);
+      auto md = std::shared_ptr<pcre2_match_data>(
+          pcre2_match_data_create_from_pattern(re.get(), nullptr),
+          pcre2_match_data_free);
+      // matches of line from at, errors (the match limit) count as none
+      auto find = [re, md](std::string_view line, size_t at) {
+        return pcre2_match(re.get(),
+                           reinterpret_cast<PCRE2_SPTR>(line.data()),
+                           line.size(), at, 0, md.get(), nullptr) > 0;
+      };
+      auto lines_hit = [find](const auto& lines) {
+        size_t n = 0;
+        for (auto line : lines) {
+          n += find(line, 0);
+        }
+        return n;
+      };
+      engines.push_back({"pcre2", lines_hit, lines_hit,
+                         [find, md](const auto& lines) {
+                           size_t n = 0;
+                           for (auto line : lines) {
+                             size_t at = 0;
+                             while ((at <= line.size()) && find(line, at)) {
+                               n += 1;
+                               const PCRE2_SIZE* ov =
+                                   pcre2_get_ovector_pointer(md.get());
+                               at = (ov[1] > ov[0]) ? ov[1] : ov[1] + 1;
+                             }
+                           }
+                           return n;
+                         }});
+    }
+#endif
+
+    // throughput, matches are checked against simple_regex's over the same
+    // lines ([1] over the prefix the other engines may be limited to)
+    const char* names[3] = {"test", "match", "match_all"};
+    size_t expected[2][3];
+    for (size_t e = 0; e < engines.size(); ++e) {
+      const auto& em = engines[e];
+      const auto& lines = e ? limited : all;
+      const runner* modes[3] = {&em.test, &em.match, &em.match_all};
+      for (uint32_t m = 0; m < 3; ++m) {
+        size_t matches = 0;
+        const double ns = median_ns(opt, [&] { matches = (*modes[m])(lines); });
+        if (e == 0) {
+          expected[0][m] = matches;
+          expected[1][m] = (limited.size() == all.size())
+                               ? matches
+                               : (*modes[m])(limited);
+        }
+        row(names[m], em.engine, bytes_of(lines), ns, matches,
+            expected[e != 0][m]);
+      }
+    }
+
+    // cold and warm dfa: a fresh scratch on the compiled program, its first
+    // pass over the corpus against a later one
+    {
+      size_t matches = 0;
+      const double cold = median_ns(
+          opt,
+          [&] {
+            simple_regex::nfa_vm vm(code);
+            matches = 0;
+            for (auto line : all) {
+              matches += vm.test<true>(line);
+            }
+          },
+          false);
+      row("test_cold", "simple_regex", bytes_of(all), cold, matches,
+          expected[0][0]);
+      simple_regex::nfa_vm vm(code);
+      const double warm = median_ns(opt, [&] {
+        matches = 0;
+        for (auto line : all) {
+          matches += vm.test<true>(line);
+        }
+      });
+      row("test_warm", "simple_regex", bytes_of(all), warm, matches,
+          expected[0][0]);
+    }
+  }
+  return 0;
+}
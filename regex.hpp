@@ -5,17 +5,44 @@
 #pragma once
 // C++ 20 needed for attributes (optional: std::popcount, std::countl_zero)
 
+#include <algorithm>  // std::sort for dfa state keys
+#include <array>      // static_regex tables
+#include <atomic>     // the shared counter of the batch workers
 #include <bit>  // for std::popcount and std::countl_zero   // requires C++ 20
 #include <cstdint>    // for fixed width types
 #include <cstring>    // for std::memcpy (type punning)
+#include <deque>      // fifo eviction order of cached dfa states
+#include <exception>  // std::exception_ptr out of batch workers
 #include <iostream>   // for overloading << and for cout of course
-#include <map>        // probably a bst? no point in handrolling one
+#include <list>       // regex_cache recency order
+#include <memory>     // std::shared_ptr for sharing compiled programs
+#include <mutex>      // regex_cache lock
+#include <span>       // batches of inputs
 #include <stdexcept>  // error handling
 #include <string>     // for c++ strings
+#include <string_view>  // input to match on, no copies
+#include <thread>       // optional workers for the batch calls
+#include <unordered_map>  // regex_cache index
 #include <vector>     // for vector the GOAT of STL
 
+// simd for the bulk set kernels, used only when the target has it
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 namespace simple_regex {
 using byte = unsigned char;
+
+// define SIMPLE_REGEX_STATS (the same in every translation unit) before
+// including to have nfa_vm count what its engines do, see nfa_vm::stats,
+// without it the counters are compiled out
+#ifdef SIMPLE_REGEX_STATS
+inline constexpr bool collect_stats = true;
+#else
+inline constexpr bool collect_stats = false;
+#endif
 /* getting and setting bits in a char */
 
 // e.g. 0b10000000 the 7th bit is 1 (start from least significant at 0)
@@ -84,6 +111,325 @@ inline uint32_t popcount(uint64_t n) {
   return cnt;
 }
 
+/*
+Bulk kernels over byte arrays of whole 64 bit words (bitmap, bitvector), 32
+bytes at a time with avx2, 16 with sse2 or neon, when the compiler targets them
+(e.g. -march=native), a word at a time otherwise
+*/
+enum class bulk_op { OR, AND, XOR };
+
+template <bulk_op Op>
+inline uint64_t apply_op(uint64_t a, uint64_t b) {
+  switch (Op) {
+    case bulk_op::OR:
+      return a | b;
+    case bulk_op::AND:
+      return a & b;
+    default:
+      return a ^ b;
+  }
+}
+
+// dst = dst op src over n bytes
+template <bulk_op Op>
+inline void bulk_apply(byte* dst, const byte* src, size_t n) {
+  size_t i = 0;
+#if defined(__AVX2__)
+  for (; i + 32 <= n; i += 32) {
+    __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + i));
+    const __m256i b =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+    a = (Op == bulk_op::OR)    ? _mm256_or_si256(a, b)
+        : (Op == bulk_op::AND) ? _mm256_and_si256(a, b)
+                               : _mm256_xor_si256(a, b);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), a);
+  }
+#elif defined(__SSE2__)
+  for (; i + 16 <= n; i += 16) {
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i));
+    const __m128i b =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+    a = (Op == bulk_op::OR)    ? _mm_or_si128(a, b)
+        : (Op == bulk_op::AND) ? _mm_and_si128(a, b)
+                               : _mm_xor_si128(a, b);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), a);
+  }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+  for (; i + 16 <= n; i += 16) {
+    const uint8x16_t a = vld1q_u8(dst + i);
+    const uint8x16_t b = vld1q_u8(src + i);
+    vst1q_u8(dst + i, (Op == bulk_op::OR)    ? vorrq_u8(a, b)
+                      : (Op == bulk_op::AND) ? vandq_u8(a, b)
+                                             : veorq_u8(a, b));
+  }
+#endif
+  uint64_t temp_a;
+  uint64_t temp_b;
+  for (; i < n; i += 8) {
+    std::memcpy(&temp_a, dst + i, 8);
+    std::memcpy(&temp_b, src + i, 8);
+    temp_a = apply_op<Op>(temp_a, temp_b);
+    std::memcpy(dst + i, &temp_a, 8);
+  }
+}
+
+inline void bulk_not(byte* dst, size_t n) {
+  size_t i = 0;
+#if defined(__AVX2__)
+  const __m256i ones = _mm256_set1_epi8(-1);
+  for (; i + 32 <= n; i += 32) {
+    const __m256i a =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + i));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i),
+                        _mm256_xor_si256(a, ones));
+  }
+#elif defined(__SSE2__)
+  const __m128i ones = _mm_set1_epi8(-1);
+  for (; i + 16 <= n; i += 16) {
+    const __m128i a =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i),
+                     _mm_xor_si128(a, ones));
+  }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+  for (; i + 16 <= n; i += 16) {
+    vst1q_u8(dst + i, vmvnq_u8(vld1q_u8(dst + i)));
+  }
+#endif
+  uint64_t temp;
+  for (; i < n; i += 8) {
+    std::memcpy(&temp, dst + i, 8);
+    temp = ~temp;
+    std::memcpy(dst + i, &temp, 8);
+  }
+}
+
+inline bool bulk_equal(const byte* a, const byte* b, size_t n) {
+  size_t i = 0;
+#if defined(__AVX2__)
+  for (; i + 32 <= n; i += 32) {
+    const __m256i x =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+    const __m256i y =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+    if (!_mm256_testz_si256(_mm256_xor_si256(x, y), _mm256_xor_si256(x, y))) {
+      return false;
+    }
+  }
+#elif defined(__SSE2__)
+  for (; i + 16 <= n; i += 16) {
+    const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+    const __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xFFFF) {
+      return false;
+    }
+  }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+  for (; i + 16 <= n; i += 16) {
+    if (vmaxvq_u8(veorq_u8(vld1q_u8(a + i), vld1q_u8(b + i)))) {
+      return false;
+    }
+  }
+#endif
+  uint64_t temp_a;
+  uint64_t temp_b;
+  for (; i < n; i += 8) {
+    std::memcpy(&temp_a, a + i, 8);
+    std::memcpy(&temp_b, b + i, 8);
+    if (temp_a != temp_b) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// set bits in n bytes, avx2 counts nibbles through a pshufb lookup
+inline uint32_t bulk_count(const byte* a, size_t n) {
+  using namespace std;  // ADL for popcount
+  size_t i = 0;
+  uint32_t ret = 0;
+#if defined(__AVX2__)
+  const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3,
+                                          2, 3, 3, 4, 0, 1, 1, 2, 1, 2, 2, 3,
+                                          1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i nibble = _mm256_set1_epi8(0x0F);
+  __m256i sums = _mm256_setzero_si256();
+  for (; i + 32 <= n; i += 32) {
+    const __m256i x =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+    const __m256i lo = _mm256_shuffle_epi8(lookup, _mm256_and_si256(x, nibble));
+    const __m256i hi = _mm256_shuffle_epi8(
+        lookup, _mm256_and_si256(_mm256_srli_epi16(x, 4), nibble));
+    sums = _mm256_add_epi64(
+        sums, _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256()));
+  }
+  uint64_t lanes[4];
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), sums);
+  ret = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+  for (; i + 16 <= n; i += 16) {
+    ret += vaddvq_u8(vcntq_u8(vld1q_u8(a + i)));
+  }
+#endif
+  uint64_t temp;
+  for (; i < n; i += 8) {
+    std::memcpy(&temp, a + i, 8);
+    ret += popcount(temp);
+  }
+  return ret;
+}
+
+// a set of byte values searched for 32 (avx2) or 16 (ssse3, neon) input
+// bytes at a time with a nibble lookup: bit (b >> 4) & 7 of lo[b >> 7][b & 15]
+// says whether b is in, so a pshufb on the low nibbles (zeroing the other half
+// by the top bit) and one on the high nibbles classify a whole vector
+struct byte_set {
+  inline void set(byte b) { lo[b >> 7][b & 15] |= 1 << ((b >> 4) & 7); }
+  inline bool test(byte b) const {
+    return (lo[b >> 7][b & 15] >> ((b >> 4) & 7)) & 1;
+  }
+  // first index at or after from holding a member, s.size() if there's none
+  size_t find(std::string_view s, size_t from) const {
+    const byte* p = reinterpret_cast<const byte*>(s.data());
+    const size_t n = s.size();
+    size_t i = from;
+#if defined(__AVX2__)
+    const __m256i t0 = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(lo[0])));
+    const __m256i t1 = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(lo[1])));
+    const __m256i bit = _mm256_setr_epi8(
+        1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8,
+        16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    const __m256i top = _mm256_set1_epi8(-128);
+    for (; i + 32 <= n; i += 32) {
+      const __m256i x =
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+      const __m256i l = _mm256_and_si256(x, nibble);
+      const __m256i t = _mm256_and_si256(x, top);
+      const __m256i flip = _mm256_xor_si256(t, top);
+      const __m256i row =
+          _mm256_or_si256(_mm256_shuffle_epi8(t0, _mm256_or_si256(l, t)),
+                          _mm256_shuffle_epi8(t1, _mm256_or_si256(l, flip)));
+      const __m256i h = _mm256_shuffle_epi8(
+          bit, _mm256_and_si256(_mm256_srli_epi16(x, 4), nibble));
+      const uint32_t miss = _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+          _mm256_and_si256(row, h), _mm256_setzero_si256()));
+      if (miss != 0xFFFFFFFF) {
+        return i + std::countr_zero(~miss);
+      }
+    }
+#elif defined(__SSSE3__)
+    const __m128i t0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lo[0]));
+    const __m128i t1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lo[1]));
+    const __m128i bit = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4,
+                                      8, 16, 32, 64, -128);
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    const __m128i top = _mm_set1_epi8(-128);
+    for (; i + 16 <= n; i += 16) {
+      const __m128i x =
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+      const __m128i l = _mm_and_si128(x, nibble);
+      const __m128i t = _mm_and_si128(x, top);
+      const __m128i row = _mm_or_si128(
+          _mm_shuffle_epi8(t0, _mm_or_si128(l, t)),
+          _mm_shuffle_epi8(t1, _mm_or_si128(l, _mm_xor_si128(t, top))));
+      const __m128i h =
+          _mm_shuffle_epi8(bit, _mm_and_si128(_mm_srli_epi16(x, 4), nibble));
+      const uint32_t miss = _mm_movemask_epi8(
+          _mm_cmpeq_epi8(_mm_and_si128(row, h), _mm_setzero_si128()));
+      if (miss != 0xFFFF) {
+        return i + std::countr_zero(~miss);
+      }
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    // out of range indices give 0 for vqtbl1q_u8 as the top bit does for pshufb
+    const uint8x16_t t0 = vld1q_u8(lo[0]);
+    const uint8x16_t t1 = vld1q_u8(lo[1]);
+    const byte bits[16] = {1, 2, 4, 8, 16, 32, 64, 128,
+                           1, 2, 4, 8, 16, 32, 64, 128};
+    const uint8x16_t bit = vld1q_u8(bits);
+    const uint8x16_t nibble = vdupq_n_u8(0x0F);
+    const uint8x16_t top = vdupq_n_u8(0x80);
+    for (; i + 16 <= n; i += 16) {
+      const uint8x16_t x = vld1q_u8(p + i);
+      const uint8x16_t l = vandq_u8(x, nibble);
+      const uint8x16_t t = vandq_u8(x, top);
+      const uint8x16_t row =
+          vorrq_u8(vqtbl1q_u8(t0, vorrq_u8(l, t)),
+                   vqtbl1q_u8(t1, vorrq_u8(l, veorq_u8(t, top))));
+      const uint8x16_t h = vqtbl1q_u8(bit, vshrq_n_u8(x, 4));
+      // a nibble per byte of the 0xFF / 0x00 hits
+      const uint64_t hits = vget_lane_u64(
+          vreinterpret_u64_u8(vshrn_n_u16(
+              vreinterpretq_u16_u8(vtstq_u8(row, h)), 4)),
+          0);
+      if (hits) {
+        return i + std::countr_zero(hits) / 4;
+      }
+    }
+#endif
+    for (; i < n; ++i) {
+      if (test(p[i])) {
+        return i;
+      }
+    }
+    return n;
+  }
+
+  byte lo[2][16] = {};
+};
+
+// first index at or after from of a byte >= floor, s.size() if there's none,
+// a vector at a time through an unsigned max (x == max(x, floor)), e.g. the
+// end of a run of ascii (floor 0x80) or the next multi byte lead (0xC0)
+inline size_t find_high(std::string_view s, size_t from, byte floor) {
+  const byte* p = reinterpret_cast<const byte*>(s.data());
+  const size_t n = s.size();
+  size_t i = from;
+#if defined(__AVX2__)
+  const __m256i f = _mm256_set1_epi8(static_cast<char>(floor));
+  for (; i + 32 <= n; i += 32) {
+    const __m256i x =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+    const uint32_t hit = _mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(_mm256_max_epu8(x, f), x));
+    if (hit) {
+      return i + std::countr_zero(hit);
+    }
+  }
+#elif defined(__SSE2__)
+  const __m128i f = _mm_set1_epi8(static_cast<char>(floor));
+  for (; i + 16 <= n; i += 16) {
+    const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+    const uint32_t hit =
+        _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(x, f), x));
+    if (hit) {
+      return i + std::countr_zero(hit);
+    }
+  }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+  const uint8x16_t f = vdupq_n_u8(floor);
+  for (; i + 16 <= n; i += 16) {
+    // a nibble per byte of the 0xFF / 0x00 comparisons
+    const uint64_t hits = vget_lane_u64(
+        vreinterpret_u64_u8(vshrn_n_u16(
+            vreinterpretq_u16_u8(vcgeq_u8(vld1q_u8(p + i), f)), 4)),
+        0);
+    if (hits) {
+      return i + std::countr_zero(hits) / 4;
+    }
+  }
+#endif
+  for (; i < n; ++i) {
+    if (p[i] >= floor) {
+      return i;
+    }
+  }
+  return n;
+}
+
 // size snapped to neearest 64 bits
 template <uint32_t bitsize>
 struct bitmap {
@@ -99,57 +445,33 @@ struct bitmap {
   inline void flip(uint32_t idx) {
     bits[idx >> 3] = flip_bit(bits[idx >> 3], idx & 7);
   }
-  inline uint32_t count() const {
-    using namespace std;  // ADL for popcount
-    uint64_t temp;
-    std::memcpy(&temp, &bits[0], 8);
-    uint32_t retv = popcount(temp);
-    for (uint32_t i = 8; i < sizeof(bits); i += 8) {
-      std::memcpy(&temp, &bits[i], 8);
-      retv += popcount(temp);
+  // bits [first, last), whole bytes with one memset
+  inline void set_range(uint32_t first, uint32_t last) {
+    while ((first < last) && (first & 7)) {
+      set(first++);
+    }
+    while ((first < last) && (last & 7)) {
+      set(--last);
+    }
+    if (first < last) {
+      std::memset(bits + (first >> 3), 0xFF, (last - first) >> 3);
     }
-    return retv;
   }
+  inline uint32_t count() const { return bulk_count(bits, sizeof(bits)); }
   inline bitmap& operator^=(const bitmap& other) {
-    uint64_t temp_a;
-    uint64_t temp_b;
-    for (uint32_t i = 0; i < sizeof(bits); i += 8) {
-      std::memcpy(&temp_a, &bits[i], 8);
-      std::memcpy(&temp_b, &other.bits[i], 8);
-      temp_a ^= temp_b;
-      std::memcpy(&bits[i], &temp_a, 8);
-    }
+    bulk_apply<bulk_op::XOR>(bits, other.bits, sizeof(bits));
     return *this;
   }
   inline bitmap& operator&=(const bitmap& other) {
-    uint64_t temp_a;
-    uint64_t temp_b;
-    for (uint32_t i = 0; i < sizeof(bits); i += 8) {
-      std::memcpy(&temp_a, &bits[i], 8);
-      std::memcpy(&temp_b, &other.bits[i], 8);
-      temp_a &= temp_b;
-      std::memcpy(&bits[i], &temp_a, 8);
-    }
+    bulk_apply<bulk_op::AND>(bits, other.bits, sizeof(bits));
     return *this;
   }
   inline bitmap& operator|=(const bitmap& other) {
-    uint64_t temp_a;
-    uint64_t temp_b;
-    for (uint32_t i = 0; i < sizeof(bits); i += 8) {
-      std::memcpy(&temp_a, &bits[i], 8);
-      std::memcpy(&temp_b, &other.bits[i], 8);
-      temp_a |= temp_b;
-      std::memcpy(&bits[i], &temp_a, 8);
-    }
+    bulk_apply<bulk_op::OR>(bits, other.bits, sizeof(bits));
     return *this;
   }
   inline bitmap& operator~() {
-    uint64_t temp_a;
-    for (uint32_t i = 0; i < sizeof(bits); i += 8) {
-      std::memcpy(&temp_a, &bits[i], 8);
-      temp_a = ~temp_a;
-      std::memcpy(&bits[i], &temp_a, 8);
-    }
+    bulk_not(bits, sizeof(bits));
     return *this;
   }
   inline friend bitmap operator^(bitmap lhs, const bitmap& rhs) {
@@ -163,16 +485,7 @@ struct bitmap {
   }
 
   inline bool operator==(const bitmap& other) {
-    uint64_t temp_a;
-    uint64_t temp_b;
-    for (uint32_t i = 0; i < sizeof(bits); i += 8) {
-      std::memcpy(&temp_a, &bits[i], 8);
-      std::memcpy(&temp_b, &other.bits[i], 8);
-      if (temp_a != temp_b) {
-        return false;
-      }
-    }
-    return true;
+    return bulk_equal(bits, other.bits, sizeof(bits));
   }
   inline bool operator!=(const bitmap& other) { return !(*this == (other)); }
   inline void clear() { std::memset(bits, 0, sizeof(bits)); }
@@ -230,66 +543,25 @@ struct bitvector {
   inline void flip(uint32_t idx) {
     data[idx >> 3] = flip_bit(data[idx >> 3], idx & 7);
   }
-  inline uint32_t count() const {
-    if (data.size() == 0) {
-      return 0;
-    }
-    using namespace std;  // ADL for popcount
-    uint64_t temp;
-    std::memcpy(&temp, &data[0], 8);
-    uint32_t retv = popcount(temp);
-    for (uint32_t i = 1; i < data.size(); i += 8) {
-      std::memcpy(&temp, &data[i], sizeof(uint64_t));
-      retv += popcount(temp);
-    }
-    return retv;
-  }
+  inline uint32_t count() const { return bulk_count(data.data(), data.size()); }
+  // over the shorter of the two
   inline bitvector& operator^=(const bitvector& other) {
-    uint64_t temp_a;
-    uint64_t temp_b;
-    uint32_t ms =
-        (data.size() < other.data.size()) ? data.size() : other.data.size();
-    for (uint32_t i = 0; i < ms; i += 8) {
-      std::memcpy(&temp_a, &data[i], sizeof(uint64_t));
-      std::memcpy(&temp_b, &other.data[i], sizeof(uint64_t));
-      temp_a ^= temp_b;
-      std::memcpy(&data[i], &temp_a, sizeof(uint64_t));
-    }
+    bulk_apply<bulk_op::XOR>(data.data(), other.data.data(),
+                             std::min(data.size(), other.data.size()));
     return *this;
   }
   inline bitvector& operator&=(const bitvector& other) {
-    uint64_t temp_a;
-    uint64_t temp_b;
-    uint32_t ms =
-        (data.size() < other.data.size()) ? data.size() : other.data.size();
-    for (uint32_t i = 0; i < ms; i += 8) {
-      std::memcpy(&temp_a, &data[i], sizeof(uint64_t));
-      std::memcpy(&temp_b, &other.data[i], sizeof(uint64_t));
-      temp_a &= temp_b;
-      std::memcpy(&data[i], &temp_a, sizeof(uint64_t));
-    }
+    bulk_apply<bulk_op::AND>(data.data(), other.data.data(),
+                             std::min(data.size(), other.data.size()));
     return *this;
   }
   inline bitvector& operator|=(const bitvector& other) {
-    uint64_t temp_a;
-    uint64_t temp_b;
-    uint32_t ms =
-        (data.size() < other.data.size()) ? data.size() : other.data.size();
-    for (uint32_t i = 0; i < ms; i += 8) {
-      std::memcpy(&temp_a, &data[i], sizeof(uint64_t));
-      std::memcpy(&temp_b, &other.data[i], sizeof(uint64_t));
-      temp_a |= temp_b;
-      std::memcpy(&data[i], &temp_a, sizeof(uint64_t));
-    }
+    bulk_apply<bulk_op::OR>(data.data(), other.data.data(),
+                            std::min(data.size(), other.data.size()));
     return *this;
   }
   inline bitvector& operator~() {
-    uint64_t temp_a;
-    for (uint32_t i = 0; i < data.size(); i += 8) {
-      std::memcpy(&temp_a, &data[i], sizeof(uint64_t));
-      temp_a = ~temp_a;
-      std::memcpy(&data[i], &temp_a, sizeof(uint64_t));
-    }
+    bulk_not(data.data(), data.size());
     return *this;
   }
   inline friend bitvector operator^(bitvector lhs, const bitvector& rhs) {
@@ -301,23 +573,31 @@ struct bitvector {
   inline friend bitvector operator|(bitvector lhs, const bitvector& rhs) {
     return lhs |= rhs;
   }
-  inline bool operator==(const bitvector& other) {
+  inline bool operator==(const bitvector& other) const {
     if (data.size() != other.data.size()) {
       return false;
     }
-    uint64_t temp_a;
-    uint64_t temp_b;
+    return bulk_equal(data.data(), other.data.data(), data.size());
+  }
+  inline bool operator!=(const bitvector& other) const {
+    return !(*this == (other));
+  }
+  // word at a time multiply xorshift, finished with the murmur3 fmix64
+  inline uint64_t hash() const {
+    uint64_t h = data.size();
+    uint64_t temp;
     for (uint32_t i = 0; i < data.size(); i += 8) {
-      std::memcpy(&temp_a, &data[i], 8);
-      std::memcpy(&temp_b, &other.data[i], 8);
-      if (temp_a != temp_b) {
-        return false;
-        break;
-      }
+      std::memcpy(&temp, &data[i], sizeof(uint64_t));
+      h = (h ^ temp) * 0x9E3779B97F4A7C15ULL;
+      h ^= h >> 29;
     }
-    return true;
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
   }
-  inline bool operator!=(const bitvector& other) { return !(*this == (other)); }
   inline friend bool comp(const bitvector& lhs, const bitvector& rhs) {
     if (lhs.data.size() <= rhs.data.size()) {
       if (lhs.data.size() < rhs.data.size()) {
@@ -328,8 +608,8 @@ struct bitvector {
       for (int64_t i = lhs.data.size() - 8; i >= 0; i -= 8) {
         std::memcpy(&temp_a, &lhs.data[i], 8);
         std::memcpy(&temp_b, &rhs.data[i], 8);
-        if (temp_a < temp_b) {
-          return true;
+        if (temp_a != temp_b) {
+          return temp_a < temp_b;
         }
       }
       return false;
@@ -352,6 +632,8 @@ struct bitvector {
 
   // size in bits
   uint32_t size() { return static_cast<uint32_t>(data.size()) * 8; }
+  // heap held, in bytes
+  size_t heap_bytes() const { return data.capacity(); }
   // capacity in bits
   uint32_t capacity() { return static_cast<uint32_t>(data.capacity()) * 8; }
 
@@ -418,8 +700,11 @@ struct sparse_set {
   }
   inline void clear() { dense.resize(0); }
   inline void shrink_to_fit() { dense.shrink_to_fit(); }
+  inline size_t heap_bytes() const {
+    return (dense.capacity() + sparse.capacity()) * sizeof(uint32_t);
+  }
   sparse_set() : dense(), sparse() {}
-  sparse_set(uint32_t size) : dense(size), sparse(size) {}
+  sparse_set(uint32_t size) : dense(), sparse(size) { dense.reserve(size); }
   std::vector<uint32_t> dense;
   std::vector<uint32_t> sparse;
 };
@@ -450,15 +735,20 @@ struct hybrid_set {
     sparse.clear();
     bitset.clear();
   }
-  inline bool operator==(const hybrid_set& other) {
+  inline bool operator==(const hybrid_set& other) const {
     if (sparse.size() != other.sparse.size()) {
       return false;
     }
     return (bitset == other.bitset);
   }
-  inline bool operator!=(const hybrid_set& other) {
+  inline bool operator!=(const hybrid_set& other) const {
     return !(*this == (other));
   }
+  // the bitset alone decides membership so it alone is hashed
+  inline uint64_t hash() const { return bitset.hash(); }
+  inline size_t heap_bytes() const {
+    return sparse.heap_bytes() + bitset.heap_bytes();
+  }
   hybrid_set() : sparse(), bitset() {}
   hybrid_set(uint32_t size) : sparse(size), bitset(size) {}
   hybrid_set(const hybrid_set&) = default;
@@ -475,6 +765,103 @@ struct hybrid_set_comp {
   }
 };
 
+// open addressing (linear probing) table of ids, the keys themselves live
+// elsewhere (e.g. a cache slot) so lookups take the key's hash and a predicate
+// telling whether the key stored under an id is the one looked for, erasing
+// shifts entries back instead of leaving tombstones
+struct id_table {
+  static constexpr uint32_t empty = -1;
+  struct entry {
+    uint64_t hash;
+    uint32_t id;
+  };
+  // slot holding the id the predicate accepts, or the empty slot where it
+  // would be inserted
+  template <typename Eq>
+  inline uint32_t find(uint64_t hash, Eq&& eq) const {
+    uint32_t slot = hash & mask;
+    while (slots[slot].id != empty) {
+      if ((slots[slot].hash == hash) && eq(slots[slot].id)) {
+        return slot;
+      }
+      slot = (slot + 1) & mask;
+    }
+    return slot;
+  }
+  inline bool occupied(uint32_t slot) const { return slots[slot].id != empty; }
+  inline uint32_t operator[](uint32_t slot) const { return slots[slot].id; }
+  // slot must come from find with nothing erased or inserted in between
+  inline void insert(uint32_t slot, uint64_t hash, uint32_t id) {
+    if (2 * (count + 1) > slots.size()) {
+      grow();
+      slot = hash & mask;
+      while (slots[slot].id != empty) {
+        slot = (slot + 1) & mask;
+      }
+    }
+    slots[slot] = {hash, id};
+    count += 1;
+  }
+  inline void erase(uint64_t hash, uint32_t id) {
+    uint32_t slot = hash & mask;
+    while (slots[slot].id != id) {
+      if (slots[slot].id == empty) {
+        return;
+      }
+      slot = (slot + 1) & mask;
+    }
+    // backward shift anything whose probe sequence ran through slot
+    uint32_t next = (slot + 1) & mask;
+    while (slots[next].id != empty) {
+      uint32_t home = slots[next].hash & mask;
+      if (((next - home) & mask) >= ((next - slot) & mask)) {
+        slots[slot] = slots[next];
+        slot = next;
+      }
+      next = (next + 1) & mask;
+    }
+    slots[slot].id = empty;
+    count -= 1;
+  }
+  inline void clear() {
+    for (auto& e : slots) {
+      e.id = empty;
+    }
+    count = 0;
+  }
+  // room for n ids without growing, drops everything
+  inline void reserve(uint32_t n) {
+    uint32_t sz = 16;
+    while (sz < 2 * n) {
+      sz <<= 1;
+    }
+    slots.assign(sz, entry{0, empty});
+    mask = sz - 1;
+    count = 0;
+  }
+  inline uint32_t size() const { return count; }
+  id_table() { reserve(8); }
+
+ protected:
+  inline void grow() {
+    std::vector<entry> old(slots.size() * 2, entry{0, empty});
+    swap(old, slots);
+    mask = slots.size() - 1;
+    for (const auto& e : old) {
+      if (e.id != empty) {
+        uint32_t slot = e.hash & mask;
+        while (slots[slot].id != empty) {
+          slot = (slot + 1) & mask;
+        }
+        slots[slot] = e;
+      }
+    }
+  }
+  std::vector<entry> slots;
+  uint32_t mask = 0;
+  uint32_t count = 0;
+};
+
 void error_invalid_utf8(const char* func_name) {
   std::string err_msg = "ERROR: Invalid UTF-8 passed to:";
   err_msg += func_name;
@@ -495,8 +882,13 @@ char peek_next(const char* s, uint32_t st, uint32_t sz) {
   return 0;
 }
 
+// is this a utf8 continuation byte 10xxxxxx
+constexpr static bool utf_cont(byte b) {
+  return (b & 0b11000000) == 0b10000000;
+}
+
 // given start byte how many bytes in this utf8 encoded code point
-inline static byte utf_bytes(byte start_byte) {
+constexpr static byte utf_bytes(byte start_byte) {
   // optimise for ASCII
   if (start_byte < 192) [[likely]] {
     return 1;  // if binary doesn't start with 110 not multi byte utf8 i.e.
@@ -545,6 +937,25 @@ inline static uint32_t pack_rev4byte(byte a, byte b = 0, byte c = 0,
   return ret;
 }
 
+// the code point of a reverse packed one (as get_utf8_n_inc gives), i.e. the
+// index utf8_bitmap keeps a multi byte one under
+constexpr static uint32_t utf8_scalar(uint32_t bytes) {
+  const byte a = bytes;
+  const uint32_t b = (bytes >> 8) & 0b00111111;
+  const uint32_t c = (bytes >> 16) & 0b00111111;
+  const uint32_t d = (bytes >> 24) & 0b00111111;
+  switch (utf_bytes(a)) {
+    default:
+      return a;
+    case 2:
+      return ((a & 0b00011111) << 6) | b;
+    case 3:
+      return ((a & 0b00001111) << 12) | (b << 6) | c;
+    case 4:
+      return ((a & 0b00000111) << 18) | (b << 12) | (c << 6) | d;
+  }
+}
+
 // not quite a complete bitmap
 // performance is linear for the 4byte codes, don't care about them
 struct utf8_bitmap {
@@ -562,14 +973,15 @@ struct utf8_bitmap {
     return false;
   }
   inline bool test(byte a, byte b, byte c, byte d) const {
+    uint16_t idx = ((static_cast<uint16_t>(a & 7)) << 6) + (b & 63);
+    uint16_t mapidx = (static_cast<uint16_t>(c & 63) << 6) + (d & 63);
     if (others) {
-      uint16_t idx = ((static_cast<uint16_t>(a & 7)) << 6) + (b & 31);
-      if (others[idx]) {
-        uint16_t mapidx = (static_cast<uint16_t>(c & 31) << 6) + (d & 31);
-        return (*others[idx]).test(mapidx);
+      if (others[idx] && (*others[idx]).test(mapidx)) {
+        return true;
       }
     }
-    return false;
+    return astral.size() &&
+           in_spans(astral, (static_cast<uint32_t>(idx) << 12) + mapidx);
   }
   inline bool test_4byte(uint32_t bytes) const {
     byte a = bytes >> 24;
@@ -638,16 +1050,19 @@ struct utf8_bitmap {
     (*bmp).set(utf_3byte_h(a, b, c));
   }
   inline void insert(byte a, byte b, byte c, byte d) {
+    if (test(a, b, c, d)) {
+      return;  // maybe in a span, pages and spans don't overlap
+    }
     if (others) {
     } else {
       others = new bitmap<4096>*[512]{};
     }
-    uint16_t idx = ((static_cast<uint16_t>(a & 7)) << 6) + (b & 31);
+    uint16_t idx = ((static_cast<uint16_t>(a & 7)) << 6) + (b & 63);
     if (others[idx]) {
     } else {
       others[idx] = new bitmap<4096>{};
     }
-    uint16_t mapidx = (static_cast<uint16_t>(c & 31) << 6) + (d & 31);
+    uint16_t mapidx = (static_cast<uint16_t>(c & 63) << 6) + (d & 63);
     (*others[idx]).set(mapidx);
   }
   inline void insert_4byte(uint32_t bytes) {
@@ -708,6 +1123,74 @@ struct utf8_bitmap {
     }
   }
 
+  // code points lo to hi (scalar values, inclusive), the bitmaps are filled
+  // a byte at a time and the 4 byte ones kept as a span, so a range costs
+  // about its size / 8 however many code points it holds
+  inline void insert_range(uint32_t lo, uint32_t hi) {
+    auto part = [&](uint32_t from, uint32_t to, auto&& fill) {
+      const uint32_t l = std::max(lo, from);
+      const uint32_t h = std::min(hi, to);
+      if (l <= h) {
+        fill(l, h + 1);
+      }
+    };
+    part(0, 0x7F, [&](uint32_t l, uint32_t h) { ascii.set_range(l, h); });
+    part(0x80, 0x7FF, [&](uint32_t l, uint32_t h) {
+      if (!latin) {
+        latin = new bitmap<2048>{};
+      }
+      (*latin).set_range(l, h);
+    });
+    part(0x800, 0xFFFF, [&](uint32_t l, uint32_t h) {
+      if (!bmp) {
+        bmp = new bitmap<65536>{};
+      }
+      (*bmp).set_range(l, h);
+    });
+    part(0x10000, 0x1FFFFF, [&](uint32_t l, uint32_t h) {
+      astral =
+          merge_spans(astral, {l, h}, [](bool x, bool y) { return x || y; });
+      drop_paged(l, h);
+    });
+  }
+  // every code point test() can tell apart is flipped in or out ([^...]):
+  // the single bytes below 192, the 2 and 3 byte ones by the index their
+  // bitmap gives them and the 4 byte ones, which all end up in spans
+  inline void negate() {
+    for (uint32_t i = 0; i < 192; ++i) {
+      ascii.flip(i);
+    }
+    if (!latin) {
+      latin = new bitmap<2048>{};
+    }
+    ~(*latin);
+    if (!bmp) {
+      bmp = new bitmap<65536>{};
+    }
+    ~(*bmp);
+    std::vector<uint32_t> paged;
+    if (others) {
+      for (uint32_t o = 0; o < 512; ++o) {
+        if (others[o]) {
+          each_run((*others[o]).data(), 4096, [&](uint32_t l, uint32_t h) {
+            if (paged.size() && (paged.back() == 4096 * o + l)) {
+              paged.back() = 4096 * o + h;
+            } else {
+              paged.push_back(4096 * o + l);
+              paged.push_back(4096 * o + h);
+            }
+          });
+          delete others[o];
+        }
+      }
+      delete[] others;
+      others = nullptr;
+    }
+    paged = merge_spans(astral, paged, [](bool x, bool y) { return x || y; });
+    astral = merge_spans(paged, {0, 1 << 21},
+                         [](bool x, bool y) { return y && !x; });
+  }
+
   inline void remove(byte a) { ascii.reset(a); }
   inline void remove(byte a, byte b) {
     if (latin) {
@@ -724,10 +1207,15 @@ struct utf8_bitmap {
     }
   }
   inline void remove(byte a, byte b, byte c, byte d) {
+    uint16_t idx = ((static_cast<uint16_t>(a & 7)) << 6) + (b & 63);
+    uint16_t mapidx = (static_cast<uint16_t>(c & 63) << 6) + (d & 63);
+    if (astral.size()) {
+      const uint32_t x = (static_cast<uint32_t>(idx) << 12) + mapidx;
+      astral = merge_spans(astral, {x, x + 1},
+                           [](bool x, bool y) { return x && !y; });
+    }
     if (others) {
-      uint16_t idx = ((static_cast<uint16_t>(a & 7)) << 6) + (b & 31);
       if (others[idx]) {
-        uint16_t mapidx = (static_cast<uint16_t>(c & 31) << 6) + (d & 31);
         (*others[idx]).reset(mapidx);
       } else {
         return;
@@ -809,9 +1297,103 @@ struct utf8_bitmap {
         }
       }
     }
+    for (size_t k = 0; k < astral.size(); k += 2) {
+      ret += astral[k + 1] - astral[k];
+    }
     return ret;
   }
 
+  // calls f with every multi byte member (reverse byte order, as test_rev4byte
+  // takes them), the ascii members are in ascii_bitmap()
+  template <typename F>
+  inline void for_each_multibyte(F&& f) const {
+    auto each_bit = [](const byte* bits, uint32_t size, auto&& g) {
+      uint64_t word;
+      for (uint32_t w = 0; w < size; w += 8) {
+        std::memcpy(&word, &bits[w], 8);
+        while (word) {
+          g(8 * w + std::countr_zero(word));
+          word &= word - 1;
+        }
+      }
+    };
+    if (latin) {
+      each_bit((*latin).data(), 2048 / 8, [&](uint32_t i) {
+        f(pack_rev4byte(192 + (i >> 6), 128 + (i & 0b00111111)));
+      });
+    }
+    if (bmp) {
+      each_bit((*bmp).data(), 65536 / 8, [&](uint32_t i) {
+        f(pack_rev4byte(224 + (i >> 12), 128 + ((i >> 6) & 0b00111111),
+                        128 + (i & 0b00111111)));
+      });
+    }
+    auto four = [&](uint32_t i) {
+      f(pack_rev4byte(240 + (i >> 18), 128 + ((i >> 12) & 0b00111111),
+                      128 + ((i >> 6) & 0b00111111), 128 + (i & 0b00111111)));
+    };
+    if (others) {
+      for (uint32_t o = 0; o < 512; ++o) {
+        if (others[o]) {
+          each_bit((*others[o]).data(), 4096 / 8,
+                   [&](uint32_t j) { four(4096 * o + j); });
+        }
+      }
+    }
+    for (size_t k = 0; k < astral.size(); k += 2) {
+      for (uint32_t i = astral[k]; i < astral[k + 1]; ++i) {
+        four(i);
+      }
+    }
+  }
+
+  // calls f(n, first, last) for each run [first, last) of n byte members, by
+  // the index their bitmap gives them (the code point for valid utf8), a
+  // range added with insert_range is one run or a few whatever its size
+  template <typename F>
+  inline void for_each_range(F&& f) const {
+    if (latin) {
+      each_run((*latin).data(), 2048,
+               [&](uint32_t l, uint32_t h) { f(2, l, h); });
+    }
+    if (bmp) {
+      each_run((*bmp).data(), 65536,
+               [&](uint32_t l, uint32_t h) { f(3, l, h); });
+    }
+    if (others) {
+      for (uint32_t o = 0; o < 512; ++o) {
+        if (others[o]) {
+          each_run((*others[o]).data(), 4096, [&](uint32_t l, uint32_t h) {
+            f(4, 4096 * o + l, 4096 * o + h);
+          });
+        }
+      }
+    }
+    for (size_t k = 0; k < astral.size(); k += 2) {
+      f(4, astral[k], astral[k + 1]);
+    }
+  }
+
+  // heap held by the sub bitmaps, in bytes
+  inline size_t heap_bytes() const {
+    size_t ret = 0;
+    if (latin) {
+      ret += sizeof(bitmap<2048>);
+    }
+    if (bmp) {
+      ret += sizeof(bitmap<65536>);
+    }
+    if (others) {
+      ret += 512 * sizeof(bitmap<4096>*);
+      for (auto i = 0; i < 512; ++i) {
+        if (others[i]) {
+          ret += sizeof(bitmap<4096>);
+        }
+      }
+    }
+    return ret + astral.capacity() * sizeof(uint32_t);
+  }
+
   inline void shrink_to_fit() {
     if (latin) {
       if (!((bool)(*latin).count())) {
@@ -846,6 +1428,7 @@ struct utf8_bitmap {
         others = nullptr;
       }
     }
+    astral.shrink_to_fit();
   }
 
   inline utf8_bitmap& operator&=(const utf8_bitmap& other) {
@@ -863,10 +1446,22 @@ struct utf8_bitmap {
         }
       }
     }
+    if (astral.size() && other.astral.size()) {
+      astral = merge_spans(astral, other.astral,
+                           [](bool x, bool y) { return x && y; });
+    }
     return *this;
   }
   inline utf8_bitmap& operator|=(const utf8_bitmap& other) {
     ascii |= other.ascii;
+    if (other.latin) {
+      if (latin) {
+        *latin |= *other.latin;
+      } else {
+        latin = new bitmap<2048>;
+        *latin = *(other.latin);
+      }
+    }
     if (other.bmp) {
       if (bmp) {
         *bmp |= *other.bmp;
@@ -897,6 +1492,15 @@ struct utf8_bitmap {
         }
       }
     }
+    if (other.astral.size()) {
+      astral = merge_spans(astral, other.astral,
+                           [](bool x, bool y) { return x || y; });
+    }
+    if (others) {
+      for (size_t k = 0; k < astral.size(); k += 2) {
+        drop_paged(astral[k], astral[k + 1]);
+      }
+    }
     return *this;
   }
   inline friend utf8_bitmap operator&(utf8_bitmap lhs, const utf8_bitmap& rhs) {
@@ -911,7 +1515,8 @@ struct utf8_bitmap {
       : ascii(),
         latin(other.latin ? new bitmap<2048> : nullptr),
         bmp(other.bmp ? new bitmap<65536> : nullptr),
-        others(other.others ? new bitmap<4096>*[512]{nullptr} : nullptr) {
+        others(other.others ? new bitmap<4096>*[512]{nullptr} : nullptr),
+        astral(other.astral) {
     ascii = other.ascii;
     if (latin) {
       *latin = *(other.latin);
@@ -1027,6 +1632,7 @@ struct utf8_bitmap {
         }
       }
     }
+    astral = other.astral;
     return *this;
   }
   inline utf8_bitmap(utf8_bitmap&& other)
@@ -1037,6 +1643,7 @@ struct utf8_bitmap {
     swap(latin, other.latin);
     swap(bmp, other.bmp);
     swap(others, other.others);
+    swap(astral, other.astral);
   }
   inline utf8_bitmap& operator=(utf8_bitmap&& other) {
     ascii = other.ascii;
@@ -1044,6 +1651,7 @@ struct utf8_bitmap {
     swap(latin, other.latin);
     swap(bmp, other.bmp);
     swap(others, other.others);
+    swap(astral, other.astral);
     return *this;
   }
   inline friend void swap(utf8_bitmap& a, utf8_bitmap& b) {
@@ -1055,6 +1663,7 @@ struct utf8_bitmap {
     swap(a.latin, b.latin);
     swap(a.bmp, b.bmp);
     swap(a.others, b.others);
+    swap(a.astral, b.astral);
   }
 
   ~utf8_bitmap() {
@@ -1167,9 +1776,84 @@ struct utf8_bitmap {
         }
       }
     }
+    auto four = [&](uint32_t i) {
+      stream << static_cast<char>(240 + (i >> 18))
+             << static_cast<char>(128 + ((i >> 12) & 0b00111111))
+             << static_cast<char>(128 + ((i >> 6) & 0b00111111))
+             << static_cast<char>(128 + (i & 0b00111111));
+    };
+    for (size_t k = 0; k < map.astral.size(); k += 2) {
+      four(map.astral[k]);
+      if (map.astral[k + 1] - map.astral[k] > 1) {
+        stream << '-';
+        four(map.astral[k + 1] - 1);
+      }
+    }
     return stream;
   }
 
+  // spans are sorted bounds, the members are [s[0], s[1]), [s[2], s[3]) ...
+  static bool in_spans(const std::vector<uint32_t>& s, uint32_t x) {
+    return (std::upper_bound(s.begin(), s.end(), x) - s.begin()) & 1;
+  }
+  // the spans of what keep(in x, in y) says is in, one sweep over the bounds
+  template <typename Keep>
+  static std::vector<uint32_t> merge_spans(const std::vector<uint32_t>& x,
+                                           const std::vector<uint32_t>& y,
+                                           Keep keep) {
+    std::vector<uint32_t> ret;
+    size_t i = 0;
+    size_t j = 0;
+    bool in = false;
+    while ((i < x.size()) || (j < y.size())) {
+      const uint32_t p = std::min((i < x.size()) ? x[i] : UINT32_MAX,
+                                  (j < y.size()) ? y[j] : UINT32_MAX);
+      i += (i < x.size()) && (x[i] == p);
+      j += (j < y.size()) && (y[j] == p);
+      const bool now = keep(i & 1, j & 1);
+      if (now != in) {
+        ret.push_back(p);
+        in = now;
+      }
+    }
+    return ret;
+  }
+  // calls g(first, last) for each run [first, last) of set bits in bits[0, n)
+  template <typename G>
+  static void each_run(const byte* bits, uint32_t n, G&& g) {
+    auto word = [&](uint32_t w) {
+      uint64_t x;
+      std::memcpy(&x, bits + 8 * w, 8);
+      return x;
+    };
+    const uint32_t words = n / 64;
+    uint32_t i = 0;
+    while (true) {
+      uint32_t w = i / 64;
+      if (w >= words) {
+        return;
+      }
+      uint64_t x = word(w) & (~uint64_t(0) << (i % 64));
+      while (!x) {
+        if (++w == words) {
+          return;
+        }
+        x = word(w);
+      }
+      const uint32_t first = 64 * w + std::countr_zero(x);
+      x = ~word(w) & (~uint64_t(0) << (first % 64));
+      while (!x) {
+        if (++w == words) {
+          g(first, n);
+          return;
+        }
+        x = ~word(w);
+      }
+      i = 64 * w + std::countr_zero(x);
+      g(first, i);
+    }
+  }
+
  protected:
   // the 1 byte code points
   bitmap<256> ascii;
@@ -1179,6 +1863,31 @@ struct utf8_bitmap {
   bitmap<65536>* bmp = nullptr;
   // the 4 byte codes default stored in reverse
   bitmap<4096>** others = nullptr;
+  // 4 byte codes added as ranges, spans over the index others uses (code
+  // point for valid utf8), never also in a page
+  std::vector<uint32_t> astral;
+
+  // clears [l, h) from the pages
+  inline void drop_paged(uint32_t l, uint32_t h) {
+    if (!others) {
+      return;
+    }
+    for (uint32_t o = l >> 12; (o < 512) && (4096 * o < h); ++o) {
+      if (!others[o]) {
+        continue;
+      }
+      const uint32_t from = std::max(l, 4096 * o) - 4096 * o;
+      const uint32_t to = std::min(h, 4096 * (o + 1)) - 4096 * o;
+      if ((from == 0) && (to == 4096)) {
+        delete others[o];
+        others[o] = nullptr;
+        continue;
+      }
+      for (uint32_t j = from; j < to; ++j) {
+        (*others[o]).reset(j);
+      }
+    }
+  }
 };
 
 // utf8 codepoint to pointer map
@@ -1271,7 +1980,7 @@ struct utf8_ptrmap {
         {
           case 2:
             byte b = bytes >> 8;
-            this->operator()(a, b);
+            return this->operator()(a, b);
         }
         {
           case 3:
@@ -1284,7 +1993,7 @@ struct utf8_ptrmap {
             byte b = bytes >> 8;
             byte c = bytes >> 16;
             byte d = bytes >> 24;
-            return this->operator()(a, b, c, bytes);
+            return this->operator()(a, b, c, d);
         }
     }
   }
@@ -1322,7 +2031,7 @@ struct utf8_ptrmap {
         {
           case 2:
             byte b = bytes >> 8;
-            this->operator()(a, b);
+            return this->operator()(a, b);
         }
         {
           case 3:
@@ -1335,7 +2044,7 @@ struct utf8_ptrmap {
             byte b = bytes >> 8;
             byte c = bytes >> 16;
             byte d = bytes >> 24;
-            return this->operator()(a, b, c, bytes);
+            return this->operator()(a, b, c, d);
         }
     }
   }
@@ -1358,7 +2067,7 @@ struct utf8_ptrmap {
     uint16_t y = idx & 2047;
     if (bmp[x]) {
     } else {
-      bmp[x] = new T*[2048];
+      bmp[x] = new T*[2048]{nullptr};
     }
     bmp[x][y] = ptr;
   }
@@ -1434,6 +2143,31 @@ struct utf8_ptrmap {
     }
   }
 
+  // heap held by the pointer tables, in bytes
+  inline size_t heap_bytes() const {
+    size_t ret = 0;
+    if (latin) {
+      ret += 2048 * sizeof(T*);
+    }
+    if (bmp) {
+      ret += 32 * sizeof(T**);
+      for (auto i = 0; i < 32; ++i) {
+        if (bmp[i]) {
+          ret += 2048 * sizeof(T*);
+        }
+      }
+    }
+    if (others) {
+      ret += 1024 * sizeof(T**);
+      for (auto i = 0; i < 1024; ++i) {
+        if (others[i]) {
+          ret += 2048 * sizeof(T*);
+        }
+      }
+    }
+    return ret;
+  }
+
   inline void shrink_to_fit() {
     if (latin) {
       bool empty = true;
@@ -1674,13 +2408,14 @@ struct utf8_ptrmap {
 
 // idx is left at end of code point (not past the end)
 // defautl order is byte 4 byte 3 byte 2 byte 1 (reverse)
-uint32_t get_utf8_n_inc(const std::string& str, uint32_t& idx) {
+// throws on truncated code points and bad continuation bytes
+uint32_t get_utf8_n_inc(std::string_view str, size_t& idx) {
   uint32_t utf8_char = static_cast<byte>(str[idx]);
   switch (utf_bytes(str[idx])) {
     default:
       break;
     case 2:
-      if ((idx < (str.size() - 1))) {
+      if ((idx < (str.size() - 1)) && utf_cont(str[idx + 1])) {
         utf8_char +=
             (static_cast<uint32_t>(static_cast<byte>(str[idx + 1])) << 8);
         idx += 1;
@@ -1691,7 +2426,8 @@ uint32_t get_utf8_n_inc(const std::string& str, uint32_t& idx) {
       }
       break;
     case 3:
-      if (idx < (str.size() - 2)) {
+      if ((idx < (str.size() - 2)) && utf_cont(str[idx + 1]) &&
+          utf_cont(str[idx + 2])) {
         utf8_char +=
             (static_cast<uint32_t>(static_cast<byte>(str[idx + 1])) << 8);
         utf8_char +=
@@ -1704,7 +2440,8 @@ uint32_t get_utf8_n_inc(const std::string& str, uint32_t& idx) {
       }
       break;
     case 4:
-      if (idx < (str.size() - 3)) {
+      if ((idx < (str.size() - 3)) && utf_cont(str[idx + 1]) &&
+          utf_cont(str[idx + 2]) && utf_cont(str[idx + 3])) {
         utf8_char +=
             (static_cast<uint32_t>(static_cast<byte>(str[idx + 1])) << 8);
         utf8_char +=
@@ -1720,10 +2457,46 @@ uint32_t get_utf8_n_inc(const std::string& str, uint32_t& idx) {
   }
   return utf8_char;
 }
-std::string uint32_revto_utf8(uint32_t code_point) {
-  byte a = code_point;
-  byte b, c, d;
-  std::string ch = "";
+// the code point get_utf8_n_inc reads, without its checks, for input that
+// utf8_error passed, everything below a multi byte lead is one byte
+inline uint32_t next_utf8(std::string_view str, size_t& idx) {
+  const byte a = str[idx];
+  if (a < 192) [[likely]] {
+    return a;
+  }
+  const uint32_t len = utf_bytes(a);
+  uint32_t utf8_char = a;
+  for (uint32_t k = 1; k < len; ++k) {
+    utf8_char |= static_cast<uint32_t>(static_cast<byte>(str[idx + k]))
+                 << (8 * k);
+  }
+  idx += len - 1;
+  return utf8_char;
+}
+// where get_utf8_n_inc reading s a code point after another would throw (a
+// lead byte without its continuation bytes), s.size() if nowhere, bytes
+// below 0xC0 are code points of their own so only the leads, found a vector
+// at a time, are looked at
+inline size_t utf8_error(std::string_view s) {
+  const size_t n = s.size();
+  for (size_t i = find_high(s, 0, 0xC0); i < n; i = find_high(s, i, 0xC0)) {
+    const size_t len = utf_bytes(s[i]);
+    if (i + len > n) {
+      return i;
+    }
+    for (size_t k = 1; k < len; ++k) {
+      if (!utf_cont(s[i + k])) {
+        return i;
+      }
+    }
+    i += len;
+  }
+  return n;
+}
+std::string uint32_revto_utf8(uint32_t code_point) {
+  byte a = code_point;
+  byte b, c, d;
+  std::string ch = "";
   ch += a;
   switch (utf_bytes(a)) {
     default:
@@ -1750,1138 +2523,5088 @@ std::string uint32_revto_utf8(uint32_t code_point) {
   return ch;
 }
 
+// the class from s[st] (just past its '[') up to End, ret_end is left on End:
+// code points and ranges lo-hi of them (a - first or last is itself), a ^
+// first negates it. the members are gathered as sorted ranges and filled in
+// a range at a time, so the cost is in the ranges rather than the code
+// points they hold
 template <char End = ']'>
 utf8_bitmap char_class(const std::string& s, uint32_t st, uint32_t& ret_end) {
+  auto unterminated = [] {
+    std::string err_msg =
+        "ERROR: Invalid string passed to char_class, must end character "
+        "class with \']\' and start initial index beyond opening sbracket";
+    throw std::invalid_argument(err_msg);
+  };
+  auto next = [&](bool& loose) {
+    size_t idx = st;
+    const uint32_t utf8 = get_utf8_n_inc(s, idx);
+    st = idx + 1;
+    loose = (utf8 >= 128) && (utf8 < 192);  // a lone continuation byte
+    return utf8_scalar(utf8);
+  };
   utf8_bitmap ret{};
-  char next_char = s[st];
-  while (next_char != End) {
-    switch (next_char) {
-      case 'a':
-        if ((peek_next(s, st) == '-') && (peek_next(s, st + 1) == 'z')) {
-          bitmap<256> lower_mask;
-          uint64_t lower_data[4] = {0, 576460743713488896L, 0, 0};
-          std::memcpy(lower_mask.data(), lower_data, sizeof(lower_data));
-          ret.ascii_bitmap() |= lower_mask;
-          st += 3;
+  const bool negated = (st < s.size()) && (s[st] == '^');
+  st += negated;
+  std::vector<std::pair<uint32_t, uint32_t>> ranges;
+  while (true) {
+    if (st >= s.size()) {
+      unterminated();
+    }
+    if (s[st] == End) {
+      break;
+    }
+    bool loose = false;
+    const uint32_t lo = next(loose);
+    if (loose) {
+      ret.insert(static_cast<byte>(lo));
+      continue;
+    }
+    uint32_t hi = lo;
+    if ((st + 1 < s.size()) && (s[st] == '-') && (s[st + 1] != End)) {
+      ++st;
+      hi = next(loose);
+      if (loose || (hi < lo)) {
+        throw std::invalid_argument(
+            "simple_regex::char_class, range out of order");
+      }
+    }
+    ranges.emplace_back(lo, hi);
+  }
+  std::sort(ranges.begin(), ranges.end());
+  for (size_t k = 0; k < ranges.size();) {
+    // overlapping and adjacent ranges are one
+    uint32_t hi = ranges[k].second;
+    size_t j = k + 1;
+    for (; (j < ranges.size()) && (ranges[j].first <= hi + 1); ++j) {
+      hi = std::max(hi, ranges[j].second);
+    }
+    ret.insert_range(ranges[k].first, hi);
+    k = j;
+  }
+  if (negated) {
+    ret.negate();
+  }
+  ret_end = st;
+  return ret;
+}
+
+// counted repeats a{n}, a{n,} and a{n,m} go up to this
+constexpr uint32_t max_repeat_count = 1000;
+// nfa_vm expands a counted repeat of one code point (a{n,m}, [0-9]{n}, .{n,})
+// up to this count into copies (a word of glushkov positions), past it the
+// repeat is a COUNT op, see nfa_vm::program::counter, a group is always
+// expanded
+constexpr uint32_t max_unrolled_repeat = 64;
+// groups nested deeper than this are rejected rather than risking the stack
+// on the recursive parsers
+constexpr uint32_t max_group_depth = 1000;
+
+// reads the count of {n}, {n,} or {n,m} starting at s[i] == '{' and moves i
+// past its }, false (i unchanged) when what follows isn't one, in which case
+// the { is a literal
+constexpr bool repeat_count(const char* s, size_t len, size_t& i, uint32_t& n,
+                            uint32_t& m, bool& inf) {
+  size_t j = i + 1;
+  auto number = [&](uint32_t& v) {
+    const size_t from = j;
+    v = 0;
+    for (; (j < len) && (s[j] >= '0') && (s[j] <= '9'); ++j) {
+      v = v * 10 + (s[j] - '0');
+      if (v > max_repeat_count) {
+        throw std::invalid_argument(
+            "simple_regex, repeat count above max_repeat_count");
+      }
+    }
+    return j != from;
+  };
+  if (!number(n) || (j == len)) {
+    return false;
+  }
+  m = n;
+  inf = false;
+  if (s[j] == ',') {
+    ++j;
+    inf = !number(m);
+  }
+  if ((j == len) || (s[j] != '}')) {
+    return false;
+  }
+  if (!inf && (m < n)) {
+    throw std::invalid_argument("simple_regex, repeat count {n,m} with m < n");
+  }
+  i = j + 1;
+  return true;
+}
+
+// an upper bound on the ops (or glushkov positions) compiling s[i, len) takes
+// up to a ')' at this depth, which is left at s[i]: a code point, ., class or
+// group is one op each (a group two more for its SAVEs), | * + ? one SPLIT and
+// a counted repeat a copy of its atom per repeat and a SPLIT per optional one,
+// with counting (nfa_vm) one past max_unrolled_repeat of a code point is its
+// COUNT op, the atom again for f{n,} and a SPLIT for that and for f{0,m}
+constexpr size_t ops_bound(const char* s, size_t len, size_t& i,
+                           uint32_t depth, bool counting) {
+  constexpr size_t cap = size_t(1) << 40;  // past any limit, can't overflow
+  size_t total = 0;
+  size_t last = 0;  // ops of the atom being repeated
+  bool atom = false;
+  bool single = false;  // the atom is one code point, nothing applied to it
+  while ((i < len) && (s[i] != ')')) {
+    const char c = s[i];
+    if ((c == '*') || (c == '+') || (c == '?')) {
+      last += 1;
+      single = false;
+      ++i;
+      continue;
+    }
+    if ((c == '{') && atom) {
+      uint32_t n = 0;
+      uint32_t m = 0;
+      bool inf = false;
+      if (repeat_count(s, len, i, n, m, inf)) {
+        if (counting && single && ((inf ? n : m) > max_unrolled_repeat)) {
+          last = inf ? 3 : (n ? 1 : 2);
         } else {
-          ret.insert(next_char);
-          ++st;
+          // f{0} is written out before it's dropped
+          const size_t copies = inf ? ((n > 1) ? n : 1) : m;
+          last =
+              std::min(last * std::max<size_t>(copies, 1) + copies + 1, cap);
         }
+        single = false;
+        continue;
+      }
+    }
+    total = std::min(total + last, cap);
+    last = 1;
+    atom = true;
+    single = true;
+    switch (c) {
+      case '|':
+        atom = false;
+        ++i;
         break;
-      case 'A':
-        if ((peek_next(s, st) == '-') && (peek_next(s, st + 1) == 'Z')) {
-          bitmap<256> lower_mask;
-          uint64_t lower_data[4] = {0, 134217726L, 0, 0};
-          std::memcpy(lower_mask.data(), lower_data, sizeof(lower_data));
-          ret.ascii_bitmap() |= lower_mask;
-          st += 3;
-        } else {
-          ret.insert(next_char);
-          ++st;
+      case '(':
+        ++i;
+        if (depth < max_group_depth) {
+          last = ops_bound(s, len, i, depth + 1, counting) + 2;
         }
+        single = false;
+        i += (i < len);
         break;
-      case '0':
-        if ((peek_next(s, st) == '-') && (peek_next(s, st + 1) == '9')) {
-          bitmap<256> lower_mask;
-          uint64_t lower_data[4] = {287948901175001088L, 0, 0, 0};
-          std::memcpy(lower_mask.data(), lower_data, sizeof(lower_data));
-          ret.ascii_bitmap() |= lower_mask;
-          st += 3;
-        } else {
-          ret.insert(next_char);
-          ++st;
+      case '[':
+        for (++i; (i < len) && (s[i] != ']'); ++i) {
         }
+        i += (i < len);
         break;
-      default:
-        switch (utf_bytes(next_char)) {
-          default:
-            ret.insert(next_char);
-            ++st;
-            break;
-          case 2:
-            if ((st < (s.size() - 2))) {
-              if (s[st + 1] == End) {
-                error_invalid_utf8("simple_regex::char_class");
-              }
-              ret.insert(next_char, s[st + 1]);
-              st += 2;
-            } else {
-              error_invalid_utf8(
-                  "simple_regex::char_class, last element must be end token, "
-                  "default ]");
-            }
-            break;
-          case 3:
-            if ((st < (s.size() - 3))) {
-              if ((s[st + 1] == End) || (s[st + 2] == End)) {
-                error_invalid_utf8("simple_regex::char_class");
-              }
-              ret.insert(next_char, s[st + 1], s[st + 2]);
-              st += 3;
-            } else {
-              error_invalid_utf8(
-                  "simple_regex::char_class, last element must be end token, "
-                  "default ]");
-            }
-            break;
-          case 4:
-            if ((st < (s.size() - 4))) {
-              if ((s[st + 1] == End) || (s[st + 2] == End) ||
-                  (s[st + 3] == End)) {
-                error_invalid_utf8("simple_regex::char_class");
-              }
-              ret.insert(next_char, s[st + 1], s[st + 2], s[st + 3]);
-              st += 4;
-            } else {
-              error_invalid_utf8(
-                  "simple_regex::char_class, last element must be end token, "
-                  "default ]");
-            }
-            break;
+      case '\\':
+        ++i;
+        if (i < len) {
+          i += utf_bytes(s[i]);
         }
         break;
+      default:
+        i += utf_bytes(c);
+        break;
     }
-    if (st >= s.size()) {
-      std::string err_msg =
-          "ERROR: Invalid string passed to char_class, must end character "
-          "class with \']\' and start initial index beyond opening sbracket";
-      throw std::invalid_argument(err_msg);
-    }
-    next_char = s[st];
   }
-  ret_end = st;
-  return ret;
+  return std::min(total + last, cap);
+}
+constexpr size_t ops_bound(const char* s, size_t len, bool counting = true) {
+  size_t bound = 0;
+  for (size_t i = 0; i < len; ++i) {
+    // a stray ) stops it, carry on
+    bound += ops_bound(s, len, i, 0, counting);
+  }
+  return bound;
 }
 
 struct nfa_vm {
+  // links are indices into the op list the op is in (so a program can be
+  // copied or moved without fixing them up), none for MATCH's lb and the rb
+  // of anything but SPLIT, 12 bytes an op
   struct op {
     enum optype : uint32_t {
       // the base
-      CHAR = 'c',
-      MATCH = 'm',
-      SPLIT = 'f',
-      ANY = 'a',
-      SAVE = 's',
-      CLASS = 'g'
+      CHAR,
+      MATCH,
+      SPLIT,
+      ANY,
+      SAVE,
+      CLASS,
+      COUNT  // a counted repeat of one code point, see program::counter
     };
-    op(uint32_t p, uint32_t dat, op* nxt, op* branch = nullptr)
-        : opt(p), data(dat), gen(-1), lb(nxt), rb(branch) {}
-    op() : opt('c'), data(0), gen(-1), lb(nullptr), rb(nullptr) {}
-    uint32_t opt;
+    static constexpr uint32_t none = (uint32_t(1) << 29) - 1;
+    op(uint32_t p, uint32_t dat, uint32_t nxt = none, uint32_t branch = none)
+        : opt(p), lb(nxt), data(dat), rb(branch) {}
+    op() : opt(CHAR), lb(none), data(0), rb(none) {}
+    uint32_t opt : 3;
+    uint32_t lb : 29;
     uint32_t data;
-    int64_t gen = -1;
-    op* lb;
-    op* rb;
+    uint32_t rb;
   };
-  // fragment of full nfa, tracks an op and a list of dangling connections
+  static_assert(sizeof(op) == 12);
+  // fragment of full nfa while compiling: its first op and a list of its
+  // dangling exits, an exit (2k for prog[k].lb, 2k + 1 for prog[k].rb) holds
+  // the next exit of the list until it's patched, none ends it
   struct nfa_frag {
-    nfa_frag() : sp(nullptr), pad(0), start(nullptr), end(nullptr) {}
-    nfa_frag(op* spos, op** st, op** ed) : sp(spos), start(st), end(ed) {}
-    nfa_frag(op& spos) : sp(&spos), start(&(spos.lb)), end(&(spos.lb)) {}
-
-    op** start;
-    op** end;
-    op* sp;
-    // pad it out to a neat 32 bytes (should benchmark to see if it matters)
-   private:
-    int64_t pad = 0;
+    nfa_frag() : sp(op::none), start(op::none), end(op::none) {}
+    nfa_frag(uint32_t spos, uint32_t st, uint32_t ed)
+        : sp(spos), start(st), end(ed) {}
+    // a lone op, lb its exit
+    static nfa_frag single(uint32_t k) { return nfa_frag(k, 2 * k, 2 * k); }
+
+    uint32_t sp;
+    uint32_t start;
+    uint32_t end;
   };
 
-  struct thread {
-    thread() : ops(nullptr), m_loc(0) {}
-    thread(op* o, uint32_t n = 0) : ops(o), m_loc(n) {}
-    thread(op* o, std::vector<uint32_t>&& relay) : ops(o), m_loc(relay) {}
-    op* ops;
-    std::vector<uint32_t> m_loc;
+  // pike vm threads, a thread id (an op, or a count of a counted repeat) is
+  // in a list at most once (generation marks) so the capture slots of thread
+  // k are row k of one flat matrix sized with the program, nothing is
+  // allocated while matching
+  struct thread_list {
+    void reset(uint32_t ops_n, uint32_t width_n) {
+      ops.clear();
+      ops.reserve(ops_n);
+      slots.assign(static_cast<size_t>(ops_n) * width_n, 0);
+      width = width_n;
+    }
+    uint32_t size() const { return ops.size(); }
+    void clear() { ops.clear(); }
+    uint32_t operator[](uint32_t j) const { return ops[j]; }
+    size_t* row(uint32_t k) { return &slots[static_cast<size_t>(k) * width]; }
+
+    std::vector<uint32_t> ops;  // indices into prog
+    std::vector<size_t> slots;
+    uint32_t width = 0;  // slots per row
   };
 
-  struct cache_element {
-    void addop(op* nxtop) {}
-    void resolve_op(std::vector<thread>& pool, thread t, uint32_t i) {}
-    void dfa_states() {}
-    cache_element* step(const std::string& s, uint32_t i) {
-      uint32_t i_c = i;
-      uint32_t utf8 = get_utf8_n_inc(s, i_c);
-      if (filter.test_rev4byte(utf8)) {
-        return next_state.set_rev4byte(utf8);
-      }
-      return next_state(255);
-    }
-    const cache_element* step(std::string& s, uint32_t i) const {
-      uint32_t utf8 = get_utf8_n_inc(s, i);
-      if (filter.test_rev4byte(utf8)) {
-        return next_state.get_rev4byte(utf8);
-      }
-      return next_state(255);
-    }
-
-    static void resolve_split(hybrid_set& list, op* nxt, op* vec_start,
-                              utf8_bitmap& filter,
-                              std::vector<utf8_bitmap>& classes) {
-      std::vector<op*> resolve_list;
-      resolve_list.reserve(8);  // picked a magic number 64 bytes
-      resolve_list.emplace_back(nxt);
-      do {
-        if (list.test(resolve_list.back() - vec_start)) {
-          resolve_list.pop_back();
-          continue;
+  // the compiled regex, nothing in here is written to while matching so one
+  // program can be shared between any number of threads (hold it through a
+  // std::shared_ptr<const program>), each thread bringing its own match_state
+  struct program {
+    program(const std::string& regex)
+        : pattern(regex),
+          prog(),
+          prog_ruin(),
+          prog_ruin_start(),
+          classes(),
+          regex_chars(),
+          save_points() {
+      compile(regex);
+      create_prog_ruin();
+      create_literal_runs();
+      closures.build(prog, 0);
+      ruin_closures.build(prog_ruin, prog_ruin_start);
+      create_byte_classes();
+      create_prefilter();
+      create_glushkov();
+      reverse = std::make_unique<const program>(*this, reversed_t{});
+    }
+    // a set of regexes in one program, tried in order after a chain of SPLIT
+    // ops, the MATCH op of regexes[k] holds k, capture slots are shared
+    program(const std::vector<std::string>& regexes)
+        : prog(),
+          prog_ruin(),
+          prog_ruin_start(),
+          classes(),
+          regex_chars(),
+          save_points() {
+      if (regexes.size() == 0) {
+        throw std::invalid_argument(
+            "simple_regex::nfa_vm::program, empty regex set");
+      }
+      std::vector<std::unique_ptr<program>> parts;
+      size_t total = regexes.size() - 1;
+      for (const auto& r : regexes) {
+        pattern += parts.size() ? "|" + r : r;
+        parts.emplace_back(std::make_unique<program>(r));
+        total += (*parts.back()).prog.size();
+      }
+      if (total >= op::none) {
+        throw std::invalid_argument(
+            "simple_regex::nfa_vm::program, regex set too large");
+      }
+      prog.reserve(total);
+      for (uint32_t k = 0; k + 1 < parts.size(); ++k) {
+        prog.emplace_back(op(op::optype::SPLIT, 0));
+      }
+      std::vector<uint32_t> starts;
+      for (uint32_t k = 0; k < parts.size(); ++k) {
+        const program& part = *parts[k];
+        const uint32_t base = prog.size();
+        starts.emplace_back(base);
+        for (auto o : part.prog) {
+          if (o.lb != op::none) {
+            o.lb += base;
+          }
+          if (o.rb != op::none) {
+            o.rb += base;
+          }
+          if (o.opt == op::optype::CLASS) {
+            o.data += classes.size();
+          } else if (o.opt == op::optype::MATCH) {
+            o.data = k;
+          } else if (o.opt == op::optype::COUNT) {
+            o.data += counters.size();
+          }
+          prog.emplace_back(o);
         }
-        list.insert(resolve_list.back() - vec_start);
-        auto& op = *resolve_list.back();
-        if (op.opt == op::optype::SPLIT) {
-          resolve_list.emplace_back(op.lb);
-          resolve_list.emplace_back(op.rb);
-        } else {
-          if (op.opt == op::optype::CHAR) {
-            filter.insert_rev4byte(op.data);
-          } else if (op.opt == op::optype::SPLIT) {
-            filter |= classes[op.data];
+        for (auto r : part.counters) {
+          r.first += count_of.size();
+          r.word += count_words;
+          if (r.atom.opt == op::optype::CLASS) {
+            r.atom.data += classes.size();
           }
-          resolve_list.pop_back();
+          counters.emplace_back(r);
         }
-
-      } while (resolve_list.size());
-    }
-    static void resolve_split(hybrid_set& list, op* nxt, op* vec_start) {
-      std::vector<op*> resolve_list;
-      resolve_list.reserve(8);  // picked a magic number 64 bytes
-      resolve_list.emplace_back(nxt);
-      do {
-        if (list.test(resolve_list.back() - vec_start)) {
-          resolve_list.pop_back();
+        for (auto j : part.count_of) {
+          count_of.emplace_back(j + counters.size() - part.counters.size());
+        }
+        count_words += part.count_words;
+        classes.insert(classes.end(), part.classes.begin(), part.classes.end());
+        regex_chars |= part.regex_chars;
+        save_points = std::max(save_points, part.save_points);
+      }
+      for (uint32_t k = 0; k + 1 < parts.size(); ++k) {
+        prog[k].lb = starts[k];
+        prog[k].rb = (k + 2 < parts.size()) ? k + 1 : starts[k + 1];
+      }
+      patterns = regexes.size();
+      create_prog_ruin();
+      create_literal_runs();
+      closures.build(prog, 0);
+      ruin_closures.build(prog_ruin, prog_ruin_start);
+      create_byte_classes();
+      create_prefilter();
+      create_glushkov();
+      reverse = std::make_unique<const program>(*this, reversed_t{});
+    }
+    // the reverse of fwd, it matches the reversed strings, only prog_ruin is
+    // set: op k mirrors consuming op k of fwd and leads to the ops that can
+    // come before it or to MATCH when op k can start a match of fwd, started
+    // from the ops that can end a match
+    struct reversed_t {};
+    program(const program& fwd, reversed_t)
+        : prog(),
+          prog_ruin(),
+          prog_ruin_start(),
+          classes(fwd.classes),
+          regex_chars(fwd.regex_chars),
+          save_points(),
+          counters(fwd.counters),
+          count_of(fwd.count_of),
+          count_words(fwd.count_words) {
+      const auto& fo = fwd.prog_ruin;
+      const auto& cl = fwd.ruin_closures;
+      const uint32_t n = fo.size();
+      uint32_t final_op = 0;
+      for (uint32_t k = 0; k < n; ++k) {
+        if (fo[k].opt == op::optype::MATCH) {
+          final_op = k;
+          break;
+        }
+      }
+      // to[k] what follows op k in reverse, to[n] the reverse start
+      std::vector<std::vector<uint32_t>> to(n + 1);
+      auto consumes = [&](uint32_t k) {
+        return (fo[k].opt == op::optype::CHAR) ||
+               (fo[k].opt == op::optype::CLASS) ||
+               (fo[k].opt == op::optype::ANY) ||
+               (fo[k].opt == op::optype::COUNT);
+      };
+      for (uint32_t k = 0; k < n; ++k) {
+        if (!consumes(k)) {
           continue;
         }
-        list.insert(resolve_list.back() - vec_start);
-        auto& op = *resolve_list.back();
-        if (op.opt == op::optype::SPLIT) {
-          resolve_list.emplace_back(op.lb);
-          resolve_list.emplace_back(op.rb);
-        } else {
-          resolve_list.pop_back();
+        const uint32_t after = fo[k].lb;
+        for (auto e = cl.begin(after); e != cl.end(after); ++e) {
+          to[consumes(e->op) ? e->op : n].emplace_back(k);
+        }
+      }
+      for (auto e = cl.begin(fwd.prog_ruin_start);
+           e != cl.end(fwd.prog_ruin_start); ++e) {
+        to[consumes(e->op) ? e->op : n].emplace_back(final_op);
+      }
+      size_t total = n + 1;
+      for (const auto& t : to) {
+        total += t.size() ? t.size() - 1 : 0;
+      }
+      prog_ruin.reserve(total);
+      prog_ruin.resize(n + 1);
+      const uint32_t dead = n;  // a SPLIT going nowhere, its closure is empty
+      prog_ruin[dead] = op(op::optype::SPLIT, 0, dead, dead);
+      // a SPLIT chain over the ops of t
+      auto chain = [&](const std::vector<uint32_t>& t) {
+        if (t.size() == 0) {
+          return dead;
+        }
+        uint32_t head = t.back();
+        for (size_t j = t.size() - 1; j-- > 0;) {
+          prog_ruin.emplace_back(op(op::optype::SPLIT, 0, t[j], head));
+          head = prog_ruin.size() - 1;
         }
-      } while (resolve_list.size());
+        return head;
+      };
+      for (uint32_t k = 0; k < n; ++k) {
+        prog_ruin[k] = consumes(k) ? op(fo[k].opt, fo[k].data)
+                       : (fo[k].opt == op::optype::MATCH)
+                           ? op(op::optype::MATCH, fo[k].data)
+                           : op(op::optype::SPLIT, 0, dead, dead);
+      }
+      for (uint32_t k = 0; k < n; ++k) {
+        if (consumes(k)) {
+          prog_ruin[k].lb = chain(to[k]);
+        }
+      }
+      prog_ruin_start = chain(to[n]);
+      ruin_closures.build(prog_ruin, prog_ruin_start);
+      std::memcpy(byte_class, fwd.byte_class, sizeof(byte_class));
+      byte_classes = fwd.byte_classes;
+      patterns = fwd.patterns;
+    }
+    program() = delete;
+    // owns its reverse, share one through a std::shared_ptr<const program>
+    // rather than copying
+    program(const program&) = delete;
+    program& operator=(const program&) = delete;
+
+    void print_classes() const {
+      std::cout << "Classes:" << std::endl;
+      for (auto i = 0; i < classes.size(); ++i) {
+        std::cout << "[" << i << "]" << "\t[" << classes[i] << "]"
+                  << std::endl;
+      }
     }
-    cache_element construct_next(uint32_t utf8, std::vector<op>& oplist,
-                                 std::vector<utf8_bitmap>& classes) {
-      cache_element new_ce{};
-      new_ce.ops.set_range(oplist.size());
-      for (uint32_t j = 0; j < ops.size(); ++j) {
-        auto& op = oplist[ops[j]];
-        switch (op.opt) {
-          default:
-            continue;
+
+    void print_oplist(const std::vector<op>& oplist) const {
+      std::cout << "Printing NFA ops" << std::endl;
+      std::cout << "--------------------------------" << std::endl;
+      for (auto i = 0; i < oplist.size(); ++i) {
+        std::string ch = "";
+        switch (oplist[i].opt) {
           case op::optype::CHAR:
-            if (utf8 == op.data) {
-              resolve_split(new_ce.ops, op.lb, oplist.data(), new_ce.filter,
-                            classes);
-            }
+            ch = uint32_revto_utf8(oplist[i].data);
+            std::cout << "[" << i << "]\t";
+            std::cout << ch;
+            std::cout << "\t\tjmp " << oplist[i].lb;
+            break;
+          case op::optype::MATCH:
+            std::cout << "[" << i << "]\t" << "match";
+            break;
+          case op::optype::SPLIT:
+            std::cout << "[" << i << "]\t" << "split";
+            std::cout << "\t\t" << oplist[i].lb << ", " << oplist[i].rb;
             break;
-          case op::optype::CLASS:
-            if (classes[op.data].test_rev4byte(utf8)) {
-            } else {
-              break;
-            }
           case op::optype::ANY:
-            resolve_split(new_ce.ops, op.lb, oplist.data(), new_ce.filter,
-                          classes);
+            std::cout << "[" << i << "]\t" << "any";
+            std::cout << "\t\tjmp " << oplist[i].lb;
             break;
-          case op::optype::MATCH:
-            ///??? idk ignore it?
+          case op::optype::SAVE:
+            std::cout << "[" << i << "]\t" << "save  " << oplist[i].data;
+            std::cout << "\t\tjmp " << oplist[i].lb;
             break;
+          case op::optype::CLASS:
+            std::cout << "[" << i << "]\t" << "class " << oplist[i].data;
+            std::cout << "\t\tjmp " << oplist[i].lb;
+            break;
+          case op::optype::COUNT: {
+            const auto& r = counters[oplist[i].data];
+            std::cout << "[" << i << "]\t" << "count " << oplist[i].data
+                      << " {" << r.min << "," << r.max << "}";
+            std::cout << "\t\tjmp " << oplist[i].lb;
+            break;
+          }
         }
+        std::cout << std::endl;
       }
-      return new_ce;
-    }
-    friend void swap(cache_element a, cache_element b) {
-      using namespace std;
-      swap(a.filter, b.filter);
-      swap(a.next_state, b.next_state);
-      swap(a.ops, b.ops);
-    }
-    utf8_bitmap filter;
-    utf8_ptrmap<cache_element>
-        next_state;  // use element at position 255 for everything not in filter
-                     // (usually nullptr unless wildcard)
-    hybrid_set ops;  // point to all the operations? incase we need to walk and
-                     // generate the next state its bitvector should also be the
-                     // key / tag of a cached_state
-  };
-  // note cache snaps to next power of two size
-  struct cache {
-    cache_element& operator[](uint32_t idx) {
-      return ring_buffer[(idx + start) & (size_less1)];
-    }
-    const cache_element& operator[](uint32_t idx) const {
-      return ring_buffer[(idx + start) & (size_less1)];
-    }
-    void pop() {
-      tree.erase(tree.find(this->operator[](0).ops));
-      start += 1;
-      start = start & size_less1;
-    }
-    void reset() {
-      start = 0;
-      end = 0;
-      tree.clear();
-    }
-    void push(cache_element& c) {
-      if (((end + 1) & size_less1) == start) {
-        pop();
-        overflow_c += 1;
-        if (overflow_c == overflow_lim) {
-          reset();
-          rebuild_c += 1;
-        }
-      }
-      tree.insert({c.ops, end});
-      ring_buffer[end] = c;
-      end += 1;
-      end = end & size_less1;
-    }
-    void push(cache_element&& c) {
-      if ((end + 1) == start) {
-        pop();
-        overflow_c += 1;
-        if (overflow_c == overflow_lim) {
-          reset();
-          rebuild_c += 1;
-        }
+      std::cout << "--------------------------------" << std::endl;
+      if (classes.size() != 0) {
+        print_classes();
+        std::cout << "--------------------------------" << std::endl;
       }
-      tree.insert({c.ops, end});
-      ring_buffer[end] = c;
-      end += 1;
-      end = end & size_less1;
-    }
-    // this also resets the cache!
-    void resize(uint32_t n) {
-      uint32_t log2_next_2pow = 32 - countl_zero(n + 1) - 1;
-      uint32_t new_size = 1 << log2_next_2pow;
-      ring_buffer.reserve(new_size);
-      ring_buffer.resize(new_size);
-      size_less1 = new_size - 1;
-      start = 0;
-      end = 0;
-      tree.clear();
     }
-    bool test(const hybrid_set& rep) { return tree.count(rep); }
-    cache_element& operator()(const hybrid_set& rep) {
-      return this->operator[](tree.find(rep)->second);
+
+    void print_prog() const { print_oplist(prog); }
+    void print_prog_ruin() const {
+      std::cout << "Starting op: " << prog_ruin_start << std::endl;
+      print_oplist(prog_ruin);
     }
-    template <bool Unanchored>
-    bool run(const std::string& s, uint32_t& i, std::vector<op>& oplist,
-             uint32_t st_op, std::vector<utf8_bitmap>& classes, int64_t& last) {
-      cache_element* current_cel = &strt;
-      if ((*current_cel).ops.test(oplist.size() - 1)) {
-        return true;
-      }
-      for (uint32_t idx = i; idx < s.size();) {
-        cache_element* nxt = (*current_cel).step(s, idx);
-        if (nxt) {
-          current_cel = nxt;
-        } else {
-          if (rebuild_lim == rebuild_c) {
-            idx += utf_bytes(s[idx]);
-            i = idx;
-            last = current_cel - &ring_buffer[start];
-            return false;
+
+    std::string pattern;  // as compiled, a set's joined by |
+    std::vector<op> prog;
+    std::vector<op> prog_ruin;  // prog without save op
+    uint32_t prog_ruin_start;   // track where the first instruction should be
+    std::vector<utf8_bitmap> classes;
+    utf8_bitmap regex_chars;
+    uint32_t save_points = 0;
+    // a counted repeat of one code point past max_unrolled_repeat is one
+    // COUNT op, counters[its data], instead of copies of its atom. A thread
+    // at the COUNT op has consumed none of the atom, one that consumed c of
+    // them (0 < c < max) is the thread id past the op list plus first + c - 1
+    // (threads are told apart by id in every engine, so threads at one
+    // repeat with different counts are different threads), consuming the
+    // atom once more takes a thread to the next count while below max and
+    // out of the repeat (the COUNT op's lb) once at min
+    struct counter {
+      op atom;       // CHAR, CLASS or ANY, its links unused
+      uint32_t min;  // at least 1, f{0,m} is (f{1,m})?
+      uint32_t max;
+      uint32_t first;    // index into count_of of count 1
+      uint32_t word;     // its counts' first word, see count_bits
+      uint32_t at;       // its COUNT op in prog
+      uint32_t ruin_at;  // and in prog_ruin
+    };
+    std::vector<counter> counters;
+    std::vector<uint32_t> count_of;  // the counter of each count past the ops
+    uint32_t count_words = 0;
+    byte byte_class[256];   // byte -> class id, see create_byte_classes
+    uint32_t byte_classes;  // number of classes
+    // what an unanchored search can skip ahead to, see create_prefilter
+    enum prefilter_kind : byte {
+      NONE,     // any byte could start a match
+      BYTE,     // every match starts with first_byte (memchr)
+      LITERAL,  // every match starts with prefix
+      BYTE_SET  // every match starts with a byte of first_bytes
+    };
+    prefilter_kind prefilter = NONE;
+    byte first_byte = 0;
+    std::string prefix;
+    byte_set first_bytes;
+    // with more start bytes than this a skip rarely gets far
+    static constexpr uint32_t byte_set_limit = 16;
+    uint32_t patterns = 1;  // regexes in the program, see the set constructor
+    // test's engine for a regex with at most 64 CHAR, CLASS and ANY ops in
+    // prog_ruin (positions, bit k for the k-th), the nfa state is one word:
+    // state = (follow(state) | start) & accept(code point), follow looked up a
+    // byte of state at a time so a step is branch free, see create_glushkov
+    struct glushkov {
+      bool usable = false;
+      bool nullable = false;        // the start reaches MATCH
+      uint32_t chunks = 0;          // bytes of state in use
+      uint64_t first = 0;           // positions the start leads to
+      uint64_t final = 0;           // positions followed by MATCH
+      uint64_t any = 0;             // ANY positions
+      uint64_t single[192];         // positions accepting each 1 byte cp
+      std::vector<uint64_t> follow;  // [256 * chunk + byte of state]
+      std::vector<uint32_t> ops;     // prog_ruin index of each position
+      std::vector<uint32_t> bit;     // position of each prog_ruin op, or -1
+    };
+    glushkov bits;
+    // a run of CHAR ops of prog each leading to the next as one literal, the
+    // backtracker compares it with memcmp, run_at[k] indexes the run CHAR op
+    // k starts (none if it doesn't start one), see create_literal_runs
+    struct literal_run {
+      uint32_t text;  // literals[text, text + bytes)
+      uint32_t bytes;
+      uint32_t next;  // the op after the run
+    };
+    std::vector<uint32_t> run_at;
+    std::vector<literal_run> runs;
+    std::string literals;
+
+    // epsilon closures worked out once so matching never follows SPLIT or
+    // SAVE ops: for each op a step (or the start) lands on, the ops it leads
+    // to that consume input or MATCH, in priority order (lb before rb), each
+    // with the slots the SAVE ops on its path record, the closure of op k is
+    // entries[start[k]..start[k + 1])
+    struct closure_table {
+      struct entry {
+        uint32_t op;
+        uint32_t saves;  // saves[saves..saves_end) of the table
+        uint32_t saves_end;
+      };
+      void build(const std::vector<op>& oplist, uint32_t first) {
+        std::vector<bool> target(oplist.size());
+        target[first] = true;
+        for (const auto& o : oplist) {
+          switch (o.opt) {
+            default:
+              break;
+            case op::optype::CHAR:
+            case op::optype::CLASS:
+            case op::optype::ANY:
+            case op::optype::COUNT:
+              target[o.lb] = true;
+              break;
           }
-          uint32_t i_c = idx;
-          uint32_t utf8 = get_utf8_n_inc(s, i_c);
-          // this should be checking the cache to see if it is there and tying
-          // things up
-          auto tmp = (*current_cel).construct_next(utf8, oplist, classes);
-          if (test(tmp.ops)) {
-            cache_element* pos = &(this->operator()(tmp.ops));
-            if ((*current_cel).filter.test(utf8)) {
-              (*current_cel).next_state.add_rev4byte_el(utf8, pos);
-            } else {
-              (*current_cel).next_state.add_element(255, pos);
+        }
+        std::vector<uint32_t> seen(oplist.size(), UINT32_MAX);
+        std::vector<std::pair<uint32_t, uint32_t>> todo;  // op, path length
+        std::vector<uint32_t> path;  // slots of the SAVE ops on the way down
+        start.assign(oplist.size() + 1, 0);
+        for (uint32_t k = 0; k < oplist.size(); ++k) {
+          start[k] = entries.size();
+          if (!target[k]) {
+            continue;
+          }
+          todo.emplace_back(k, 0);
+          while (todo.size()) {
+            const auto [j, depth] = todo.back();
+            todo.pop_back();
+            path.resize(depth);
+            const op* o = &oplist[j];
+            if (seen[j] == k) {
+              continue;
             }
-            current_cel = pos;
-          } else {
-            push(std::move(tmp));
-            auto pos = &ring_buffer[((end - 1) & size_less1)];
-            if ((*current_cel).filter.test(utf8)) {
-              (*current_cel).next_state.add_rev4byte_el(utf8, pos);
-            } else {
-              (*current_cel).next_state.add_element(255, pos);
+            seen[j] = k;
+            switch (o->opt) {
+              case op::optype::SPLIT:
+                todo.emplace_back(o->rb, depth);
+                todo.emplace_back(o->lb, depth);
+                break;
+              case op::optype::SAVE:
+                path.emplace_back(o->data);
+                todo.emplace_back(o->lb, depth + 1);
+                break;
+              default:
+                entries.push_back({j, static_cast<uint32_t>(saves.size()),
+                                   static_cast<uint32_t>(saves.size() +
+                                                         path.size())});
+                saves.insert(saves.end(), path.begin(), path.end());
+                break;
             }
-            current_cel = pos;
           }
         }
-        if ((*current_cel).ops.test(oplist.size() - 1)) {
-          idx += utf_bytes(s[idx]);
-          i = idx;
-          return true;
-        }
-        if constexpr (Unanchored) {
-          cache_element::resolve_split((*current_cel).ops, &oplist[st_op],
-                                       oplist.data(), (*current_cel).filter,
-                                       classes);
-        }
-        idx += utf_bytes(s[idx]);
-        i = idx;
+        start[oplist.size()] = entries.size();
+      }
+      const entry* begin(uint32_t k) const { return entries.data() + start[k]; }
+      const entry* end(uint32_t k) const {
+        return entries.data() + start[k + 1];
       }
-      last = -1;
-      return false;
-    }
 
-    void init_s(std::vector<op>& oplist, uint32_t st_op,
-                std::vector<utf8_bitmap>& classes) {
-      strt = cache_element{};
-      strt.ops.set_range(oplist.size());
-      cache_element::resolve_split(strt.ops, &oplist[st_op], oplist.data(),
-                                   strt.filter, classes);
-    }
-    uint32_t start;
-    uint32_t end;         // start and end track what is initialised
-    uint32_t size_less1;  // power of two size
-    uint32_t overflow_lim = 5;
-    uint32_t rebuild_lim = 5;
-    uint32_t overflow_c = 0;
-    uint32_t rebuild_c = 0;
-    cache_element strt;
-    std::vector<cache_element> ring_buffer;
-    std::map<hybrid_set, uint32_t, hybrid_set_comp> tree;
-  };
+      std::vector<uint32_t> start;
+      std::vector<entry> entries;
+      std::vector<uint32_t> saves;
+    };
+    closure_table closures;       // of prog
+    closure_table ruin_closures;  // of prog_ruin, no saves
+    // finds where matches start, see match
+    std::unique_ptr<const program> reverse;
 
- protected:
-  uint opt_precedence(char c) {
-    switch (c) {
-      case '\\':
-        return 100;
-      case '(':
-        return 90;
-      case '[':
-        return 80;
-      case '?':
-      case '*':
-      case '+':
-        return 70;
-      case 0:
-        return 60;
-      case '|':
-        return 50;
-      default:
-        std::string err_msg = "Invalid argument:";
-        err_msg.push_back(c);
-        err_msg += " to simple_regex::nfa_vm::opt_precendence";
-        throw std::invalid_argument(err_msg);
-        return 0;
+    // inserts the closure of prog_ruin[k] into list
+    void add_closure(hybrid_set& list, uint32_t k) const {
+      for (auto e = ruin_closures.begin(k); e != ruin_closures.end(k); ++e) {
+        list.test_insert(e->op);
+      }
     }
-  }
-
-  void compile_char(std::string& processed, uint32_t& ret_idx) {
-    if (processed[ret_idx] == '.') {
-      prog.emplace_back(op(op::optype::ANY, 0, nullptr));
-    } else {
-      uint32_t utf8_char = get_utf8_n_inc(processed, ret_idx);
-      regex_chars.insert_rev4byte(utf8_char);
-      prog.emplace_back(op(op::optype::CHAR, utf8_char, nullptr));
-    };
-    f_stack.emplace_back(prog.back());
-  }
 
-  void pop_stack_presedence(byte c, std::string& optstack,
-                            std::string& processed) {
-    while (true) {
-      if (optstack.size() == 0) {
-        optstack += c;
-        return;
-      }  // everything is left associative
-      if ((opt_precedence(c) > opt_precedence(optstack.back())) ||
-          (optstack.back() == '(')) {
-        optstack += c;
+    // thread ids of prog and of prog_ruin, the ops and then the counts
+    uint32_t threads() const { return prog.size() + count_of.size(); }
+    uint32_t ruin_threads() const {
+      return prog_ruin.size() + count_of.size();
+    }
+    // the counter and count of thread k of oplist (prog or prog_ruin), a
+    // COUNT op or one past the ops
+    std::pair<uint32_t, uint32_t> count_at(const std::vector<op>& oplist,
+                                         uint32_t k) const {
+      if (k < oplist.size()) {
+        return {oplist[k].data, 0};
+      }
+      const uint32_t j = count_of[k - oplist.size()];
+      return {j, k - oplist.size() - counters[j].first + 1};
+    }
+    // the code point op o consumes with, o itself but for COUNT
+    const op& atom_of(const op& o) const {
+      return (o.opt == op::optype::COUNT) ? counters[o.data].atom : o;
+    }
+    // whether code point op o (CHAR, CLASS or ANY) consumes utf8
+    bool takes(const op& o, uint32_t utf8) const {
+      switch (o.opt) {
+        case op::optype::CHAR:
+          return o.data == utf8;
+        case op::optype::CLASS:
+          return classes[o.data].test_rev4byte(utf8);
+        default:
+          return true;
+      }
+    }
+    // the counts of counter r bit parallel: bit c of words w set when a thread
+    // consumed c of its atoms, moved past code point utf8 (shifted up one or
+    // cleared), true when a count reached min, used is the number of low
+    // words that can hold a set bit (0 once none does)
+    bool count_bits(uint64_t* w, const counter& r, uint32_t utf8,
+                    uint32_t& used) const {
+      if (!takes(r.atom, utf8)) {
+        std::fill(w, w + used, 0);
+        used = 0;
+        return false;
+      }
+      // the counts at min or past it leave, then all move up one
+      const uint32_t words = (r.max + 63) / 64;
+      const uint32_t n = std::min(used + 1, words);
+      const uint32_t lo = r.min - 1;
+      uint64_t out = (lo / 64 < n) ? w[lo / 64] >> (lo % 64) : 0;
+      for (uint32_t k = lo / 64 + 1; k < n; ++k) {
+        out |= w[k];
+      }
+      for (uint32_t k = n - 1; k > 0; --k) {
+        w[k] = (w[k] << 1) | (w[k - 1] >> 63);
+      }
+      w[0] <<= 1;
+      if ((n == words) && (r.max % 64)) {
+        w[words - 1] &= (uint64_t(1) << (r.max % 64)) - 1;
+      }
+      used = n;
+      while (used && !w[used - 1]) {
+        --used;
+      }
+      return out != 0;
+    }
+    // moves prog_ruin thread k, in a counted repeat, past code point utf8
+    // into list: on to the next count while below max (first, the repeat is
+    // greedy) and into the closure after the repeat once at min
+    void count_step(hybrid_set& list, uint32_t k, uint32_t utf8) const {
+      const auto [j, c] = count_at(prog_ruin, k);
+      const counter& r = counters[j];
+      if (!takes(r.atom, utf8)) {
         return;
-      } else {
-        processed += optstack.back();
-        optstack.pop_back();
+      }
+      if (c + 1 < r.max) {
+        list.test_insert(prog_ruin.size() + r.first + c);
+      }
+      if (c + 1 >= r.min) {
+        add_closure(list, prog_ruin[r.ruin_at].lb);
       }
     }
-  }
 
-  // add in implicit concatenation operators with null
-  void tokenise(const std::string& regex, std::string& tokenised) {
-    tokenised = "";
-    tokenised.reserve(regex.size() * 2);
-    for (auto i = 0; i < regex.size(); ++i) {
-      // ignore all nulls in a string, what the hell is it doing here
-      if (regex[i] == 0) {
-        continue;
-      }
-      if (regex[i] == '[') {
-        while (regex[i] != ']') {
-          tokenised += regex[i];
-          ++i;
-          if (i == regex.size()) {
-            throw std::invalid_argument(
-                "simple_regex::nfa_vm, stray ] in regex");
-          }
+    // adds the pattern ids of the MATCH ops among ops (prog_ruin indices) to
+    // hits, true once every pattern is in hits
+    template <typename List>
+    bool collect(const List& ops, hybrid_set& hits) const {
+      for (uint32_t j = 0; j < ops.size(); ++j) {
+        if (ops[j] >= prog_ruin.size()) {
+          continue;  // a count
+        }
+        const auto& o = prog_ruin[ops[j]];
+        if (o.opt == op::optype::MATCH) {
+          hits.test_insert(o.data);
         }
       }
-      byte n;
-      switch (utf_bytes(regex[i])) {
+      return hits.size() == patterns;
+    }
+
+    // first position at or after from where a match could start, s.size() if
+    // there's none (or where a literal cut off by the end of s could start,
+    // the rest of it might come in the next chunk of a stream), the bytes
+    // skipped over aren't checked for valid utf8
+    size_t next_candidate(std::string_view s, size_t from) const {
+      return next_candidate(prefilter, first_byte, prefix, s, from,
+                            &first_bytes);
+    }
+    static size_t next_candidate(prefilter_kind prefilter, byte first_byte,
+                                 std::string_view prefix, std::string_view s,
+                                 size_t from,
+                                 const byte_set* first_bytes = nullptr) {
+      switch (prefilter) {
         default:
-          tokenised += regex[i];
-          break;
-        case 2:
-          if ((i < (regex.size() - 1))) {
-            tokenised += regex[i];
-            tokenised += regex[i + 1];
-            i += 1;
-          } else {
-            error_invalid_utf8(
-                "simple_regex::nfa_vm, constructor passed invalid "
-                "utf8");
+          return from;
+        case BYTE_SET:
+          return (from >= s.size()) ? s.size() : first_bytes->find(s, from);
+        case BYTE: {
+          if (from >= s.size()) {
+            return s.size();
           }
-          break;
-        case 3:
-          if (i < (regex.size() - 2)) {
-            tokenised += regex[i];
-            tokenised += regex[i + 1];
-            tokenised += regex[i + 2];
-            i += 2;
-          } else {
-            error_invalid_utf8(
-                "simple_regex::nfa_vm, constructor passed invalid "
-                "utf8");
+          const void* p =
+              std::memchr(s.data() + from, first_byte, s.size() - from);
+          return p ? static_cast<const char*>(p) - s.data() : s.size();
+        }
+        case LITERAL: {
+          if (from >= s.size()) {
+            return s.size();
           }
-          break;
-        case 4:
-          if (i < (regex.size() - 3)) {
-            tokenised += regex[i];
-            tokenised += regex[i + 1];
-            tokenised += regex[i + 2];
-            tokenised += regex[i + 3];
-            i += 3;
-          } else {
-            error_invalid_utf8(
-                "simple_regex::nfa_vm, constructor passed invalid "
-                "utf8");
+          size_t p = s.find(prefix, from);
+          if (p == std::string_view::npos) {
+            p = (s.size() - from >= prefix.size())
+                    ? s.size() + 1 - prefix.size()
+                    : from;
+            while ((p > from) && utf_cont(s[p])) {
+              --p;
+            }
           }
-          break;
+          return p;
+        }
       }
-      n = peek_next(regex, i);
-      if ((regex[i] == '|') || (regex[i] == '(')) {
-        continue;
+    }
+
+   protected:
+    // compilation, a recursive descent writing the nfa straight into prog
+    // (Thompson's construction): an alternation is concatenations separated
+    // by |, a concatenation is repeats, a repeat is an atom followed by any
+    // number of * + ? {n} {n,} {n,m}, an atom is a code point, a \ escaped
+    // one, ., a class or a group, group k (numbered by its '(' from 1) saves
+    // slots 2k and 2k + 1, prog is reserved once for ops_bound
+    void compile(const std::string& regex) {
+      const size_t bound = ops_bound(regex.data(), regex.size());
+      if (bound > max_ops) {
+        throw std::invalid_argument(
+            "simple_regex::nfa_vm, regex too large (counted repeats)");
       }
-      if ((regex[i] == '\\') && n) {
-        ++i;
-        tokenised += regex[i];
+      prog.reserve(bound + 4);
+      prog.emplace_back(op(op::optype::SAVE, 0));
+      save_points = 2;
+      uint32_t i = 0;
+      nfa_frag f = parse_alt(regex, i, 0);
+      if (i != regex.size()) {
+        throw std::invalid_argument("simple_regex::nfa_vm, stray ) in regex");
       }
-      if (n && (n != ')') && (n != '|') && (n != '*') && (n != '+') &&
-          (n != '?')) {
-        tokenised.push_back(0);
+      prog[0].lb = f.sp;
+      prog.emplace_back(op(op::optype::SAVE, 1));
+      patch(f, prog.size() - 1);
+      prog.emplace_back(op(op::optype::MATCH, 0));
+      prog[prog.size() - 2].lb = prog.size() - 1;
+      optimize(prog, 0);  // op 0 is the SAVE it starts on, it stays
+    }
+    static constexpr uint32_t max_depth = max_group_depth;
+    // counted repeats are expanded (or counted), a regex compiling to more
+    // ops, or to more counts, is rejected
+    static constexpr size_t max_ops = 1 << 16;
+
+    nfa_frag parse_alt(const std::string& s, uint32_t& i, uint32_t depth) {
+      nfa_frag f = parse_concat(s, i, depth);
+      while ((i < s.size()) && (s[i] == '|')) {
+        ++i;
+        nfa_frag g = parse_concat(s, i, depth);
+        prog.emplace_back(op(op::optype::SPLIT, 0, f.sp, g.sp));
+        fuse(f, g);
+        f.sp = prog.size() - 1;
       }
+      return f;
     }
-  }
-
-  // not exactly shunting yard
-  void nearly_shunting_yard(const std::string& tokenised,
-                            std::string& processed) {
-    std::string operator_stack = "";
-    processed = "";
-    operator_stack.reserve(tokenised.size());
-    processed.reserve(tokenised.size());
-    bool atom = false;
-    char p = 0;
-    for (auto i = 0; i < tokenised.size(); ++i) {
-      switch (tokenised[i]) {
-        case '\\':
-          processed += tokenised[i];
+    nfa_frag parse_concat(const std::string& s, uint32_t& i, uint32_t depth) {
+      nfa_frag f = parse_repeat(s, i, depth);
+      while ((i < s.size()) && (s[i] != '|') && (s[i] != ')')) {
+        join(f, parse_repeat(s, i, depth));
+      }
+      return f;
+    }
+    nfa_frag parse_repeat(const std::string& s, uint32_t& i, uint32_t depth) {
+      const uint32_t first = prog.size();
+      nfa_frag f = parse_atom(s, i, depth);
+      while (i < s.size()) {
+        const char c = s[i];
+        if ((c == '*') || (c == '+') || (c == '?')) {
+          suffix(f, c);
           ++i;
-          processed += tokenised[i];
-          break;
-        case '(':
-          processed += tokenised[i];
-          operator_stack += tokenised[i];
-          break;
-        case ')':
-          p = tokenised[i];
-          // processed += tokenised[i];
-          while (operator_stack.back() != '(') {
-            processed += operator_stack.back();
-            operator_stack.pop_back();
-            if (operator_stack.size() == 0) {
-              throw std::invalid_argument(
-                  "simple_regex::nfa_vm, stray ) in regex");
-            }
-          }
-          processed += p;
-          operator_stack.pop_back();
-          break;
-        case '[':
-          while (tokenised[i] != ']') {
-            processed += tokenised[i];
-            ++i;
-            if (i == tokenised.size()) {
-              throw std::invalid_argument(
-                  "simple_regex::nfa_vm, stray ] in regex");
-            }
-          }
-          processed += tokenised[i];
-          break;
-        case ']':
-          throw std::invalid_argument("simple_regex::nfa_vm, stray ] in regex");
-          break;
-        case '?':
-        case '*':
-        case '+':
-        case 0:
-        case '|':
-          pop_stack_presedence(tokenised[i], operator_stack, processed);
-          break;
-        default:
-          switch (utf_bytes(tokenised[i])) {
-            default:
-              processed += tokenised[i];
-              break;
-            case 2:
-              if ((i < (tokenised.size() - 1))) {
-                processed += tokenised[i];
-                processed += tokenised[i + 1];
-                i += 1;
-              } else {
-                error_invalid_utf8(
-                    "simple_regex::nfa_vm, constructor passed invalid "
-                    "utf8");
-              }
-              break;
-            case 3:
-              if (i < (tokenised.size() - 2)) {
-                processed += tokenised[i];
-                processed += tokenised[i + 1];
-                processed += tokenised[i + 2];
-                i += 2;
-              } else {
-                error_invalid_utf8(
-                    "simple_regex::nfa_vm, constructor passed invalid "
-                    "utf8");
-              }
-              break;
-            case 4:
-              if (i < (tokenised.size() - 3)) {
-                processed += tokenised[i];
-                processed += tokenised[i + 1];
-                processed += tokenised[i + 2];
-                processed += tokenised[i + 3];
-                i += 3;
-              } else {
-                error_invalid_utf8(
-                    "simple_regex::nfa_vm, constructor passed invalid "
-                    "utf8");
-              }
-              break;
-          }
+          continue;
+        }
+        uint32_t n = 0;
+        uint32_t m = 0;
+        bool inf = false;
+        size_t j = i;
+        if ((c != '{') || !repeat_count(s.data(), s.size(), j, n, m, inf)) {
           break;
+        }
+        i = j;
+        f = counted(f, first, n, m, inf);
       }
+      return f;
+    }
+    // f followed by g
+    void join(nfa_frag& f, const nfa_frag& g) {
+      patch(f, g.sp);
+      f.start = g.start;
+      f.end = g.end;
+    }
+    // f*, f+ or f?
+    void suffix(nfa_frag& f, char c) {
+      const uint32_t k = prog.size();
+      prog.emplace_back(op(op::optype::SPLIT, 0, f.sp));
+      const uint32_t skip = 2 * k + 1;  // its rb
+      if (c == '?') {
+        // the skip is one more dangling exit
+        set_exit(f.end, skip);
+        f.end = skip;
+        f.sp = k;
+        return;
+      }
+      patch(f, k);
+      if (c == '*') {
+        f.sp = k;
+      }
+      f.start = skip;
+      f.end = skip;
+    }
+    // f{n}, f{n,} or f{n,m} where f is prog[first, ...), expanded into copies
+    // of f so the glushkov sets run it as they are: f{n,} is n - 1 copies
+    // then f+ (f* for n = 0), f{n,m} is n copies then m - n optional ones
+    // nested as (f(f(f)?)?)? so a skip leaves all the rest behind in one
+    // SPLIT. Past max_unrolled_repeat a code point f is counted instead, one
+    // COUNT op (see counter) in place of f: f{n,m} counts to m (and is
+    // optional for n = 0), f{n,} counts to n then has f*
+    nfa_frag counted(nfa_frag f, uint32_t first, uint32_t n, uint32_t m,
+                     bool inf) {
+      const op o = prog[first];
+      const bool single = (prog.size() == first + 1) &&
+                          ((o.opt == op::optype::CHAR) ||
+                           (o.opt == op::optype::CLASS) ||
+                           (o.opt == op::optype::ANY));
+      if (single && ((inf ? n : m) > max_unrolled_repeat)) {
+        const op atom(o.opt, o.data);
+        prog[first] = op(op::optype::COUNT,
+                         new_counter(atom, std::max(n, 1u), inf ? n : m));
+        if (inf) {
+          prog.emplace_back(atom);
+          nfa_frag g = nfa_frag::single(prog.size() - 1);
+          suffix(g, '*');
+          join(f, g);
+        } else if (n == 0) {
+          suffix(f, '?');
+        }
+        return f;
+      }
+      const uint32_t copies = inf ? std::max(n, 1u) : m;
+      if (copies == 0) {
+        // f{0} matches the empty string, a SPLIT with both exits dangling
+        prog.erase(prog.begin() + first, prog.end());
+        const uint32_t k = prog.size();
+        prog.emplace_back(op(op::optype::SPLIT, 0, 2 * k + 1));
+        return nfa_frag(k, 2 * k, 2 * k + 1);
+      }
+      // every copy is taken before any is patched
+      const uint32_t last = prog.size();
+      std::vector<nfa_frag> c(1, f);
+      for (uint32_t k = 1; k < copies; ++k) {
+        c.emplace_back(clone(f, first, last));
+      }
+      const uint32_t fixed = inf ? copies - 1 : n;
+      if (inf) {
+        suffix(c.back(), n ? '+' : '*');
+      } else if (fixed < copies) {
+        suffix(c.back(), '?');
+        for (uint32_t k = copies - 1; k-- > fixed;) {
+          join(c[k], c[k + 1]);
+          suffix(c[k], '?');
+        }
+      }
+      const uint32_t parts = std::min(fixed + 1, copies);
+      for (uint32_t k = 1; k < parts; ++k) {
+        join(c[0], c[k]);
+      }
+      return c[0];
+    }
+    // appends a copy of prog[first, last) holding fragment f, links into
+    // the range moved with it, the dangling exits' by as many exits
+    nfa_frag clone(const nfa_frag& f, uint32_t first, uint32_t last) {
+      const uint32_t delta = prog.size() - first;
+      std::vector<bool> dangling(2 * (last - first));
+      for (uint32_t e = f.start; e != op::none; e = exit_link(e)) {
+        dangling[e - 2 * first] = true;
+      }
+      auto move = [&](uint32_t e, uint32_t to) {
+        if (to == op::none) {
+          return to;
+        }
+        if (dangling[e - 2 * first]) {
+          return to + 2 * delta;
+        }
+        return ((to >= first) && (to < last)) ? to + delta : to;
+      };
+      for (uint32_t k = first; k < last; ++k) {
+        op o = prog[k];
+        o.lb = move(2 * k, o.lb);
+        o.rb = move(2 * k + 1, o.rb);
+        if (o.opt == op::optype::COUNT) {
+          // its own counts, a thread id belongs to one op
+          const counter r = counters[o.data];
+          o.data = new_counter(r.atom, r.min, r.max);
+        }
+        prog.emplace_back(o);
+      }
+      return nfa_frag(f.sp + delta, f.start + 2 * delta, f.end + 2 * delta);
     }
-    while (operator_stack.size()) {
-      processed += operator_stack.back();
-      operator_stack.pop_back();
-    }
-  }
-
-  // patch nfa fragments, Thompson's algorithm
-  void patch(nfa_frag nfa_frag, op* pos) {
-    op* next = *nfa_frag.start;
-    op** tmp;
-    *nfa_frag.start = pos;
-    while (next != nullptr) {
-      std::memcpy(&tmp, &next, sizeof(tmp));
-      next = *tmp;
-      *tmp = pos;
-    }
-  }
-
-  // link these two linked lists
-  void fuse(nfa_frag f1, nfa_frag f2) {
-    op** tmp = f2.start;
-    std::memcpy(&(*(f1.end)), &tmp, sizeof(tmp));
-    f1.end = f2.end;
-  }
-
-  // compile the not quite postfix notation regex
-  void compile_nfa_sg(std::string& processed) {
-    prog.reserve(processed.size() + 4);
-    uint32_t lsave = 2;
-    uint32_t rsave = 3;
-    uint32_t class_c = 0;
-    prog.emplace_back(op(op::optype::SAVE, save_points, nullptr));
-    save_points += 2;
-    f_stack.emplace_back(prog.back());
-    int64_t f1, f2;
-    op** tmp;
-    for (uint32_t i = 0; i < processed.size(); ++i) {
-      // std::cout << "iteration:" << i << " " << processed[i] << std::endl;
-      switch (processed[i]) {
-        case '\\':
-          if (peek_next(processed, i)) {
-            ++i;
-            compile_char(processed, i);
+    // the counter of a new COUNT op, see counter
+    uint32_t new_counter(const op& atom, uint32_t min, uint32_t max) {
+      if (count_of.size() + max > max_ops) {
+        throw std::invalid_argument(
+            "simple_regex::nfa_vm, regex too large (counted repeats)");
+      }
+      const uint32_t j = counters.size();
+      counters.push_back({atom, min, max,
+                          static_cast<uint32_t>(count_of.size()), count_words,
+                          op::none, op::none});
+      count_of.insert(count_of.end(), max - 1, j);
+      count_words += (max + 63) / 64;
+      return j;
+    }
+    nfa_frag parse_atom(const std::string& s, uint32_t& i, uint32_t depth) {
+      if (i == s.size()) {
+        throw std::invalid_argument(
+            "simple_regex::nfa_vm, operator without an operand in regex");
+      }
+      switch (s[i]) {
+        case '(': {
+          if (depth == max_depth) {
+            throw std::invalid_argument(
+                "simple_regex::nfa_vm, groups nested too deep in regex");
           }
-          break;
-        case '(':
-          prog.emplace_back(op(op::optype::SAVE, lsave, nullptr));
-          f1 = f_stack.size() - 1;
-          patch(f_stack[f1], &prog.back());
-          tmp = &(prog.back().lb);
-          f_stack[f1].start = tmp;
-          f_stack[f1].end = tmp;
-          lsave += 2;
-          break;
-        case ')':
-          prog.emplace_back(op(op::optype::SAVE, rsave, nullptr));
-          f1 = f_stack.size() - 1;
-          patch(f_stack[f1], &prog.back());
-          tmp = &(prog.back().lb);
-          f_stack[f1].start = tmp;
-          f_stack[f1].end = tmp;
-          rsave += 2;
-          break;
-        case '[':
+          const uint32_t slot = save_points;
+          save_points += 2;
+          const uint32_t open = prog.size();
+          prog.emplace_back(op(op::optype::SAVE, slot));
           ++i;
-          classes.emplace_back(char_class(processed, i, i));
-          prog.emplace_back(op(op::optype::CLASS, class_c, nullptr));
-          regex_chars |= classes[class_c];
-          f_stack.emplace_back(prog.back());
-          ++class_c;
-          break;
+          nfa_frag f = parse_alt(s, i, depth + 1);
+          if ((i == s.size()) || (s[i] != ')')) {
+            throw std::invalid_argument(
+                "simple_regex::nfa_vm, stray ( in regex");
+          }
+          ++i;
+          prog[open].lb = f.sp;
+          prog.emplace_back(op(op::optype::SAVE, slot + 1));
+          patch(f, prog.size() - 1);
+          nfa_frag g = nfa_frag::single(prog.size() - 1);
+          g.sp = open;
+          return g;
+        }
+        case '[': {
+          uint32_t utf8 = 0;
+          if (lone_member(s, i, utf8)) {
+            // [x] is x
+            regex_chars.insert_rev4byte(utf8);
+            prog.emplace_back(op(op::optype::CHAR, utf8));
+            return nfa_frag::single(prog.size() - 1);
+          }
+          classes.emplace_back(char_class(s, i + 1, i));
+          ++i;
+          prog.emplace_back(op(op::optype::CLASS, classes.size() - 1));
+          regex_chars |= classes.back();
+          return nfa_frag::single(prog.size() - 1);
+        }
+        case '.':
+          ++i;
+          prog.emplace_back(op(op::optype::ANY, 0));
+          return nfa_frag::single(prog.size() - 1);
         case ']':
-          throw std::invalid_argument("simple_regex::nfa_vm, stray ] in regex");
-          break;
-        case '?':
-          f1 = f_stack.size() - 1;
-          prog.emplace_back(op(op::optype::SPLIT, 0, f_stack[f1].sp, nullptr));
-          tmp = &(prog.back().rb);
-          std::memcpy(&(*f_stack[f1].end), &tmp, sizeof(tmp));
-          f_stack[f1].end = tmp;
-          f_stack[f1].sp = &prog.back();
-          break;
+          throw std::invalid_argument(
+              "simple_regex::nfa_vm, stray ] in regex");
+        case ')':
+        case '|':
         case '*':
-          f1 = f_stack.size() - 1;
-          prog.emplace_back(op(op::optype::SPLIT, 0, f_stack[f1].sp, nullptr));
-          patch(f_stack[f1], &prog.back());
-          f_stack[f1].sp = &(prog.back());
-          f_stack[f1].start = &(prog.back().rb);
-          f_stack[f1].end = &(prog.back().rb);
-          break;
         case '+':
-          f1 = f_stack.size() - 1;
-          prog.emplace_back(op(op::optype::SPLIT, 0, f_stack[f1].sp, nullptr));
-          patch(f_stack[f1], &prog.back());
-          f_stack[f1].start = &(prog.back().rb);
-          f_stack[f1].end = &(prog.back().rb);
-          break;
-        case 0:
-          f2 = f_stack.size() - 1;
-          f1 = f_stack.size() - 2;
-          patch(f_stack[f1], f_stack[f2].sp);
-          f_stack[f1].start = f_stack[f2].start;
-          f_stack[f1].end = f_stack[f2].end;
-          f_stack.resize(f2);
-          break;
-        case '|':
-          f2 = f_stack.size() - 1;
-          f1 = f_stack.size() - 2;
-          prog.emplace_back(
-              op(op::optype::SPLIT, 0, f_stack[f1].sp, f_stack[f2].sp));
-          fuse(f_stack[f1], f_stack[f2]);
-          f_stack.resize(f2);
-          f_stack[f1].sp = &prog.back();
+        case '?':
+          throw std::invalid_argument(
+              "simple_regex::nfa_vm, operator without an operand in regex");
+        case '\\':
+          if (++i == s.size()) {
+            throw std::invalid_argument(
+                "simple_regex::nfa_vm, trailing \\ in regex");
+          }
           break;
         default:
-          compile_char(processed, i);
           break;
       }
+      size_t idx = i;
+      const uint32_t utf8_char = get_utf8_n_inc(s, idx);
+      i = idx + 1;
+      regex_chars.insert_rev4byte(utf8_char);
+      prog.emplace_back(op(op::optype::CHAR, utf8_char));
+      return nfa_frag::single(prog.size() - 1);
+    }
+    // true for a class of one code point ([x], not negated nor a range) which
+    // is then in utf8 with i moved past its ], s[i] is its [
+    static bool lone_member(const std::string& s, uint32_t& i,
+                            uint32_t& utf8) {
+      size_t idx = i + 1;
+      if ((idx >= s.size()) || (s[idx] == '^') || (s[idx] == ']')) {
+        return false;
+      }
+      const uint32_t c = get_utf8_n_inc(s, idx);
+      if (((c >= 128) && (c < 192)) || (idx + 1 >= s.size()) ||
+          (s[idx + 1] != ']')) {
+        return false;  // a lone continuation byte or more to the class
+      }
+      utf8 = c;
+      i = idx + 2;
+      return true;
     }
-    f1 = f_stack.size() - 1;
-    if (f1 != 1) {
-      std::cout << "Error extra fragments after compiling: " << f1 - 1
-                << std::endl;
-      throw std::runtime_error("simple_regex::nfa failed to parse regex");
-    }
-    prog.emplace_back(op(op::optype::SAVE, 1, nullptr));
-    patch(f_stack[0], f_stack[f1].sp);
-    patch(f_stack[f1], &prog.back());
-    prog.emplace_back(op(op::optype::MATCH, 0, nullptr));
-    prog[prog.size() - 2].lb = &prog.back();
-    save_points = lsave;
-  }
 
-  void create_prog_ruin() {
-    prog_ruin.reserve(prog.size());
-    std::vector<uint32_t> save_count(prog.size());
-    if (prog[0].opt == op::optype::SAVE) {
-      save_count[0] = 1;
-      auto lp = prog[0].lb;
-      while (lp->opt == op::optype::SAVE) {
-        lp = lp->lb;
+    // what exit e of a fragment holds, see nfa_frag
+    uint32_t exit_link(uint32_t e) const {
+      const op& o = prog[e >> 1];
+      return (e & 1) ? o.rb : o.lb;
+    }
+    void set_exit(uint32_t e, uint32_t to) {
+      op& o = prog[e >> 1];
+      if (e & 1) {
+        o.rb = to;
+      } else {
+        o.lb = to;
       }
-      prog_ruin_start = lp - prog.data();
     }
-    for (uint32_t i = 1; i < prog.size(); ++i) {
-      save_count[i] = save_count[i - 1];
-      if (prog[i].opt == op::optype::SAVE) {
-        save_count[i] += 1;
+    // patch nfa fragments, Thompson's algorithm
+    void patch(const nfa_frag& f, uint32_t pos) {
+      for (uint32_t e = f.start; e != op::none;) {
+        const uint32_t next = exit_link(e);
+        set_exit(e, pos);
+        e = next;
       }
     }
-    prog_ruin_start -= save_count[prog_ruin_start];
-    for (uint32_t i = 0; i < prog.size(); ++i) {
-      if (prog[i].opt != op::optype::SAVE) {
-        prog_ruin.emplace_back(prog[i]);
-        if (prog_ruin.back().lb) {
-          auto lp = prog[i].lb;
-          while (lp->opt == op::optype::SAVE) {
-            lp = lp->lb;
+    // link these two linked lists
+    void fuse(nfa_frag& f1, const nfa_frag& f2) {
+      set_exit(f1.end, f2.start);
+      f1.end = f2.end;
+    }
+
+    // peephole pass over an op list: links are threaded through SPLITs with
+    // one way out, both branches to the same op or one back to itself (what
+    // a {0} leaves, and chains of them), then the ops start no longer
+    // reaches are dropped and the rest renumbered in order, returns start's
+    // new index
+    static uint32_t optimize(std::vector<op>& ops, uint32_t start) {
+      const uint32_t n = ops.size();
+      auto thread = [&](uint32_t k) {
+        // a loop of such SPLITs (it matches nothing) is left after n hops
+        for (uint32_t hops = 0;
+             (k != op::none) && (hops < n) && (ops[k].opt == op::optype::SPLIT);
+             ++hops) {
+          const op& o = ops[k];
+          if ((o.lb == o.rb) || (o.lb == k)) {
+            k = o.rb;
+          } else if (o.rb == k) {
+            k = o.lb;
+          } else {
+            break;
           }
-          prog_ruin.back().lb = prog_ruin.data();
-          prog_ruin.back().lb += lp - prog.data();
-          auto diff_to_s = prog_ruin.back().lb - prog_ruin.data();
-          prog_ruin.back().lb -= save_count[diff_to_s];
         }
-        if (prog_ruin.back().rb) {
-          auto lp = prog[i].rb;
-          while (lp->opt == op::optype::SAVE) {
-            lp = lp->lb;
+        return k;
+      };
+      start = thread(start);
+      for (auto& o : ops) {
+        o.lb = thread(o.lb);
+        o.rb = thread(o.rb);
+      }
+      std::vector<uint32_t> index(n, op::none);
+      std::vector<uint32_t> todo(1, start);
+      index[start] = 0;
+      while (todo.size()) {
+        const op& o = ops[todo.back()];
+        todo.pop_back();
+        for (uint32_t to : {uint32_t(o.lb), o.rb}) {
+          if ((to != op::none) && (index[to] == op::none)) {
+            index[to] = 0;
+            todo.push_back(to);
           }
-          prog_ruin.back().rb = prog_ruin.data();
-          prog_ruin.back().rb += lp - prog.data();
-          auto diff_to_s = prog_ruin.back().rb - prog_ruin.data();
-          prog_ruin.back().rb -= save_count[diff_to_s];
         }
       }
-    }
-  }
-  void clear_compile_info() {
-    f_stack.clear();
-    prog.clear();
-    prog_ruin.clear();
-    classes.clear();
-    save_points = 0;
-    prog_ruin_start = 0;
-  }
-
- public:
-  nfa_vm(const std::string& regex)
-      : prog(),
-        classes(),
-        regex_chars(),
-        save_points(),
-        f_stack(),
-        gen_id(),
-        cur(),
-        nxt(),
-        matches() {
-    std::string tokens;
-    tokenise(regex, tokens);
-    // std::cout << tokens << std::endl;
-    std::string notquitepostfix;
-    nearly_shunting_yard(tokens, notquitepostfix);
-    // std::cout << notquitepostfix << std::endl;
-    compile_nfa_sg(notquitepostfix);
-    create_prog_ruin();
-    mem.resize(32);
-    mem.init_s(prog_ruin, prog_ruin_start, classes);
-  }
-  nfa_vm() = delete;
-  void recompile(const std::string& regex) {
-    clear_compile_info();
-    std::string tokens;
-    tokenise(regex, tokens);
-    std::string notquitepostfix;
-    nearly_shunting_yard(tokens, notquitepostfix);
-    compile_nfa_sg(notquitepostfix);
-    create_prog_ruin();
-  }
-  void print_classes() {
-    std::cout << "Classes:" << std::endl;
-    for (auto i = 0; i < classes.size(); ++i) {
-      std::cout << "[" << i << "]" << "\t[" << classes[i] << "]" << std::endl;
-    }
-  }
-
-  void print_oplist(std::vector<op>& oplist) {
-    std::cout << "Printing NFA ops" << std::endl;
-    std::cout << "--------------------------------" << std::endl;
-    for (auto i = 0; i < oplist.size(); ++i) {
-      std::string ch = "";
-      switch (oplist[i].opt) {
-        case op::optype::CHAR:
-          ch = uint32_revto_utf8(oplist[i].data);
-          std::cout << "[" << i << "]\t";
-          std::cout << ch;
-          std::cout << "\t\tjmp " << oplist[i].lb - oplist.data();
-          break;
-        case op::optype::MATCH:
-          std::cout << "[" << i << "]\t" << "match";
-          break;
-        case op::optype::SPLIT:
-          std::cout << "[" << i << "]\t" << "split";
-          std::cout << "\t\t" << oplist[i].lb - oplist.data() << ", "
-                    << oplist[i].rb - oplist.data();
-          break;
-        case op::optype::ANY:
-          std::cout << "[" << i << "]\t" << "any";
-          std::cout << "\t\tjmp " << oplist[i].lb - oplist.data();
-          break;
-        case op::optype::SAVE:
-          std::cout << "[" << i << "]\t" << "save  " << oplist[i].data;
-          std::cout << "\t\tjmp " << oplist[i].lb - oplist.data();
-          break;
-        case op::optype::CLASS:
-          std::cout << "[" << i << "]\t" << "class " << oplist[i].data;
-          std::cout << "\t\tjmp " << oplist[i].lb - oplist.data();
-          break;
+      uint32_t kept = 0;
+      for (uint32_t k = 0; k < n; ++k) {
+        if (index[k] != op::none) {
+          index[k] = kept;
+          ops[kept++] = ops[k];
+        }
       }
-      std::cout << std::endl;
-    }
-    std::cout << "--------------------------------" << std::endl;
-    if (classes.size() != 0) {
-      print_classes();
-      std::cout << "--------------------------------" << std::endl;
+      ops.resize(kept);
+      for (auto& o : ops) {
+        o.lb = (o.lb == op::none) ? o.lb : index[o.lb];
+        o.rb = (o.rb == op::none) ? o.rb : index[o.rb];
+      }
+      return index[start];
     }
-  }
-
-  void print_prog() { print_oplist(prog); }
-  void print_prog_ruin() {
-    std::cout << "Starting op: " << prog_ruin_start << std::endl;
-    print_oplist(prog_ruin);
-  }
 
-  void new_thread(std::vector<thread>& pool, thread t, uint32_t i) {
-    auto& op = *t.ops;
-    if (op.gen == gen_id) {
-      return;
-    }
-    op.gen = gen_id;
-    if (op.opt == op::optype::SPLIT) {
-      new_thread(pool, thread(op.lb, std::move(t.m_loc)), i);
-      new_thread(pool, thread(op.rb, std::move(t.m_loc)), i);
-      return;
-    }
-    if (op.opt == op::optype::SAVE) {
-      t.m_loc[op.data] = i + 1;
-      new_thread(pool, thread(op.lb, std::move(t.m_loc)), i);
-      return;
+    // prog without its SAVE ops, links to one go past it, op k of prog is op
+    // k - (SAVE ops before it) of prog_ruin
+    void create_prog_ruin() {
+      std::vector<uint32_t> saves(prog.size() + 1);
+      for (uint32_t k = 0; k < prog.size(); ++k) {
+        saves[k + 1] = saves[k] + (prog[k].opt == op::optype::SAVE);
+      }
+      auto past = [&](uint32_t k) {
+        if (k == op::none) {
+          return k;
+        }
+        while (prog[k].opt == op::optype::SAVE) {
+          k = prog[k].lb;
+        }
+        return k - saves[k];
+      };
+      prog_ruin.reserve(prog.size() - saves[prog.size()]);
+      for (const auto& o : prog) {
+        if (o.opt != op::optype::SAVE) {
+          prog_ruin.emplace_back(o);
+          prog_ruin.back().lb = past(o.lb);
+          prog_ruin.back().rb = past(o.rb);
+        }
+      }
+      prog_ruin_start = optimize(prog_ruin, past(0));
+      for (uint32_t k = 0; k < prog.size(); ++k) {
+        if (prog[k].opt == op::optype::COUNT) {
+          counters[prog[k].data].at = k;
+        }
+      }
+      for (uint32_t k = 0; k < prog_ruin.size(); ++k) {
+        if (prog_ruin[k].opt == op::optype::COUNT) {
+          counters[prog_ruin[k].data].ruin_at = k;
+        }
+      }
     }
-    pool.emplace_back(t);
-  }
 
-  void new_thread(std::vector<thread>& pool, thread t, uint32_t i,
-                  bitvector& bitvec) {
-    auto& op = *t.ops;
-    if (op.gen == gen_id) {
-      return;
-    }
-    op.gen = gen_id;
-    if (op.opt == op::optype::SPLIT) {
-      new_thread(pool, thread(op.lb, std::move(t.m_loc)), i, bitvec);
-      new_thread(pool, thread(op.rb, std::move(t.m_loc)), i, bitvec);
-      return;
-    }
-    if (op.opt == op::optype::SAVE) {
-      t.m_loc[op.data] = i + 1;
-      new_thread(pool, thread(op.lb, std::move(t.m_loc)), i, bitvec);
-      return;
+    // splits the 256 byte values into classes no op can tell apart (the lazy
+    // dfa's alphabet), bytes with different utf8 roles never share a class and
+    // every byte of a multi byte code point the regex mentions gets its own
+    void create_byte_classes() {
+      for (uint32_t b = 0; b < 256; ++b) {
+        // ascii, continuation, 2 3 and 4 byte lead
+        byte_class[b] = (b < 128) ? 0 : utf_cont(b) ? 1 : utf_bytes(b);
+      }
+      byte_classes = 5;
+      auto refine = [&](auto&& in_set) {
+        uint16_t remap[256][2];
+        std::fill(&remap[0][0], &remap[0][0] + 512, 0xFFFF);
+        uint32_t n = 0;
+        for (uint32_t b = 0; b < 256; ++b) {
+          auto& id = remap[byte_class[b]][in_set(b) ? 1 : 0];
+          if (id == 0xFFFF) {
+            id = n++;
+          }
+          byte_class[b] = id;
+        }
+        byte_classes = n;
+      };
+      // every byte of a CHAR op (or of a class member that is one code
+      // point) is a class alone, and the lead and continuation bytes a class
+      // range starts and ends on are too, with the classes also broken before
+      // and after them (cut) since a range tells the bytes below its ends
+      // from those above. any two code points spelled with bytes of the same
+      // classes are then in the same classes (what the lazy dfa relies on, it
+      // keys pending bytes by class), while the inside of a range (a whole
+      // script but the bytes at its ends) stays a few classes. one pass,
+      // refining is commutative
+      bitmap<256> alone;
+      bitmap<320> cut;
+      // the bytes spelling index h of an n byte code point
+      auto ends = [&](uint32_t n, uint32_t h, bool split) {
+        auto mark = [&](uint32_t b) {
+          alone.set(b);
+          if (split) {
+            cut.set(b);
+            cut.set(b + 1);
+          }
+        };
+        const uint32_t lead = h >> (6 * (n - 1));
+        mark(((n == 2) ? 0xC0 : (n == 3) ? 0xE0 : 0xF0) + lead);
+        if (n == 4) {
+          mark(0xF8 + lead);  // utf8_bitmap only looks at its low 3 bits
+        }
+        for (uint32_t k = n - 1; k-- > 0;) {
+          mark(0x80 + ((h >> (6 * k)) & 0b00111111));
+        }
+      };
+      for (const auto& r : prog_ruin) {
+        const op& o = atom_of(r);
+        if (o.opt == op::optype::CHAR) {
+          uint32_t utf8 = o.data;
+          do {
+            alone.set(utf8 & 0xFF);
+          } while (utf8 >>= 8);
+        }
+      }
+      for (const auto& c : classes) {
+        c.for_each_range([&](uint32_t n, uint32_t first, uint32_t last) {
+          const bool split = (last - first > 1);
+          ends(n, first, split);
+          ends(n, last - 1, split);
+        });
+      }
+      {
+        uint16_t remap[5][257];
+        std::fill(&remap[0][0], &remap[0][0] + 5 * 257, 0xFFFF);
+        uint32_t n = 0;
+        uint32_t segment = 0;
+        for (uint32_t b = 0; b < 256; ++b) {
+          segment += cut.test(b);
+          if (alone.test(b)) {
+            byte_class[b] = n++;
+            continue;
+          }
+          auto& id = remap[byte_class[b]][segment];
+          if (id == 0xFFFF) {
+            id = n++;
+          }
+          byte_class[b] = id;
+        }
+        byte_classes = n;
+      }
+      for (const auto& c : classes) {
+        refine([&](uint32_t b) { return c.test(static_cast<byte>(b)); });
+      }
     }
-    bitvec.set(t.ops - prog.data());
-    pool.emplace_back(t);
-  }
-
-  void clear_match_info() {
-    cur.clear();
-    nxt.clear();
-    matches.clear();
-    gen_id = 0;
-  }
 
-  template <bool Unanchored = false>
-  bool test(const std::string& str) {
-    mem.rebuild_c = 0;
-    mem.overflow_c = 0;
-    bool match = false;
-    bool cache = true;
-    hybrid_set current{};
-    hybrid_set next{};
-    for (uint32_t i = 0; i < str.size(); ++i) {
-      if (cache) {
-        int64_t last_c = 0;
-        match = mem.run<Unanchored>(str, i, prog_ruin, prog_ruin_start, classes,
-                                    last_c);
-        if (match) {
-          return match;
-        }
-        if (last_c != -1) {
-          current.set_range(prog_ruin.size());
-          next.set_range(prog_ruin.size());
-          current = mem[last_c].ops;
-        } else {
-          return false;
+    // a run starts at each CHAR op leading to another that no CHAR op leads
+    // to, and takes in the CHAR ops after it
+    void create_literal_runs() {
+      const uint32_t n = prog.size();
+      auto is_char = [&](uint32_t k) {
+        return (k != op::none) && (prog[k].opt == op::optype::CHAR);
+      };
+      std::vector<bool> inner(n);
+      for (const auto& o : prog) {
+        if ((o.opt == op::optype::CHAR) && is_char(o.lb)) {
+          inner[o.lb] = true;
         }
       }
-      uint32_t i_c = i;
-      uint32_t utf8 = get_utf8_n_inc(str, i_c);
-      if constexpr (Unanchored) {
-        cache_element::resolve_split(current, &prog_ruin[prog_ruin_start],
-                                     prog_ruin.data());
+      run_at.assign(n, op::none);
+      for (uint32_t k = 0; k < n; ++k) {
+        if (inner[k] || !is_char(k) || !is_char(prog[k].lb)) {
+          continue;
+        }
+        literal_run r{static_cast<uint32_t>(literals.size()), 0, k};
+        for (uint32_t hops = 0; is_char(r.next) && (hops < n); ++hops) {
+          literals += uint32_revto_utf8(prog[r.next].data);
+          r.next = prog[r.next].lb;
+        }
+        r.bytes = literals.size() - r.text;
+        run_at[k] = runs.size();
+        runs.push_back(r);
       }
+    }
 
-      for (uint32_t j = 0; j < current.size(); ++j) {
-        auto& op = prog_ruin[current[j]];
-        switch (op.opt) {
+    // the literal every match starts with (the CHAR ops run from the start op)
+    // or failing that the one byte every match starts with, nothing when the
+    // regex can match the empty string
+    void create_prefilter() {
+      for (uint32_t k = prog_ruin_start; prog_ruin[k].opt == op::optype::CHAR;
+           k = prog_ruin[k].lb) {
+        prefix += uint32_revto_utf8(prog_ruin[k].data);
+      }
+      if (prefix.size() > 1) {
+        prefilter = LITERAL;
+        return;
+      }
+      hybrid_set start{};
+      start.set_range(prog_ruin.size());
+      add_closure(start, prog_ruin_start);
+      bitmap<256> first;
+      for (uint32_t j = 0; j < start.size(); ++j) {
+        const auto& o = atom_of(prog_ruin[start[j]]);
+        switch (o.opt) {
           default:
             continue;
           case op::optype::CHAR:
-            if (utf8 == op.data) {  // fallthrough
-            } else {
-              break;
-            }
+            first.set(o.data & 0xFF);
+            break;
           case op::optype::CLASS:
-            if (classes[op.data].test_rev4byte(utf8)) {  // fallthrough
-            } else {
-              break;
+            for (uint32_t b = 0; b < 256; ++b) {
+              if (classes[o.data].test(static_cast<byte>(b))) {
+                first.set(b);
+              }
             }
-          case op::optype::ANY:
-            cache_element::resolve_split(next, op.lb, prog_ruin.data());
+            classes[o.data].for_each_range(
+                [&](uint32_t n, uint32_t lo, uint32_t hi) {
+                  const uint32_t shift = 6 * (n - 1);
+                  const uint32_t lead = (n == 2)   ? 0xC0
+                                        : (n == 3) ? 0xE0
+                                                   : 0xF0;
+                  for (uint32_t d = lo >> shift; d <= (hi - 1) >> shift; ++d) {
+                    first.set(lead + d);
+                  }
+                });
             break;
+          case op::optype::ANY:
           case op::optype::MATCH:
-            return true;
+            prefix.clear();
+            return;
         }
       }
-      {
-        using namespace std;
-        swap(current, next);
-        next.clear();
+      uint32_t count = 0;
+      for (uint32_t b = 0; b < 256; ++b) {
+        if (first.test(b)) {
+          first_byte = b;
+          count += 1;
+        }
       }
+      // a lone continuation byte may sit inside a code point, don't jump there
+      bool cont = false;
+      for (uint32_t b = 0x80; b < 0xC0; ++b) {
+        cont |= first.test(b);
+      }
+      if ((count == 1) && !cont) {
+        prefilter = BYTE;
+      } else if ((count > 1) && (count <= byte_set_limit) && !cont) {
+        prefilter = BYTE_SET;
+        for (uint32_t b = 0; b < 256; ++b) {
+          if (first.test(b)) {
+            first_bytes.set(b);
+          }
+        }
+      }
+      prefix.clear();
     }
-    return current.test(prog_ruin.size() - 1);
-  }
 
-  template <bool Unanchored = false, bool Match_one = true>
-  bool match(const std::string& str) {
-    clear_match_info();
-    cur.reserve(prog.size());
-    nxt.reserve(prog.size());
-    bool match = false;
-    new_thread(cur, thread(&prog[0], save_points), -1);
-    for (uint32_t i = 0; i < str.size();) {
-      gen_id = i;
-      if constexpr (Unanchored) {
-        new_thread(cur, thread(&prog[0], save_points), i - 1);
+    // positions and their follow sets straight from ruin_closures, only for
+    // a single regex (test_set needs to know which MATCH was reached) without
+    // COUNT ops (a position can't hold a count)
+    void create_glushkov() {
+      auto& bit = bits.bit;
+      bit.assign(prog_ruin.size(), UINT32_MAX);
+      for (uint32_t k = 0; k < prog_ruin.size(); ++k) {
+        switch (prog_ruin[k].opt) {
+          default:
+            break;
+          case op::optype::CHAR:
+          case op::optype::CLASS:
+          case op::optype::ANY:
+            bit[k] = bits.ops.size();
+            bits.ops.emplace_back(k);
+            break;
+        }
+      }
+      if ((patterns != 1) || (bits.ops.size() > 64) || counters.size()) {
+        bits.ops.clear();
+        bit.clear();
+        return;
+      }
+      // the positions (and whether MATCH) the closure of op k holds
+      auto leads_to = [&](uint32_t k, bool& match) {
+        uint64_t ret = 0;
+        for (auto e = ruin_closures.begin(k); e != ruin_closures.end(k); ++e) {
+          if (prog_ruin[e->op].opt == op::optype::MATCH) {
+            match = true;
+          } else {
+            ret |= uint64_t(1) << bit[e->op];
+          }
+        }
+        return ret;
+      };
+      const uint32_t n = bits.ops.size();
+      std::vector<uint64_t> after(n);
+      for (uint32_t p = 0; p < n; ++p) {
+        bool match = false;
+        const op& o = prog_ruin[bits.ops[p]];
+        after[p] = leads_to(o.lb, match);
+        bits.final |= uint64_t(match) << p;
+        bits.any |= uint64_t(o.opt == op::optype::ANY) << p;
+      }
+      bits.first = leads_to(prog_ruin_start, bits.nullable);
+      bits.chunks = (n + 7) / 8;
+      bits.follow.assign(256 * bits.chunks, 0);
+      for (uint32_t c = 0; c < bits.chunks; ++c) {
+        for (uint32_t b = 1; b < 256; ++b) {
+          // the lowest set bit's follow set and the rest, already done
+          const uint32_t low = std::countr_zero(b);
+          const uint32_t p = 8 * c + low;
+          bits.follow[256 * c + b] = bits.follow[256 * c + (b & (b - 1))] |
+                                     ((p < n) ? after[p] : 0);
+        }
       }
-      uint32_t i_c = i;  // temporary to avoid change in i
-      for (uint32_t j = 0; j < cur.size(); ++j) {
-        auto& op = *cur[j].ops;
-        uint32_t utf8;
+      for (uint32_t b = 0; b < 192; ++b) {
+        bits.single[b] = accepts(b);
+      }
+      bits.usable = true;
+    }
+
+   public:
+    // the positions of bits that can consume code point utf8
+    uint64_t accepts(uint32_t utf8) const {
+      uint64_t ret = bits.any;
+      if (!regex_chars.test_rev4byte(utf8)) {
+        return ret;
+      }
+      for (uint32_t p = 0; p < bits.ops.size(); ++p) {
+        const op& o = prog_ruin[bits.ops[p]];
+        const bool hit =
+            (o.opt == op::optype::CHAR)    ? (o.data == utf8)
+            : (o.opt == op::optype::CLASS) ? classes[o.data].test_rev4byte(utf8)
+                                           : false;
+        ret |= uint64_t(hit) << p;
+      }
+      return ret;
+    }
+  };
+
+  // a lazy dfa state, the dfa steps on bytes (through program::byte_class)
+  // so a state is either at a code point boundary or part way into a multi
+  // byte code point, pending bytes still to come
+  struct cache_element {
+    // the boundary state reached from ops on code point utf8, work is scratch
+    // sized to prog_ruin's threads, unanchored_start is the first op of the
+    // program when searching, none if not (the start closure is folded into
+    // every state), leftmost states keep their ops in priority order instead
+    // (see finish), the new state's ops are written into buf (a recycled
+    // list, see cache::take)
+    static cache_element step(const std::vector<uint32_t>& ops, uint32_t utf8,
+                              const program& code, hybrid_set& work,
+                              uint32_t unanchored_start, bool leftmost,
+                              bool matched, std::vector<uint32_t>&& buf) {
+      const auto& oplist = code.prog_ruin;
+      work.clear();
+      for (uint32_t j = 0; j < ops.size(); ++j) {
+        if (ops[j] >= oplist.size()) {
+          code.count_step(work, ops[j], utf8);
+          continue;
+        }
+        auto& op = oplist[ops[j]];
         switch (op.opt) {
           default:
             continue;
           case op::optype::CHAR:
-            i_c = i;
-            utf8 = get_utf8_n_inc(str, i_c);
-            if (utf8 != op.data) {
-              continue;
+            if (utf8 == op.data) {
+              code.add_closure(work, op.lb);
             }
-            new_thread(nxt, thread(op.lb, std::move(cur[j].m_loc)), i);
-            continue;
+            break;
+          case op::optype::COUNT:
+            code.count_step(work, ops[j], utf8);
+            break;
           case op::optype::CLASS:
-            i_c = i;
-            utf8 = get_utf8_n_inc(str, i_c);
-            if (classes[op.data].test_rev4byte(utf8)) {
-              new_thread(nxt, thread(op.lb, std::move(cur[j].m_loc)), i);
+            if (code.classes[op.data].test_rev4byte(utf8)) {
+            } else {
+              break;
             }
-            continue;
           case op::optype::ANY:
-            new_thread(nxt, thread(op.lb, std::move(cur[j].m_loc)), i);
-            continue;
+            code.add_closure(work, op.lb);
+            break;
           case op::optype::MATCH:
-            match = true;
-            matches.emplace_back(cur[j].m_loc);
+            // nothing follows a match
+            matched = true;
             break;
         }
       }
-      std::swap(cur, nxt);
-      nxt.clear();
-      if constexpr (Match_one) {
-        if (match) {
-          return match;
-        }
+      // once a match was seen a leftmost search starts nothing new
+      if ((unanchored_start != op::none) && !(leftmost && matched)) {
+        code.add_closure(work, unanchored_start);
       }
-      i += utf_bytes(str[i]);
+      cache_element new_ce{};
+      new_ce.ops = std::move(buf);
+      new_ce.ops.assign(work.sparse.dense.begin(), work.sparse.dense.end());
+      new_ce.finish(oplist, leftmost);
+      new_ce.matched = leftmost && matched;
+      return new_ce;
     }
-    for (uint32_t j = 0; j < cur.size(); ++j) {
-      auto& op = *cur[j].ops;
-      byte a;
-      uint32_t utf8;
-      switch (op.opt) {
-        default:
-          continue;
-        case op::optype::MATCH:
+    // sorts ops, or for a leftmost (first) dfa drops the ops after the match
+    // op, they have a lower priority than the match already found
+    void finish(const std::vector<op>& oplist, bool leftmost) {
+      if (!leftmost) {
+        std::sort(ops.begin(), ops.end());
+        match = has_match(ops, oplist);
+        return;
+      }
+      for (uint32_t j = 0; j < ops.size(); ++j) {
+        if ((ops[j] < oplist.size()) &&
+            (oplist[ops[j]].opt == op::optype::MATCH)) {
+          ops.resize(j + 1);
           match = true;
-          matches.emplace_back(cur[j].m_loc);
-          break;
+          return;
+        }
       }
     }
-    return match;
+    static bool has_match(const std::vector<uint32_t>& ops,
+                          const std::vector<op>& oplist) {
+      for (auto o : ops) {
+        if ((o < oplist.size()) && (oplist[o].opt == op::optype::MATCH)) {
+          return true;
+        }
+      }
+      return false;
+    }
+    // the state after byte b, only valid when b continues or starts a code
+    // point (see cache::build)
+    cache_element construct_next(byte b, const program& code, hybrid_set& work,
+                                 uint32_t unanchored_start, bool leftmost,
+                                 std::vector<uint32_t>&& buf = {}) const {
+      const byte cls = code.byte_class[b];
+      if (pending == 0) {
+        const byte n = utf_bytes(b);
+        if (n == 1) {
+          return step(ops, b, code, work, unanchored_start, leftmost, matched,
+                      std::move(buf));
+        }
+        cache_element new_ce{};
+        new_ce.ops = std::move(buf);
+        new_ce.ops.assign(ops.begin(), ops.end());
+        new_ce.matched = matched;
+        new_ce.pending = n - 1;
+        new_ce.prefix_len = 1;
+        new_ce.prefix = b;
+        new_ce.prefix_cls = cls;
+        return new_ce;
+      }
+      const uint32_t shift = 8 * prefix_len;
+      if (pending == 1) {
+        return step(ops, prefix | (static_cast<uint32_t>(b) << shift), code,
+                    work, unanchored_start, leftmost, matched, std::move(buf));
+      }
+      cache_element new_ce{};
+      new_ce.ops = std::move(buf);
+      new_ce.ops.assign(ops.begin(), ops.end());
+      new_ce.matched = matched;
+      new_ce.pending = pending - 1;
+      new_ce.prefix_len = prefix_len + 1;
+      new_ce.prefix = prefix | (static_cast<uint32_t>(b) << shift);
+      new_ce.prefix_cls = prefix_cls | (static_cast<uint32_t>(cls) << shift);
+      return new_ce;
+    }
+    // states are told apart by their ops and by the classes of the pending
+    // bytes, the raw prefix is just one representative of those classes
+    bool same_state(const cache_element& other) const {
+      return (pending == other.pending) && (prefix_len == other.prefix_len) &&
+             (prefix_cls == other.prefix_cls) && (matched == other.matched) &&
+             (ops == other.ops);
+    }
+    uint64_t hash() const {
+      uint64_t h = ops.size() ^ (static_cast<uint64_t>(prefix_cls) << 32) ^
+                   (static_cast<uint64_t>(pending) << 24) ^
+                   (static_cast<uint64_t>(matched) << 16);
+      for (auto o : ops) {
+        h = (h ^ o) * 0x9E3779B97F4A7C15ULL;
+        h ^= h >> 29;
+      }
+      h ^= h >> 33;
+      h *= 0xFF51AFD7ED558CCDULL;
+      h ^= h >> 33;
+      return h;
+    }
+    // heap held by this state outside its transition row, in bytes
+    size_t heap_bytes() const {
+      return sizeof(cache_element) + ops.capacity() * sizeof(uint32_t) +
+             incoming.capacity() * sizeof(uint32_t);
+    }
+
+    // prog_ruin threads of the state (ops and counts, see program::counter),
+    // sorted (in priority order when leftmost)
+    std::vector<uint32_t> ops;
+    // transition slots (cache::trans indices) pointing here, cleared when the
+    // state is evicted, may hold stale entries (checked before use)
+    std::vector<uint32_t> incoming;
+    uint64_t key = 0;         // hash(), kept for the state table
+    uint32_t prefix = 0;      // pending bytes seen so far, reverse order
+    uint32_t prefix_cls = 0;  // their byte classes, same order
+    byte pending = 0;         // bytes left in the current code point
+    byte prefix_len = 0;
+    bool match = false;    // holds the match op
+    bool matched = false;  // leftmost: a match was seen, nothing new starts
+    bool live = false;     // false once evicted, the row is free
+    bool checked = false;  // looked at by cache::accelerate
+    bool accel = false;    // all bytes but escapes loop back here
+    byte_set escapes;
+  };
+
+  // how the lazy dfa caches of a match_state behave, the budget is counted
+  // against the real heap footprint of each state (its transition row plus
+  // cache_element::heap_bytes)
+  struct cache_config {
+    enum policy : uint32_t {
+      CLEAR_ALL,  // drop every state once the budget is hit
+      FIFO,       // evict the oldest states first
+      CLOCK       // evict states not entered since the clock hand last passed
+    };
+    size_t budget = 1 << 20;
+    policy eviction = FIFO;
+    // once states are being evicted, give up on the dfa and simulate the nfa
+    // for the rest of the input if fewer than this many bytes were scanned per
+    // state built, 0 never gives up
+    uint32_t min_bytes_per_state = 10;
+    // don't judge before this many states were built in one call
+    uint32_t min_states = 64;
+  };
+
+  // what the engines of an nfa_vm did since it was made (or reset_stats),
+  // counted only with SIMPLE_REGEX_STATS, cache_bytes is always filled in
+  struct engine_stats {
+    uint64_t states_built = 0;        // lazy dfa states built
+    uint64_t transitions_cached = 0;  // transitions written into the rows
+    uint64_t cache_hits = 0;    // dfa steps on a transition already built
+    uint64_t cache_misses = 0;  // dfa steps that had to build theirs
+    uint64_t evictions = 0;     // states evicted to fit the budget
+    uint64_t rebuilds = 0;      // CLEAR_ALL clears
+    uint64_t dfa_bytes = 0;     // input walked (or skipped) by the lazy dfas
+    // input left to the nfa once a cache gave up (the position sets of test,
+    // the pike vm or backtracker of match up to where it stopped reading)
+    uint64_t nfa_bytes = 0;
+    // longest pike vm thread list, 0 while the backtracker takes every
+    // fallback and group (inputs short enough for can_backtrack)
+    uint64_t peak_threads = 0;
+    size_t cache_bytes = 0;     // heap the cached states hold now
+
+    engine_stats& operator+=(const engine_stats& o) {
+      states_built += o.states_built;
+      transitions_cached += o.transitions_cached;
+      cache_hits += o.cache_hits;
+      cache_misses += o.cache_misses;
+      evictions += o.evictions;
+      rebuilds += o.rebuilds;
+      dfa_bytes += o.dfa_bytes;
+      nfa_bytes += o.nfa_bytes;
+      peak_threads = std::max(peak_threads, o.peak_threads);
+      cache_bytes += o.cache_bytes;
+      return *this;
+    }
+  };
+
+  // lazily built dfa over byte classes, every state owns one row of trans
+  // (stride = byte_classes + 1 entries, the last one is the clock mark) and
+  // transitions hold the premultiplied row offset of the next state, so a
+  // step is one class lookup and one load, state 0 is the start state and is
+  // never evicted
+  struct cache {
+    static constexpr uint32_t unknown = 0xFFFFFFFF;  // not built yet
+    static constexpr uint32_t invalid = 0xFFFFFFFE;  // bad utf8
+    // set on transitions into match or dead states, rows are below it
+    static constexpr uint32_t special = 0x80000000;
+    static constexpr uint32_t offset_mask = 0x7FFFFFFF;
+
+    cache_element& operator[](uint32_t id) { return states[id]; }
+    const cache_element& operator[](uint32_t id) const { return states[id]; }
+
+    // drops every state, init_s has to be called again
+    void configure(const cache_config& c) {
+      cfg = c;
+      clear();
+    }
+    void clear() {
+      states.clear();
+      trans.clear();
+      free_ids.clear();
+      fifo.clear();
+      table.clear();
+      spare[0].clear();
+      spare[1].clear();
+      hand = 0;
+      used = 0;
+    }
+    // per call counters
+    void new_call() {
+      overflow_c = 0;
+      rebuild_c = 0;
+      built_c = 0;
+    }
+    // heap held by the states, in bytes
+    size_t memory() const { return used; }
+    uint32_t size() const { return states.size() - free_ids.size(); }
+    uint32_t row_bytes() const { return stride * sizeof(uint32_t); }
+
+    // table slot holding the same state as c (c.key must be set) or the empty
+    // slot to insert c at
+    uint32_t find(const cache_element& c) const {
+      return table.find(
+          c.key, [&](uint32_t id) { return states[id].same_state(c); });
+    }
+    // slot is where find left c, evicts (never pinned or the start state)
+    // until c fits the budget and returns c's id
+    uint32_t push(cache_element&& c, uint32_t slot, uint32_t pinned) {
+      c.incoming = take(spare[1]);
+      const size_t need = c.heap_bytes() + row_bytes();
+      if (used + need > cfg.budget) {
+        make_room(need, pinned);
+        slot = find(c);  // evicting moves entries around
+      }
+      uint32_t id;
+      if (free_ids.size()) {
+        id = free_ids.back();
+        free_ids.pop_back();
+      } else {
+        id = states.size();
+        states.emplace_back();
+        trans.resize(trans.size() + stride, unknown);
+        bytes.emplace_back(0);
+      }
+      auto& e = states[id];
+      e = std::move(c);
+      e.live = true;
+      std::fill(&trans[id * stride], &trans[id * stride] + stride, unknown);
+      trans[id * stride + mark] = 0;
+      bytes[id] = need;
+      used += need;
+      table.insert(slot, e.key, id);
+      if (cfg.eviction == cache_config::FIFO) {
+        fifo.push_back(id);
+      }
+      built_c += 1;
+      if constexpr (collect_stats) {
+        counted.states_built += 1;
+      }
+      return id;
+    }
+    // transition value of state id
+    uint32_t target(uint32_t id) const {
+      const auto& e = states[id];
+      const uint32_t off = id * stride;
+      if (e.match || ((e.ops.size() == 0) && (e.pending == 0)) ||
+          ((id == 0) && skip_start) || e.accel) {
+        return off | special;
+      }
+      return off;
+    }
+    void link(uint32_t from, byte cls, uint32_t to) {
+      const uint32_t slot = from * stride + cls;
+      trans[slot] = target(to);
+      if constexpr (collect_stats) {
+        counted.transitions_cached += 1;
+      }
+      auto& in = states[to].incoming;
+      const size_t before = states[to].heap_bytes();
+      if (in.size() == in.capacity()) {
+        // drop stale edges before growing
+        const uint32_t off = to * stride;
+        uint32_t k = 0;
+        for (auto s : in) {
+          if ((trans[s] < invalid) && ((trans[s] & offset_mask) == off)) {
+            in[k++] = s;
+          }
+        }
+        in.resize(k);
+      }
+      in.push_back(slot);
+      const size_t after = states[to].heap_bytes();
+      used += after;
+      used -= before;
+      bytes[to] += after;
+      bytes[to] -= before;
+    }
+    void evict(uint32_t id) {
+      auto& e = states[id];
+      const uint32_t off = id * stride;
+      for (auto s : e.incoming) {
+        if ((trans[s] < invalid) && ((trans[s] & offset_mask) == off)) {
+          trans[s] = unknown;
+        }
+      }
+      std::fill(&trans[off], &trans[off] + stride, unknown);
+      table.erase(e.key, id);
+      used -= bytes[id];
+      bytes[id] = 0;
+      give(spare[0], std::move(e.ops));
+      give(spare[1], std::move(e.incoming));
+      e = cache_element{};
+      free_ids.push_back(id);
+      overflow_c += 1;
+      if constexpr (collect_stats) {
+        counted.evictions += 1;
+      }
+    }
+    // the lists of evicted states and of states built only to find they were
+    // cached already are kept in pool (spare[0] ops, spare[1] incoming) and
+    // handed to the next states built, so warming up and thrashing reuse the
+    // same few buffers instead of going through the allocator for every
+    // state, at most spare_limit per pool are held (outside the budget)
+    using list_pool = std::vector<std::vector<uint32_t>>;
+    static std::vector<uint32_t> take(list_pool& pool) {
+      if (pool.empty()) {
+        return {};
+      }
+      std::vector<uint32_t> v = std::move(pool.back());
+      pool.pop_back();
+      return v;
+    }
+    static void give(list_pool& pool, std::vector<uint32_t>&& v) {
+      if ((pool.size() < spare_limit) && v.capacity()) {
+        v.clear();
+        pool.emplace_back(std::move(v));
+      }
+    }
+    static constexpr size_t spare_limit = 256;
+    // give up on the dfa, see cache_config::min_bytes_per_state
+    bool thrashing(uint64_t scanned) const {
+      return cfg.min_bytes_per_state && overflow_c &&
+             (built_c >= cfg.min_states) &&
+             (scanned < static_cast<uint64_t>(cfg.min_bytes_per_state) *
+                            built_c);
+    }
+    // builds the transition of state id on byte b, returns its value
+    template <bool Unanchored>
+    uint32_t build(uint32_t id, byte b, const program& code) {
+      const auto& e = states[id];
+      if (e.pending && !utf_cont(b)) {
+        trans[id * stride + code.byte_class[b]] = invalid;
+        return invalid;
+      }
+      auto tmp = e.construct_next(
+          b, code, work,
+          Unanchored ? code.prog_ruin_start : op::none,
+          leftmost, take(spare[0]));
+      tmp.key = tmp.hash();
+      uint32_t slot = find(tmp);
+      uint32_t to;
+      if (table.occupied(slot)) {
+        to = table[slot];
+        give(spare[0], std::move(tmp.ops));
+      } else {
+        to = push(std::move(tmp), slot, id);
+      }
+      link(id, code.byte_class[b], to);
+      if ((to == id) && !states[id].checked) {
+        accelerate<Unanchored>(id, code);
+      }
+      return trans[id * stride + code.byte_class[b]];
+    }
+
+    // a state looping back to itself on every byte but a few ascii ones (and
+    // bytes leaving it part way into a code point) gets those escapes in a
+    // byte_set and the transitions into it made special, run then jumps to
+    // the next escape byte instead of stepping, e.g. the .* of f.*l is left
+    // only on l, looked at on the state's first self loop, building its row
+    template <bool Unanchored>
+    void accelerate(uint32_t id, const program& code) {
+      states[id].checked = true;
+      const auto& st = states[id];
+      if ((id == 0) || st.match || st.pending || (st.ops.size() == 0)) {
+        return;  // dead states are already special
+      }
+      const uint32_t off = id * stride;
+      byte_set escapes;
+      uint32_t ascii = 0;
+      for (uint32_t b = 0; b < 256; ++b) {
+        uint32_t t = trans[off + code.byte_class[b]];
+        if (t == unknown) {
+          t = build<Unanchored>(id, b, code);
+        }
+        if ((t >= invalid) || ((t & offset_mask) != off)) {
+          escapes.set(b);
+          ascii += (b < 128);
+          if (ascii > accel_escapes) {
+            return;
+          }
+        }
+      }
+      auto& e = states[id];
+      e.accel = true;
+      e.escapes = escapes;
+      for (auto k : e.incoming) {
+        if ((trans[k] < invalid) && ((trans[k] & offset_mask) == off)) {
+          trans[k] |= special;
+        }
+      }
+    }
+    static constexpr uint32_t accel_escapes = 3;  // ascii ones
+
+    // walks the dfa from s[i] building states as needed, returns true once a
+    // state holding the match op is reached with i just past it, otherwise i
+    // is left at the first code point not consumed and fallback points to the
+    // ops of the state reached (nullptr when s was exhausted, no match), with
+    // hits every match state reached adds its pattern ids and the walk only
+    // stops once every pattern matched
+    template <bool Unanchored>
+    bool run(std::string_view s, size_t& i, const program& code,
+             const std::vector<uint32_t>*& fallback,
+             hybrid_set* hits = nullptr) {
+      uint32_t cur = 0;
+      if (run<Unanchored>(s, i, code, fallback, cur, hits)) {
+        return true;
+      }
+      if (!fallback && pending(cur)) {
+        error_invalid_utf8("simple_regex::nfa_vm::cache::run, truncated");
+      }
+      return false;
+    }
+    // same but starting from (and leaving) the state at row offset cur, the
+    // input may end part way into a code point (see test_stream)
+    template <bool Unanchored>
+    bool run(std::string_view s, size_t& i, const program& code,
+             const std::vector<uint32_t>*& fallback, uint32_t& cur,
+             hybrid_set* hits = nullptr) {
+      if (cfg.eviction == cache_config::CLOCK) {
+        return run<Unanchored, true>(s, i, code, fallback, cur, hits);
+      }
+      return run<Unanchored, false>(s, i, code, fallback, cur, hits);
+    }
+    template <bool Unanchored, bool Mark>
+    bool run(std::string_view s, size_t& i, const program& code,
+             const std::vector<uint32_t>*& fallback, uint32_t& cur,
+             hybrid_set* hits) {
+      const byte* str = reinterpret_cast<const byte*>(s.data());
+      const byte* classes = code.byte_class;
+      const size_t n = s.size();
+      const size_t i0 = i;
+      auto walked = [&](size_t to) {
+        if constexpr (collect_stats) {
+          counted.dfa_bytes += to - i0;
+        }
+      };
+      fallback = nullptr;
+      if (states[cur / stride].match &&
+          (!hits || code.collect(states[cur / stride].ops, *hits))) {
+        return true;
+      }
+      size_t idx = i;
+      if (Unanchored && skip_start && (cur == 0)) {
+        idx = code.next_candidate(s, idx);
+      }
+      const uint32_t* tt = trans.data();
+      for (; idx < n; ++idx) {
+        uint32_t nxt = tt[cur + classes[str[idx]]];
+        if constexpr (Mark) {
+          trans[cur + mark] = 1;
+        }
+        if constexpr (collect_stats) {
+          counted.cache_hits += (nxt != unknown);
+        }
+        if (nxt & special) [[unlikely]] {
+          if (nxt == unknown) {
+            const uint32_t id = cur / stride;
+            if (thrashing(idx - i0)) {
+              // back to the start of the code point being read
+              i = idx - states[id].prefix_len;
+              fallback = &states[id].ops;
+              walked(i);
+              return false;
+            }
+            if constexpr (collect_stats) {
+              counted.cache_misses += 1;
+            }
+            nxt = build<Unanchored>(id, str[idx], code);
+            tt = trans.data();
+          }
+          if (nxt == invalid) {
+            error_invalid_utf8("simple_regex::nfa_vm::cache::run");
+          }
+          if (nxt & special) {
+            if (states[(nxt & offset_mask) / stride].match) {
+              cur = nxt & offset_mask;
+              if (!hits || code.collect(states[cur / stride].ops, *hits)) {
+                i = idx + 1;
+                walked(i);
+                return true;
+              }
+              continue;
+            }
+            if (states[(nxt & offset_mask) / stride].accel) {
+              cur = nxt & offset_mask;
+              idx = states[cur / stride].escapes.find(s, idx + 1) - 1;
+              continue;
+            }
+            if (nxt == special) {
+              // back at the start, jump to where a match could start
+              idx = code.next_candidate(s, idx + 1) - 1;
+              cur = 0;
+              continue;
+            }
+            // dead, nothing can match any more
+            cur = nxt & offset_mask;
+            walked(idx + 1);
+            i = n;
+            return false;
+          }
+        }
+        cur = nxt;
+      }
+      walked(n);
+      i = n;
+      return false;
+    }
+    // the state at row offset cur is part way into a code point
+    bool pending(uint32_t cur) const { return states[cur / stride].pending; }
+    // the ops of the state at row offset cur
+    const std::vector<uint32_t>& ops_at(uint32_t cur) const {
+      return states[cur / stride].ops;
+    }
+
+    // the row offset of the boundary state holding ops (as finish leaves
+    // them) built unless it's cached, for carrying on from the state a
+    // shared_dfa reached
+    uint32_t adopt(const std::vector<uint32_t>& ops, const program& code) {
+      cache_element c{};
+      c.ops = take(spare[0]);
+      c.ops.assign(ops.begin(), ops.end());
+      c.finish(code.prog_ruin, leftmost);
+      c.key = c.hash();
+      const uint32_t slot = find(c);
+      if (table.occupied(slot)) {
+        give(spare[0], std::move(c.ops));
+        return table[slot] * stride;
+      }
+      return push(std::move(c), slot, 0) * stride;
+    }
+
+    enum outcome { NO_MATCH, FOUND, GAVE_UP };
+    // end of the leftmost first match, the pike vm's, searching from s[i] on
+    // a leftmost cache: the walk goes on past match states until the dfa is
+    // dead, end is where the last match state was entered, GAVE_UP if the
+    // cache thrashed
+    template <bool Unanchored>
+    outcome last_match(std::string_view s, size_t i, const program& code,
+                       size_t& end) {
+      if (cfg.eviction == cache_config::CLOCK) {
+        return last_match<Unanchored, true>(s, i, code, end);
+      }
+      return last_match<Unanchored, false>(s, i, code, end);
+    }
+    template <bool Unanchored, bool Mark>
+    outcome last_match(std::string_view s, size_t i, const program& code,
+                       size_t& end) {
+      const byte* str = reinterpret_cast<const byte*>(s.data());
+      const byte* classes = code.byte_class;
+      const size_t n = s.size();
+      outcome res = NO_MATCH;
+      auto done = [&](size_t at, outcome r) {
+        if constexpr (collect_stats) {
+          counted.dfa_bytes += at - i;
+        }
+        return r;
+      };
+      if (states[0].match) {
+        end = i;
+        res = FOUND;
+      }
+      uint32_t cur = 0;
+      size_t idx = i;
+      if (Unanchored && skip_start) {
+        idx = code.next_candidate(s, idx);
+      }
+      const uint32_t* tt = trans.data();
+      for (; idx < n; ++idx) {
+        uint32_t nxt = tt[cur + classes[str[idx]]];
+        if constexpr (Mark) {
+          trans[cur + mark] = 1;
+        }
+        if constexpr (collect_stats) {
+          counted.cache_hits += (nxt != unknown);
+        }
+        if (nxt & special) [[unlikely]] {
+          if (nxt == unknown) {
+            if (thrashing(idx - i)) {
+              return done(idx, GAVE_UP);
+            }
+            if constexpr (collect_stats) {
+              counted.cache_misses += 1;
+            }
+            nxt = build<Unanchored>(cur / stride, str[idx], code);
+            tt = trans.data();
+          }
+          if (nxt == invalid) {
+            error_invalid_utf8("simple_regex::nfa_vm::cache::last_match");
+          }
+          if (nxt & special) {
+            if (states[(nxt & offset_mask) / stride].match) {
+              cur = nxt & offset_mask;
+              end = idx + 1;
+              res = FOUND;
+              continue;
+            }
+            if (states[(nxt & offset_mask) / stride].accel) {
+              cur = nxt & offset_mask;
+              idx = states[cur / stride].escapes.find(s, idx + 1) - 1;
+              continue;
+            }
+            if (nxt == special) {
+              idx = code.next_candidate(s, idx + 1) - 1;
+              cur = 0;
+              continue;
+            }
+            return done(idx + 1, res);  // dead
+          }
+        }
+        cur = nxt;
+      }
+      if (pending(cur)) {
+        error_invalid_utf8(
+            "simple_regex::nfa_vm::cache::last_match, truncated");
+      }
+      return done(n, res);
+    }
+
+    // start of the match ending at end, walking the reverse program's dfa
+    // (anchored) back from end over whole code points (their bytes still go
+    // in first to last) down to lo, start is the last position a match state
+    // was reached at, bytes that can't be utf8 end the walk (they are before
+    // any match, the forward walk checked the rest)
+    outcome first_start(std::string_view s, size_t lo, size_t end,
+                        const program& rev, size_t& start) {
+      const byte* str = reinterpret_cast<const byte*>(s.data());
+      outcome res = NO_MATCH;
+      if (states[0].match) {
+        start = end;
+        res = FOUND;
+      }
+      uint32_t cur = 0;
+      for (size_t p = end; p > lo;) {
+        size_t q = p - 1;
+        for (size_t j = p - 1; (j + 4 > p) && (j > lo) && utf_cont(str[j]);) {
+          --j;
+          if ((str[j] >= 192) && (utf_bytes(str[j]) == p - j)) {
+            q = j;
+            break;
+          }
+        }
+        for (size_t k = q; k < p; ++k) {
+          uint32_t nxt = trans[cur + rev.byte_class[str[k]]];
+          if (cfg.eviction == cache_config::CLOCK) {
+            trans[cur + mark] = 1;
+          }
+          if constexpr (collect_stats) {
+            counted.dfa_bytes += 1;
+            counted.cache_hits += (nxt != unknown);
+          }
+          if (nxt == unknown) {
+            if (thrashing(end - p)) {
+              return GAVE_UP;
+            }
+            if constexpr (collect_stats) {
+              counted.cache_misses += 1;
+            }
+            nxt = build<false>(cur / stride, str[k], rev);
+          }
+          if (nxt == invalid) {
+            return res;
+          }
+          cur = nxt & offset_mask;
+        }
+        const auto& e = states[cur / stride];
+        if (e.pending) {
+          return res;
+        }
+        if (e.match) {
+          start = q;
+          res = FOUND;
+        } else if (e.ops.size() == 0) {
+          return res;  // dead
+        }
+        p = q;
+      }
+      return res;
+    }
+
+    // (re)builds the start state, drops everything else, an unanchored cache
+    // leaves the start state through the program's prefilter, a leftmost one
+    // has states in priority order (see last_match)
+    void init_s(const program& code, bool unanchored, bool lf = false) {
+      clear();
+      leftmost = lf;
+      skip_start = unanchored && (code.prefilter != program::NONE);
+      stride = code.byte_classes + 1;
+      mark = code.byte_classes;
+      work = hybrid_set{};
+      work.set_range(code.ruin_threads());
+      code.add_closure(work, code.prog_ruin_start);
+      cache_element strt{};
+      strt.ops = work.sparse.dense;
+      strt.finish(code.prog_ruin, leftmost);
+      strt.key = strt.hash();
+      strt.live = true;
+      table.insert(find(strt), strt.key, 0);
+      states.emplace_back(std::move(strt));
+      trans.assign(stride, unknown);
+      trans[mark] = 0;
+      bytes.assign(1, states[0].heap_bytes() + row_bytes());
+      used = bytes[0];
+    }
+
+    cache_config cfg;
+    uint32_t overflow_c = 0;  // states evicted this call
+    uint32_t rebuild_c = 0;   // full clears this call
+    uint32_t built_c = 0;     // states built this call
+    engine_stats counted;     // since made, see collect_stats
+
+   protected:
+    void make_room(size_t need, uint32_t pinned) {
+      const uint32_t n = states.size();
+      switch (cfg.eviction) {
+        default:
+        case cache_config::CLEAR_ALL:
+          for (uint32_t id = 1; id < n; ++id) {
+            if (states[id].live && (id != pinned)) {
+              evict(id);
+            }
+          }
+          fifo.clear();
+          rebuild_c += 1;
+          if constexpr (collect_stats) {
+            counted.rebuilds += 1;
+          }
+          break;
+        case cache_config::FIFO:
+          for (uint32_t k = fifo.size(); k && (used + need > cfg.budget); --k) {
+            uint32_t id = fifo.front();
+            fifo.pop_front();
+            if (id == pinned) {
+              fifo.push_back(id);
+            } else if (states[id].live) {
+              evict(id);
+            }
+          }
+          break;
+        case cache_config::CLOCK:
+          // two sweeps clear every mark then evict
+          for (uint32_t k = (n > 1) ? 2 * n : 0;
+               k && (used + need > cfg.budget); --k) {
+            hand = (hand + 1 < n) ? hand + 1 : 1;
+            if (!states[hand].live || (hand == pinned)) {
+              continue;
+            }
+            if (trans[hand * stride + mark]) {
+              trans[hand * stride + mark] = 0;
+            } else {
+              evict(hand);
+            }
+          }
+          break;
+      }
+    }
+
+    std::vector<cache_element> states;
+    std::vector<uint32_t> trans;  // states.size() rows of stride entries
+    std::vector<size_t> bytes;    // what each state was accounted at
+    std::vector<uint32_t> free_ids;
+    std::deque<uint32_t> fifo;  // insertion order for FIFO eviction
+    uint32_t stride = 1;
+    uint32_t mark = 0;  // index of the clock mark in a row
+    uint32_t hand = 0;  // clock hand
+    size_t used = 0;    // sum of bytes
+    hybrid_set work;    // scratch for building states
+    id_table table;     // state -> states index
+    // transitions into the start state are special (prefilter)
+    bool skip_start = false;
+    bool leftmost = false;
+    list_pool spare[2];  // see take
+  };
+
+  // the lazy dfa of test built up front (every state reachable from the
+  // start, at most max_states) and optionally minimized, held in one position
+  // independent blob so one written out can be mapped back in and matched on
+  // with no warmup, the blob (native byte order, 4 byte aligned) is
+  //   header, byte_class[256], first_bytes (byte_set::lo, 32 bytes), prefix
+  //   padded to 4 bytes,
+  //   trans (states rows of byte_classes premultiplied entries as in cache),
+  //   one flag byte per state
+  struct full_dfa {
+    static constexpr uint32_t invalid = cache::invalid;
+    static constexpr uint32_t special = cache::special;
+    static constexpr uint32_t offset_mask = cache::offset_mask;
+    enum state_flag : byte { MATCH = 1, PENDING = 2, DEAD = 4 };
+    struct header {
+      char magic[8];
+      uint32_t size;          // of the whole blob
+      uint32_t byte_classes;  // entries per row
+      uint32_t states;        // the start state is state 0
+      uint32_t unanchored;
+      uint32_t prefilter;  // program::prefilter_kind, taken at the start
+      uint32_t first_byte;
+      uint32_t prefix_len;
+    };
+    static constexpr char magic[8] = {'S', 'R', 'X', 'D', 'F', 'A', '0', '2'};
+
+    full_dfa(const program& code, bool unanchored,
+             uint32_t max_states = 1 << 16, bool minimize = true) {
+      const uint32_t nc = code.byte_classes;
+      const auto& oplist = code.prog_ruin;
+      const uint32_t start = code.prog_ruin_start;
+      byte rep[256];  // a byte of each class
+      for (uint32_t b = 256; b-- > 0;) {
+        rep[code.byte_class[b]] = b;
+      }
+      std::vector<cache_element> states;
+      std::vector<uint32_t> next;  // state ids, or invalid
+      id_table table;
+      hybrid_set work{};
+      work.set_range(code.ruin_threads());
+      code.add_closure(work, start);
+      states.emplace_back();
+      states[0].ops = work.sparse.dense;
+      states[0].finish(oplist, false);
+      states[0].key = states[0].hash();
+      table.insert(table.find(states[0].key, [](uint32_t) { return false; }),
+                   states[0].key, 0);
+      for (uint32_t id = 0; id < states.size(); ++id) {
+        for (uint32_t c = 0; c < nc; ++c) {
+          if (states[id].pending && !utf_cont(rep[c])) {
+            next.emplace_back(invalid);
+            continue;
+          }
+          auto t = states[id].construct_next(rep[c], code, work,
+                                             unanchored ? start : op::none,
+                                             false);
+          t.key = t.hash();
+          const uint32_t slot = table.find(
+              t.key, [&](uint32_t k) { return states[k].same_state(t); });
+          if (table.occupied(slot)) {
+            next.emplace_back(table[slot]);
+            continue;
+          }
+          if (states.size() == max_states) {
+            throw std::runtime_error(
+                "simple_regex::nfa_vm::full_dfa, more than max_states states");
+          }
+          table.insert(slot, t.key, states.size());
+          next.emplace_back(states.size());
+          states.emplace_back(std::move(t));
+        }
+      }
+      const uint32_t n = states.size();
+      std::vector<byte> flag(n);
+      for (uint32_t id = 0; id < n; ++id) {
+        // dead as in cache::target, nothing can match and no more bytes
+        // are read so bad utf8 after it isn't looked at
+        const bool dead = (states[id].ops.size() == 0) && !states[id].pending;
+        flag[id] = (states[id].match ? MATCH : 0) |
+                   (states[id].pending ? PENDING : 0) | (dead ? DEAD : 0);
+      }
+      // block[id] is the state id is merged into
+      std::vector<uint32_t> block(n);
+      for (uint32_t id = 0; id < n; ++id) {
+        block[id] = minimize ? flag[id] : id;
+      }
+      uint32_t blocks = minimize ? 0 : n;
+      if (minimize) {
+        // moore: split blocks by the blocks their transitions go to until
+        // nothing splits, states left in one block can't be told apart
+        std::vector<uint32_t> order(n);
+        std::vector<uint32_t> split(n);
+        std::vector<uint32_t> renumber(n);
+        auto to = [&](uint32_t id, uint32_t c) {
+          const uint32_t t = next[id * nc + c];
+          return (t == invalid) ? invalid : block[t];
+        };
+        auto before = [&](uint32_t a, uint32_t b) {
+          if (block[a] != block[b]) {
+            return block[a] < block[b];
+          }
+          for (uint32_t c = 0; c < nc; ++c) {
+            if (to(a, c) != to(b, c)) {
+              return to(a, c) < to(b, c);
+            }
+          }
+          return false;
+        };
+        while (true) {
+          for (uint32_t id = 0; id < n; ++id) {
+            order[id] = id;
+          }
+          std::sort(order.begin(), order.end(), before);
+          uint32_t count = 0;
+          for (uint32_t k = 0; k < n; ++k) {
+            if (k && before(order[k - 1], order[k])) {
+              count += 1;
+            }
+            split[order[k]] = count;
+          }
+          count += 1;
+          // number blocks in state order, the start stays 0
+          std::fill(renumber.begin(), renumber.end(), invalid);
+          uint32_t m = 0;
+          for (uint32_t id = 0; id < n; ++id) {
+            if (renumber[split[id]] == invalid) {
+              renumber[split[id]] = m++;
+            }
+          }
+          for (uint32_t id = 0; id < n; ++id) {
+            block[id] = renumber[split[id]];
+          }
+          if (count == blocks) {
+            break;
+          }
+          blocks = count;
+        }
+      }
+      // one state of each block stands for it
+      std::vector<uint32_t> first(blocks, invalid);
+      for (uint32_t id = 0; id < n; ++id) {
+        if (first[block[id]] == invalid) {
+          first[block[id]] = id;
+        }
+      }
+      header h{};
+      std::memcpy(h.magic, magic, sizeof(magic));
+      h.byte_classes = nc;
+      h.states = blocks;
+      h.unanchored = unanchored;
+      h.prefilter = unanchored ? code.prefilter : program::NONE;
+      h.first_byte = code.first_byte;
+      h.prefix_len = (h.prefilter == program::LITERAL) ? code.prefix.size() : 0;
+      const size_t row_start = layout(h);
+      h.size = row_start + static_cast<size_t>(blocks) * nc * sizeof(uint32_t) +
+               blocks;
+      own.assign((h.size + 3) / 4, 0);
+      byte* out = reinterpret_cast<byte*>(own.data());
+      std::memcpy(out, &h, sizeof(h));
+      std::memcpy(out + sizeof(h), code.byte_class, 256);
+      std::memcpy(out + sizeof(h) + 256, code.first_bytes.lo, 32);
+      std::memcpy(out + sizeof(h) + 288, code.prefix.data(), h.prefix_len);
+      uint32_t* rows = reinterpret_cast<uint32_t*>(out + row_start);
+      byte* flags_out = out + row_start + blocks * nc * sizeof(uint32_t);
+      for (uint32_t b = 0; b < blocks; ++b) {
+        flags_out[b] = flag[first[b]];
+      }
+      for (uint32_t b = 0; b < blocks; ++b) {
+        for (uint32_t c = 0; c < nc; ++c) {
+          const uint32_t t = to_block(next, block, first[b] * nc + c);
+          if (t == invalid) {
+            rows[b * nc + c] = invalid;
+            continue;
+          }
+          rows[b * nc + c] = t * nc;
+          if ((flags_out[t] & (MATCH | DEAD)) ||
+              ((t == 0) && (h.prefilter != program::NONE))) {
+            rows[b * nc + c] |= special;
+          }
+        }
+      }
+      bind(out, h.size);
+    }
+    // a view of a blob written out from data() (e.g. a mapped file), nothing
+    // is copied so it must outlive this, the header and every transition are
+    // checked (throws if it isn't a blob)
+    full_dfa(const void* data, size_t size) {
+      if (reinterpret_cast<uintptr_t>(data) % 4) {
+        throw std::invalid_argument(
+            "simple_regex::nfa_vm::full_dfa, blob not 4 byte aligned");
+      }
+      bind(static_cast<const byte*>(data), size);
+    }
+    full_dfa(const full_dfa&) = delete;
+    full_dfa& operator=(const full_dfa&) = delete;
+    full_dfa(full_dfa&&) = default;  // the buffer moves with own
+    full_dfa& operator=(full_dfa&&) = default;
+
+    // what the blob to write out is
+    std::string_view data() const {
+      return std::string_view(reinterpret_cast<const char*>(base), h.size);
+    }
+    uint32_t size() const { return h.states; }
+
+    // the same as nfa_vm::test<unanchored> on the program it was built from
+    bool test(std::string_view s) const {
+      const byte* str = reinterpret_cast<const byte*>(s.data());
+      const size_t n = s.size();
+      const auto kind = static_cast<program::prefilter_kind>(h.prefilter);
+      check_utf8(s, "simple_regex::nfa_vm::full_dfa::test");
+      if (flags[0] & MATCH) {
+        return true;
+      }
+      uint32_t cur = 0;
+      size_t idx = 0;
+      if (kind != program::NONE) {
+        idx = program::next_candidate(kind, h.first_byte, prefix, s, 0,
+                                      &first_bytes);
+      }
+      for (; idx < n; ++idx) {
+        const uint32_t nxt = trans[cur + classes[str[idx]]];
+        if (nxt & special) [[unlikely]] {
+          if (nxt == invalid) {
+            error_invalid_utf8("simple_regex::nfa_vm::full_dfa::test");
+          }
+          const byte f = flags[(nxt & offset_mask) / h.byte_classes];
+          if (f & MATCH) {
+            return true;
+          }
+          if (f & DEAD) {
+            return false;
+          }
+          // back at the start, jump to where a match could start
+          idx = program::next_candidate(kind, h.first_byte, prefix, s,
+                                        idx + 1, &first_bytes) -
+                1;
+          cur = 0;
+          continue;
+        }
+        cur = nxt;
+      }
+      if (flags[cur / h.byte_classes] & PENDING) {
+        error_invalid_utf8("simple_regex::nfa_vm::full_dfa::test, truncated");
+      }
+      return false;
+    }
+
+   protected:
+    // where the rows start
+    static size_t layout(const header& hd) {
+      return sizeof(header) + 288 + ((hd.prefix_len + 3) & ~size_t{3});
+    }
+    static uint32_t to_block(const std::vector<uint32_t>& next,
+                             const std::vector<uint32_t>& block, uint32_t k) {
+      return (next[k] == invalid) ? invalid : block[next[k]];
+    }
+    void bind(const byte* data, size_t size) {
+      auto bad = [] {
+        throw std::invalid_argument(
+            "simple_regex::nfa_vm::full_dfa, not a dfa blob");
+      };
+      if (size < sizeof(header) + 288) {
+        bad();
+      }
+      std::memcpy(&h, data, sizeof(h));
+      if (std::memcmp(h.magic, magic, sizeof(magic)) || (h.size != size) ||
+          !h.byte_classes || (h.byte_classes > 256) || !h.states ||
+          (h.prefilter > program::BYTE_SET)) {
+        bad();
+      }
+      const size_t rows = layout(h);
+      const size_t cells = static_cast<size_t>(h.states) * h.byte_classes;
+      if ((cells > offset_mask) ||
+          (rows + cells * sizeof(uint32_t) + h.states != size)) {
+        bad();
+      }
+      base = data;
+      classes = data + sizeof(header);
+      std::memcpy(first_bytes.lo, data + sizeof(header) + 256, 32);
+      prefix = std::string_view(
+          reinterpret_cast<const char*>(data + sizeof(header) + 288),
+          h.prefix_len);
+      trans = reinterpret_cast<const uint32_t*>(data + rows);
+      flags = data + rows + cells * sizeof(uint32_t);
+      for (uint32_t b = 0; b < 256; ++b) {
+        if (classes[b] >= h.byte_classes) {
+          bad();
+        }
+      }
+      for (size_t k = 0; k < cells; ++k) {
+        const uint32_t t = trans[k] & ((trans[k] == invalid) ? 0 : offset_mask);
+        if ((t >= cells) || (t % h.byte_classes)) {
+          bad();
+        }
+      }
+    }
+
+    std::vector<uint32_t> own;  // the blob when built here
+    header h{};
+    const byte* base = nullptr;
+    const byte* classes = nullptr;  // byte_class
+    std::string_view prefix;
+    byte_set first_bytes;  // copied out of the blob
+    const uint32_t* trans = nullptr;
+    const byte* flags = nullptr;
+  };
+
+  // everything written to while matching, bound to the program it was last
+  // reset with, construction is cheap so keep one per thread
+  struct shared_dfa;
+  struct match_state {
+    match_state() = default;
+    match_state(const program& code) { reset(code); }
+    void reset(const program& code) {
+      owner = &code;
+      gen.assign(code.threads(), 0);
+      gen_id = 0;
+      cur.reset(code.threads(), code.save_points);
+      nxt.reset(code.threads(), code.save_points);
+      blank.assign(code.save_points, 0);
+      for (uint32_t u = 0; u < 2; ++u) {
+        mem[u].configure(config);
+        mem[u].init_s(code, u);
+        first[u].configure(config);
+        first[u].init_s(code, u, true);
+      }
+      rev.configure(config);
+      rev.init_s(*code.reverse, false);
+      hits = hybrid_set{};
+      hits.set_range(code.patterns);
+      for (auto& h : sim) {
+        h = hybrid_set{};
+        h.set_range(code.ruin_threads());
+      }
+      for (auto& h : counting) {
+        h = hybrid_set{};
+        if (code.counters.size()) {
+          h.set_range(code.counters.size());
+        }
+      }
+      counts.assign(code.count_words, 0);
+      count_used.assign(code.counters.size(), 0);
+      matches.clear();
+    }
+    // drops the cached dfa states
+    void configure(const cache_config& c) {
+      config = c;
+      if (owner) {
+        reset(*owner);
+      }
+    }
+    void clear_match_info() {
+      cur.clear();
+      nxt.clear();
+      matches.clear();
+    }
+    void free_memory() {
+      // matching will still work but might have a bit of warmup, the next
+      // call rebinds
+      cur = thread_list{};
+      nxt = thread_list{};
+      matches = std::move(std::vector<std::vector<size_t>>(0));
+      owner = nullptr;
+    }
+
+    const program* owner = nullptr;
+    // generation marks for the pike vm, one per thread id of prog
+    std::vector<uint64_t> gen;
+    uint64_t gen_id = 0;
+    thread_list cur{};
+    thread_list nxt{};
+    std::vector<size_t> blank;  // all zero slots for threads at the start
+    cache_config config;
+    cache mem[2];     // lazy dfa, [0] anchored [1] unanchored
+    cache first[2];   // leftmost first lazy dfa for match, same
+    cache rev;        // of the reverse program, anchored
+    shared_dfa* shared = nullptr;  // test looks states up there first
+    hybrid_set hits;  // pattern ids test_set found
+    hybrid_set sim[2];  // nfa simulation once the cache gives up
+    hybrid_set counting[2];       // its counters with counts, see search
+    std::vector<uint64_t> counts;  // and their bits
+    std::vector<uint32_t> count_used;  // see program::count_bits
+    std::vector<size_t> best;  // slots of the last match found
+    bitvector visited;         // backtracker, one bit per (op, position)
+    // backtracker stack, a slot to restore or (slot = explore) a branch
+    struct frame {
+      static constexpr uint32_t explore = -1;
+      uint32_t op;
+      uint32_t slot;
+      size_t pos;  // or the slot's old value
+    };
+    std::vector<frame> frames;
+    std::vector<std::vector<size_t>> matches;
+    engine_stats counted;  // what isn't the caches', see collect_stats
+    size_t reached = 0;  // where the last backtrack or pike run stopped reading
+
+    // the counters of this scratch and its caches
+    engine_stats stats() const {
+      engine_stats ret = counted;
+      for (const cache* c : {&mem[0], &mem[1], &first[0], &first[1], &rev}) {
+        ret += (*c).counted;
+        ret.cache_bytes += (*c).memory();
+      }
+      return ret;
+    }
+    void reset_stats() {
+      counted = engine_stats{};
+      for (cache* c : {&mem[0], &mem[1], &first[0], &first[1], &rev}) {
+        (*c).counted = engine_stats{};
+      }
+    }
+  };
+
+ protected:
+  static void bind(const program& code, match_state& scratch) {
+    if (scratch.owner != &code) {
+      scratch.reset(code);
+    }
+  }
+  // input is checked once before matching, the engines then read it with
+  // next_utf8, bad utf8 anywhere throws whether or not a match comes first
+  static void check_utf8(std::string_view str, const char* func_name) {
+    if (utf8_error(str) != str.size()) {
+      error_invalid_utf8(func_name);
+    }
+  }
+
+ public:
+  nfa_vm(const std::string& regex)
+      : code(std::make_shared<const program>(regex)), scratch(*code) {}
+  // a set of regexes, see test_set
+  nfa_vm(const std::vector<std::string>& regexes)
+      : code(std::make_shared<const program>(regexes)), scratch(*code) {}
+  // share an already compiled program, only the scratch is per instance
+  nfa_vm(std::shared_ptr<const program> compiled)
+      : code(std::move(compiled)), scratch(*code) {}
+  nfa_vm() = delete;
+  void recompile(const std::string& regex) {
+    code = std::make_shared<const program>(regex);
+    scratch.reset(*code);
+    scratch.reset_stats();
+    helpers.clear();
+    share(nullptr);
+  }
+  // memory budget and eviction policy of the lazy dfa, drops cached states
+  void set_cache_config(const cache_config& cfg) {
+    scratch.configure(cfg);
+    for (auto& h : helpers) {
+      h.configure(cfg);
+    }
+  }
+  const cache_config& get_cache_config() const { return scratch.config; }
+  const program& compiled() const { return *code; }
+  const std::shared_ptr<const program>& shared_program() const { return code; }
+  void print_classes() { (*code).print_classes(); }
+  void print_prog() { (*code).print_prog(); }
+  void print_prog_ruin() { (*code).print_prog_ruin(); }
+
+  // add the threads of the closure of o to pool (see program::closure_table),
+  // pos is the index SAVE records, caps holds the slots of the thread that
+  // got to o, a thread already in pool (by a higher priority path) is skipped
+  static void new_thread(const program& code, match_state& scratch,
+                         thread_list& pool, uint32_t k, const size_t* caps,
+                         size_t pos) {
+    const auto& cl = code.closures;
+    for (auto e = cl.begin(k); e != cl.end(k); ++e) {
+      auto& mark = scratch.gen[e->op];
+      if (mark == scratch.gen_id) {
+        continue;
+      }
+      mark = scratch.gen_id;
+      pool.ops.emplace_back(e->op);
+      size_t* row = pool.row(e->op);
+      std::memcpy(row, caps, pool.width * sizeof(size_t));
+      for (uint32_t v = e->saves; v < e->saves_end; ++v) {
+        row[cl.saves[v]] = pos;
+      }
+    }
+  }
+  // pike vm thread k in a counted repeat (see program::counter) past code
+  // point utf8 into pool: on to the next count with the same slots while
+  // below max (first, the repeat is greedy) and after the repeat once at min
+  static void count_thread(const program& code, match_state& scratch,
+                           thread_list& pool, uint32_t k, uint32_t utf8,
+                           const size_t* caps, size_t pos) {
+    const auto [j, c] = code.count_at(code.prog, k);
+    const auto& r = code.counters[j];
+    if (!code.takes(r.atom, utf8)) {
+      return;
+    }
+    const uint32_t to = code.prog.size() + r.first + c;
+    if ((c + 1 < r.max) && (scratch.gen[to] != scratch.gen_id)) {
+      scratch.gen[to] = scratch.gen_id;
+      pool.ops.emplace_back(to);
+      std::memcpy(pool.row(to), caps, pool.width * sizeof(size_t));
+    }
+    if (c + 1 >= r.min) {
+      new_thread(code, scratch, pool, code.prog[r.at].lb, caps, pos);
+    }
+  }
+  // the thread at the start of the program
+  static void start_thread(const program& code, match_state& scratch,
+                           thread_list& pool, size_t pos) {
+    new_thread(code, scratch, pool, 0, scratch.blank.data(), pos);
+  }
+
+  // does a match exist (anchored: one starting at str[0]), no positions are
+  // tracked so this runs on the lazy dfa and only simulates the nfa if the
+  // cache gives up
+  template <bool Unanchored = false>
+  static bool test(const program& code, match_state& scratch,
+                   std::string_view str) {
+    bind(code, scratch);
+    return search<Unanchored>(code, scratch, str, nullptr);
+  }
+
+  // which regexes of a set (see program's set constructor) match, their ids
+  // are written to ids in ascending order, a single regex is a set of one
+  template <bool Unanchored = false>
+  static bool test_set(const program& code, match_state& scratch,
+                       std::string_view str, std::vector<uint32_t>& ids) {
+    bind(code, scratch);
+    auto& hits = scratch.hits;
+    hits.clear();
+    search<Unanchored>(code, scratch, str, &hits);
+    ids = hits.sparse.dense;
+    std::sort(ids.begin(), ids.end());
+    return ids.size() != 0;
+  }
+
+ protected:
+  // test on code.bits from str[i], reach holds the positions that can
+  // consume it (unanchored always with the start's, so reach == first is the
+  // start state)
+  template <bool Unanchored>
+  static bool bit_parallel(const program& code, std::string_view str,
+                           size_t& i, uint64_t reach) {
+    const auto& g = code.bits;
+    const uint64_t* follow = g.follow.data();
+    while (i < str.size()) {
+      if constexpr (Unanchored) {
+        if (reach == g.first) {
+          i = code.next_candidate(str, i);
+          if (i >= str.size()) {
+            break;
+          }
+        }
+      }
+      const byte b = str[i];
+      const uint64_t hit =
+          reach & ((b < 192) ? g.single[b]
+                             : code.accepts(next_utf8(str, i)));
+      ++i;
+      if (hit & g.final) {
+        return true;
+      }
+      reach = Unanchored ? g.first : 0;
+      for (uint32_t c = 0; c < g.chunks; ++c) {
+        reach |= follow[256 * c + ((hit >> (8 * c)) & 0xFF)];
+      }
+      if constexpr (!Unanchored) {
+        if (!reach) {
+          return false;
+        }
+      }
+    }
+    return false;
+  }
+
+  // test and test_set, with hits the search only stops once every pattern
+  // matched, end (when given) is set just past where the first match to end
+  // does
+  template <bool Unanchored>
+  static bool search(const program& code, match_state& scratch,
+                     std::string_view str, hybrid_set* hits,
+                     size_t* end = nullptr) {
+    check_utf8(str, "simple_regex::nfa_vm::test");
+    auto& mem = scratch.mem[Unanchored];
+    const auto& prog_ruin = code.prog_ruin;
+    mem.new_call();
+    size_t i = 0;
+    const std::vector<uint32_t>* last = nullptr;
+    auto found = [&] {
+      if (end) {
+        *end = i;
+      }
+      return true;
+    };
+    uint32_t cur = 0;
+    if (shared_dfa* shared = scratch.shared) {
+      // the states every worker shares first (built there when missing), the
+      // own cache from where that can't go on
+      const auto r = (*shared).walk<Unanchored>(str, i, scratch, hits, cur);
+      if constexpr (collect_stats) {
+        scratch.counted.dfa_bytes += i;
+      }
+      if (r != cache::GAVE_UP) {
+        return (r == cache::FOUND) && found();
+      }
+    }
+    if (mem.run<Unanchored>(str, i, code, last, cur, hits)) {
+      return found();
+    }
+    if (!last) {
+      if (mem.pending(cur)) {
+        error_invalid_utf8("simple_regex::nfa_vm::cache::run, truncated");
+      }
+      return false;
+    }
+    // the cache gave up, carry on from its last state with the nfa, as one
+    // word of positions if it's small enough
+    if (!hits && code.bits.usable) {
+      uint64_t reach = Unanchored ? code.bits.first : 0;
+      for (auto o : *last) {
+        const uint32_t p = code.bits.bit[o];
+        reach |= (p < 64) ? uint64_t(1) << p : 0;
+      }
+      const size_t from = i;
+      const bool r = bit_parallel<Unanchored>(code, str, i, reach);
+      if constexpr (collect_stats) {
+        scratch.counted.nfa_bytes += i - from;
+      }
+      return r && found();
+    }
+    // counted repeats are counted bit parallel here, a thread at a COUNT op
+    // sets bit 0 of its counts (see program::count_bits)
+    auto& current = scratch.sim[0];
+    auto& next = scratch.sim[1];
+    hybrid_set* counting = &scratch.counting[0];  // the counters with counts
+    hybrid_set* counting_next = &scratch.counting[1];
+    uint64_t* counts = scratch.counts.data();
+    uint32_t* used = scratch.count_used.data();
+    current.clear();
+    next.clear();
+    if (code.counters.size()) {  // sized only then
+      (*counting).clear();
+      (*counting_next).clear();
+    }
+    std::fill(scratch.counts.begin(), scratch.counts.end(), 0);
+    std::fill(scratch.count_used.begin(), scratch.count_used.end(), 0);
+    for (auto o : *last) {
+      if (o < prog_ruin.size()) {
+        current.insert(o);
+        continue;
+      }
+      const auto [j, c] = code.count_at(prog_ruin, o);
+      counts[code.counters[j].word + c / 64] |= uint64_t(1) << (c % 64);
+      used[j] = std::max(used[j], c / 64 + 1);
+      (*counting).test_insert(j);
+    }
+    while (i < str.size()) {
+      size_t i_c = i;
+      uint32_t utf8 = next_utf8(str, i_c);
+      for (uint32_t j = 0; j < current.size(); ++j) {
+        auto& op = prog_ruin[current[j]];
+        switch (op.opt) {
+          default:
+            continue;
+          case op::optype::CHAR:
+            if (utf8 == op.data) {
+              code.add_closure(next, op.lb);
+            }
+            break;
+          case op::optype::COUNT:
+            counts[code.counters[op.data].word] |= 1;
+            used[op.data] = std::max(used[op.data], uint32_t(1));
+            (*counting).test_insert(op.data);
+            break;
+          case op::optype::CLASS:
+            if (code.classes[op.data].test_rev4byte(utf8)) {  // fallthrough
+            } else {
+              break;
+            }
+          case op::optype::ANY:
+            code.add_closure(next, op.lb);
+            break;
+        }
+      }
+      for (uint32_t k = 0; k < (*counting).size(); ++k) {
+        const uint32_t j = (*counting)[k];
+        const auto& r = code.counters[j];
+        if (code.count_bits(counts + r.word, r, utf8, used[j])) {
+          code.add_closure(next, prog_ruin[r.ruin_at].lb);
+        }
+        if (used[j]) {
+          (*counting_next).insert(j);
+        }
+      }
+      if constexpr (Unanchored) {
+        code.add_closure(next, code.prog_ruin_start);
+      }
+      {
+        using namespace std;
+        swap(current, next);
+        next.clear();
+        swap(counting, counting_next);
+        if ((*counting_next).size()) {
+          (*counting_next).clear();
+        }
+      }
+      if constexpr (collect_stats) {
+        scratch.counted.nfa_bytes += i_c + 1 - i;
+      }
+      i = i_c + 1;
+      if (hits ? code.collect(current, *hits)
+               : cache_element::has_match(current.sparse.dense, prog_ruin)) {
+        return found();
+      }
+      if ((current.size() == 0) && ((*counting).size() == 0)) {
+        return false;
+      }
+    }
+    return false;
+  }
+
+ public:
+
+  static bool empty_at(const size_t* caps, size_t pos) {
+    return (caps[0] == pos) && (caps[1] == pos);
+  }
+
+  // pike vm step, moves the threads of cur past code point utf8 into nxt (n
+  // is the position after it), returns true if a MATCH was reached, it then
+  // becomes best and the lower priority threads are cut
+  static bool step(const program& code, match_state& scratch, uint32_t utf8,
+                   size_t n, size_t skip_empty, std::vector<size_t>& best) {
+    auto& cur = scratch.cur;
+    auto& nxt = scratch.nxt;
+    bool hit = false;
+    ++scratch.gen_id;
+    for (uint32_t j = 0; j < cur.size(); ++j) {
+      size_t* caps = cur.row(cur[j]);
+      if (cur[j] >= code.prog.size()) {
+        count_thread(code, scratch, nxt, cur[j], utf8, caps, n);
+        continue;
+      }
+      auto& op = code.prog[cur[j]];
+      switch (op.opt) {
+        default:
+          continue;
+        case op::optype::COUNT:
+          count_thread(code, scratch, nxt, cur[j], utf8, caps, n);
+          continue;
+        case op::optype::CHAR:
+          if (utf8 != op.data) {
+            continue;
+          }
+          new_thread(code, scratch, nxt, op.lb, caps, n);
+          continue;
+        case op::optype::CLASS:
+          if (code.classes[op.data].test_rev4byte(utf8)) {
+            new_thread(code, scratch, nxt, op.lb, caps, n);
+          }
+          continue;
+        case op::optype::ANY:
+          new_thread(code, scratch, nxt, op.lb, caps, n);
+          continue;
+        case op::optype::MATCH:
+          if (empty_at(caps, skip_empty)) {
+            continue;
+          }
+          // lower priority threads can't beat this one, cut them
+          hit = true;
+          best.assign(caps, caps + cur.width);
+          j = cur.size();
+          break;
+      }
+    }
+    std::swap(cur, nxt);
+    nxt.clear();
+    if constexpr (collect_stats) {
+      scratch.counted.peak_threads =
+          std::max<uint64_t>(scratch.counted.peak_threads, cur.size());
+    }
+    return hit;
+  }
+  // end of input, only the match op can still succeed
+  static bool step_end(const program& code, match_state& scratch,
+                       size_t skip_empty, std::vector<size_t>& best) {
+    auto& cur = scratch.cur;
+    bool hit = false;
+    for (uint32_t j = 0; j < cur.size(); ++j) {
+      const size_t* caps = cur.row(cur[j]);
+      if ((cur[j] < code.prog.size()) &&
+          (code.prog[cur[j]].opt == op::optype::MATCH) &&
+          !empty_at(caps, skip_empty)) {
+        hit = true;
+        best.assign(caps, caps + cur.width);
+        break;
+      }
+    }
+    cur.clear();
+    return hit;
+  }
+
+  // leftmost first (the first alternative that can match wins), Match_one =
+  // false collects every non overlapping match into matches (see
+  // match_cursor for them one at a time)
+  template <bool Unanchored = false, bool Match_one = true>
+  static bool match(const program& code, match_state& scratch,
+                    std::string_view str) {
+    bind(code, scratch);
+    check_utf8(str, "simple_regex::nfa_vm::match");
+    scratch.clear_match_info();
+    size_t pos = 0;
+    size_t skip_empty = -1;
+    bool match = false;
+    while (next_match<Unanchored>(code, scratch, str, pos, skip_empty)) {
+      match = true;
+      scratch.matches.emplace_back(scratch.best);
+      if constexpr (Match_one) {
+        break;
+      }
+    }
+    return match;
+  }
+
+  // the non overlapping matches of str one at a time, each one's slots
+  // (program::save_points of them) are written to the caller's buffer so
+  // nothing is allocated per match, scratch holds the search state between
+  // calls and mustn't be used for anything else meanwhile
+  template <bool Unanchored = false>
+  struct match_cursor {
+    match_cursor(const program& code, match_state& scratch,
+                 std::string_view str)
+        : code(&code), scratch(&scratch), str(str) {
+      bind(code, scratch);
+      check_utf8(str, "simple_regex::nfa_vm::match_cursor");
+    }
+    // false once there are no more matches
+    bool next(size_t* slots) {
+      if (!next_match<Unanchored>(*code, *scratch, str, pos, skip_empty)) {
+        return false;
+      }
+      std::memcpy(slots, (*scratch).best.data(),
+                  (*scratch).best.size() * sizeof(size_t));
+      return true;
+    }
+    size_t width() const { return (*code).save_points; }
+
+   protected:
+    const program* code;
+    match_state* scratch;
+    std::string_view str;
+    size_t pos = 0;
+    size_t skip_empty = -1;
+  };
+
+ protected:
+  // the next match at or after pos into scratch.best, after an empty match
+  // at skip_empty it can't be that one again, then moves pos (and skip_empty)
+  // past it, a single match is found by the lazy dfas when they can and the
+  // pike vm only fills in the groups over the span they found
+  template <bool Unanchored>
+  static bool next_match(const program& code, match_state& scratch,
+                         std::string_view str, size_t& pos,
+                         size_t& skip_empty) {
+    if (pos > str.size()) {
+      return false;
+    }
+    bool found;
+    if (!find_span<Unanchored>(code, scratch, str, pos, skip_empty, found)) {
+      found = can_backtrack(code, str.size() - pos)
+                  ? backtrack<Unanchored>(code, scratch, str, pos, skip_empty)
+                  : pike<Unanchored>(code, scratch, str, pos, skip_empty);
+      if constexpr (collect_stats) {
+        // the span it read, up to the match (and what decided it)
+        scratch.counted.nfa_bytes += scratch.reached - pos;
+      }
+    }
+    if (!found) {
+      pos = str.size() + 1;
+      return false;
+    }
+    const auto& best = scratch.best;
+    pos = best[1];
+    if (best[0] == best[1]) {
+      skip_empty = pos;
+    }
+    return true;
+  }
+
+  // the match in three steps: the leftmost first dfa runs forward to where
+  // the match ends, the reverse dfa back from there to where it starts and
+  // the pike vm anchored over just that span if there are groups, false
+  // (found unset) when a cache gave up or the match is the empty one at
+  // skip_empty (the pike vm knows what comes after it)
+  template <bool Unanchored>
+  static bool find_span(const program& code, match_state& scratch,
+                        std::string_view str, size_t from, size_t skip_empty,
+                        bool& found) {
+    auto& fwd = scratch.first[Unanchored];
+    fwd.new_call();
+    size_t end = 0;
+    const auto r = fwd.last_match<Unanchored>(str, from, code, end);
+    if (r == cache::GAVE_UP) {
+      return false;
+    }
+    found = (r == cache::FOUND);
+    if (!found) {
+      return true;
+    }
+    size_t start = from;
+    if constexpr (Unanchored) {
+      scratch.rev.new_call();
+      if (scratch.rev.first_start(str, from, end, *code.reverse, start) !=
+          cache::FOUND) {
+        return false;
+      }
+    }
+    if ((start == end) && (start == skip_empty)) {
+      return false;
+    }
+    if (code.save_points == 2) {
+      scratch.best.assign({start, end});
+      return true;
+    }
+    // the match from start is the one ending at end, the input past it
+    // doesn't change which
+    if (can_backtrack(code, end - start)) {
+      return backtrack<false>(code, scratch, str.substr(0, end), start, -1);
+    }
+    return pike<false>(code, scratch, str.substr(0, end), start, -1);
+  }
+
+  // bits the backtracker may use for its visited set
+  static constexpr size_t backtrack_limit = 1 << 21;
+  static bool can_backtrack(const program& code, size_t len) {
+    return code.threads() * (len + 1) <= backtrack_limit;
+  }
+  // bounded backtracking from str[from], the same match as the pike vm (the
+  // first MATCH reached trying branches in priority order) into scratch.best,
+  // each (thread, position) is tried at most once (a second try would fail
+  // the same way, a count being a thread of its own) so for a small program
+  // over a short input it does less work than moving thread lists along,
+  // see can_backtrack
+  template <bool Unanchored>
+  static bool backtrack(const program& code, match_state& scratch,
+                        std::string_view str, size_t from, size_t skip_empty) {
+    using frame = match_state::frame;
+    const op* base = code.prog.data();
+    const uint32_t ops = code.prog.size();
+    const size_t n = str.size();
+    const size_t len = n - from + 1;
+    auto& visited = scratch.visited;
+    visited.resize(code.threads() * len);
+    visited.clear();
+    auto& caps = scratch.best;
+    caps.assign(code.save_points, 0);
+    auto& stack = scratch.frames;
+    scratch.reached = from;
+    for (size_t start = from; start <= n;) {
+      if constexpr (Unanchored) {
+        if (code.prefilter != program::NONE) {
+          start = code.next_candidate(str, start);
+          if (start >= n) {
+            scratch.reached = n;
+            return false;  // and the regex can't match the empty string
+          }
+        }
+      }
+      stack.clear();
+      stack.push_back({0, frame::explore, start});
+      while (stack.size()) {
+        const frame f = stack.back();
+        stack.pop_back();
+        if (f.slot != frame::explore) {
+          caps[f.slot] = f.pos;
+          continue;
+        }
+        uint32_t k = f.op;
+        size_t p = f.pos;
+        // follow lb, rb waits on the stack
+        while (true) {
+          if constexpr (collect_stats) {
+            scratch.reached = std::max(scratch.reached, std::min(p + 1, n));
+          }
+          const uint32_t bit = k * len + (p - from);
+          if (visited.test(bit)) {
+            break;
+          }
+          visited.set(bit);
+          if ((k >= ops) || (base[k].opt == op::optype::COUNT)) {
+            // a counted repeat, the next count first and out of it once at
+            // min waits on the stack
+            const auto [j, c] = code.count_at(code.prog, k);
+            const auto& r = code.counters[j];
+            size_t q = p;
+            if ((p >= n) || !code.takes(r.atom, next_utf8(str, q))) {
+              break;
+            }
+            p = q + 1;
+            const uint32_t out = base[r.at].lb;
+            if (c + 1 == r.max) {
+              k = out;
+              continue;
+            }
+            if (c + 1 >= r.min) {
+              stack.push_back({out, frame::explore, p});
+            }
+            k = ops + r.first + c;
+            continue;
+          }
+          const auto& o = base[k];
+          if (o.opt == op::optype::SPLIT) {
+            stack.push_back({o.rb, frame::explore, p});
+            k = o.lb;
+            continue;
+          }
+          if (o.opt == op::optype::SAVE) {
+            stack.push_back({0, o.data, caps[o.data]});
+            caps[o.data] = p;
+            k = o.lb;
+            continue;
+          }
+          if (o.opt == op::optype::MATCH) {
+            if (empty_at(caps.data(), skip_empty)) {
+              break;
+            }
+            return true;
+          }
+          if (p >= n) {
+            break;
+          }
+          if ((o.opt == op::optype::CHAR) && (code.run_at[k] != op::none)) {
+            // the ops past its head aren't marked visited, one reached some
+            // other way walks the rest of the run again
+            const auto& r = code.runs[code.run_at[k]];
+            if ((n - p < r.bytes) ||
+                std::memcmp(str.data() + p, code.literals.data() + r.text,
+                            r.bytes)) {
+              break;
+            }
+            k = r.next;
+            p += r.bytes;
+            continue;
+          }
+          size_t q = p;
+          const uint32_t utf8 = next_utf8(str, q);
+          if (((o.opt == op::optype::CHAR) && (utf8 != o.data)) ||
+              ((o.opt == op::optype::CLASS) &&
+               !code.classes[o.data].test_rev4byte(utf8))) {
+            break;
+          }
+          k = o.lb;
+          p = q + 1;
+        }
+      }
+      if (!Unanchored || (start >= n)) {
+        break;
+      }
+      size_t q = start;
+      next_utf8(str, q);
+      start = q + 1;
+    }
+    scratch.reached = Unanchored ? n : scratch.reached;
+    return false;
+  }
+
+  // the pike vm from str[from], the match goes to scratch.best
+  template <bool Unanchored>
+  static bool pike(const program& code, match_state& scratch,
+                   std::string_view str, size_t from, size_t skip_empty) {
+    auto& cur = scratch.cur;
+    auto& best = scratch.best;
+    bool found = false;  // a match is pending, only higher priority threads
+                         // are still running
+    size_t i = from;
+    ++scratch.gen_id;
+    start_thread(code, scratch, cur, i);
+    while (true) {
+      if constexpr (Unanchored) {
+        if (!found) {
+          if ((cur.size() == 0) && (code.prefilter != program::NONE)) {
+            // nothing running, skip to where a match could start
+            const size_t skip = code.next_candidate(str, i);
+            if (skip >= str.size()) {
+              i = str.size();
+              break;  // and the regex can't match the empty string
+            }
+            if (skip != i) {
+              i = skip;
+              ++scratch.gen_id;
+            }
+          }
+          start_thread(code, scratch, cur, i);
+        }
+      }
+      if (cur.size() == 0) {
+        break;
+      }
+      if (i >= str.size()) {
+        found |= step_end(code, scratch, skip_empty, best);
+        continue;
+      }
+      size_t i_c = i;  // temporary to avoid change in i
+      uint32_t utf8 = next_utf8(str, i_c);
+      found |= step(code, scratch, utf8, i_c + 1, skip_empty, best);
+      i = i_c + 1;
+    }
+    cur.clear();
+    scratch.reached = i;
+    return found;
+  }
+
+ public:
+  template <bool Unanchored = false>
+  bool test(std::string_view str) {
+    return test<Unanchored>(*code, scratch, str);
+  }
+
+  // test on up to threads cores at once, for one large input (see scan)
+  template <bool Unanchored = false>
+  bool test(std::string_view str, uint32_t threads) {
+    return scan<Unanchored>(str, threads, true) != std::string_view::npos;
+  }
+  // the offset just past the end of the first match to end (where test
+  // stops), npos without a match
+  template <bool Unanchored = false>
+  size_t find_end(std::string_view str, uint32_t threads = 1) {
+    return scan<Unanchored>(str, threads, false);
+  }
+
+  template <bool Unanchored = false>
+  bool test_set(std::string_view str, std::vector<uint32_t>& ids) {
+    return test_set<Unanchored>(*code, scratch, str, ids);
+  }
+
+  template <bool Unanchored = false, bool Match_one = true>
+  bool match(std::string_view str) {
+    return match<Unanchored, Match_one>(*code, scratch, str);
+  }
+
+  template <bool Unanchored = false, bool Match_one = true>
+  bool match(std::string_view str, bool print_flag) {
+    bool m = match<Unanchored, Match_one>(str);
+    if (m) {
+      std::cout << "Regex matching successsful!" << "\n";
+      std::cout << str.substr(0, (str.size() > 1000) ? 1000 : str.size())
+                << ((str.size() > 1000) ? " ..." : "") << std::endl;
+      const auto& matches = scratch.matches;
+      for (auto i = 0; i < (*code).save_points; i += 2) {
+        std::cout << "Matches for group [" << i / 2 << "]" << "\n";
+        for (auto j = 0; j < matches.size(); ++j) {
+          for (auto k = matches[j][i]; k < matches[j][i + 1]; ++k) {
+            std::cout << str[k];
+          }
+          std::cout << "\n";
+        }
+      }
+      std::cout << std::flush;
+    }
+    return m;
+  }
+  bool multi_match(std::string_view str) { return match<true, true>(str); }
+
+  // see match_cursor, it shares this instance's scratch so don't match with
+  // the instance while the cursor is in use
+  template <bool Unanchored = false>
+  match_cursor<Unanchored> find_all(std::string_view str) {
+    return match_cursor<Unanchored>(*code, scratch, str);
+  }
+  // calls f(slots) for every non overlapping match, one buffer for all
+  template <bool Unanchored = false, typename F>
+  void for_each_match(std::string_view str, F&& f) {
+    auto cursor = find_all<Unanchored>(str);
+    std::vector<size_t> slots((*code).save_points);
+    while (cursor.next(slots.data())) {
+      f(static_cast<const size_t*>(slots.data()));
+    }
+  }
+
+  // test on every input, bit k of out (resized to hold in.size()) is
+  // whether in[k] has a match, scratch stays bound from one input to the next
+  // so there's no setup per input, threads > 1 spreads the inputs over
+  // worker threads (see for_batch), bad utf8 throws as test does
+  template <bool Unanchored = false>
+  void test_batch(std::span<const std::string_view> in, bitvector& out,
+                  uint32_t threads = 1) {
+    out.resize(in.size());
+    for_batch(in.size(), threads, [&](match_state& st, size_t k) {
+      if (search<Unanchored>(*code, st, in[k], nullptr)) {
+        out.set(k);
+      } else {
+        out.reset(k);
+      }
+    });
+  }
+  // the first match of every input, as test_batch, row k of slots (resized
+  // to in.size() rows of save_points) holds in[k]'s slots or -1s when bit k
+  // of out is unset, match_indices isn't touched
+  template <bool Unanchored = false>
+  void match_batch(std::span<const std::string_view> in, bitvector& out,
+                   std::vector<size_t>& slots, uint32_t threads = 1) {
+    const size_t width = (*code).save_points;
+    out.resize(in.size());
+    slots.resize(in.size() * width);
+    for_batch(in.size(), threads, [&](match_state& st, size_t k) {
+      size_t pos = 0;
+      size_t skip_empty = -1;
+      size_t* row = slots.data() + k * width;
+      check_utf8(in[k], "simple_regex::nfa_vm::match_batch");
+      if (next_match<Unanchored>(*code, st, in[k], pos, skip_empty)) {
+        std::memcpy(row, st.best.data(), width * sizeof(size_t));
+        out.set(k);
+      } else {
+        std::fill(row, row + width, size_t(-1));
+        out.reset(k);
+      }
+    });
+  }
+
+  std::vector<std::vector<size_t>>& match_indices() {
+    return scratch.matches;
+  }
+  const std::vector<std::vector<size_t>>& match_indices() const {
+    return scratch.matches;
+  }
+
+  // what the engines did on this instance (the batch workers' included) since
+  // it was made or reset_stats, e.g. how much of the input was left to the
+  // nfa, the counters stay 0 without SIMPLE_REGEX_STATS
+  engine_stats stats() const {
+    engine_stats ret = scratch.stats();
+    for (const auto& h : helpers) {
+      ret += h.stats();
+    }
+    return ret;
+  }
+  void reset_stats() {
+    scratch.reset_stats();
+    for (auto& h : helpers) {
+      h.reset_stats();
+    }
+  }
+  // hands f(pattern, stats()) on (to a metrics exporter, one series per
+  // pattern) and starts counting afresh
+  template <typename F>
+  void export_stats(F&& f) {
+    f(std::string_view((*code).pattern), stats());
+    reset_stats();
+  }
+
+  void free_memory(bool free_prog_vec = false) {
+    if (free_prog_vec) {
+      // drops this instance's hold on the program, others sharing it are
+      // unaffected
+      code.reset();
+      share(nullptr);
+    }
+    scratch.free_memory();
+    for (const auto& h : helpers) {
+      // the workers' counts outlive them
+      engine_stats c = h.stats();
+      c.cache_bytes = 0;
+      scratch.counted += c;
+    }
+    helpers.clear();
+  }
+
+  // test's lazy dfas (anchored and unanchored) for any number of nfa_vm on
+  // one program (see share), built by all of them together: a worker missing
+  // a transition builds the state and publishes it with a compare and swap,
+  // into the state table and then into the transition, so the others find it
+  // from then on, and looking states up never locks. A table holding as many
+  // states as the budget allows is swapped for an empty one, the old one is
+  // freed once no walk that started in it is left (each walk pins the epoch
+  // it started in), e.g. for a pool of workers
+  //   auto dfa = std::make_shared<nfa_vm::shared_dfa>(code);
+  //   vm.share(dfa);  // in each worker
+  struct shared_dfa {
+    // into match, dead or (with a prefilter) unanchored start states
+    static constexpr uint32_t special = cache::special;
+    static constexpr uint32_t offset_mask = cache::offset_mask;
+    static constexpr uint32_t unknown = cache::unknown;
+    static constexpr uint32_t invalid = cache::invalid;
+    static constexpr uint32_t readers = 64;  // walks at once, see pin
+
+    shared_dfa(std::shared_ptr<const program> compiled)
+        : code(std::move(compiled)) {
+      configure(scratch.config);
+    }
+    // cfg.budget over the bytes a state takes sets how many a table holds
+    shared_dfa(std::shared_ptr<const program> compiled,
+               const cache_config& cfg)
+        : code(std::move(compiled)) {
+      configure(cfg);
+    }
+    shared_dfa(const shared_dfa&) = delete;
+    shared_dfa& operator=(const shared_dfa&) = delete;
+
+    // builds the states test<false> and test<true> reach on sample ahead of
+    // time (the unanchored walk restarting after each match so all of it is
+    // seen), not at once with another warm, throws once frozen
+    void warm(std::string_view sample) {
+      if (frozen) {
+        throw std::logic_error("simple_regex::nfa_vm::shared_dfa, frozen");
+      }
+      check_utf8(sample, "simple_regex::nfa_vm::shared_dfa::warm");
+      size_t i = 0;
+      uint32_t own;
+      walk<false>(sample, i, scratch, nullptr, own);
+      for (i = 0; i < sample.size();) {
+        const size_t from = i;
+        if ((walk<true>(sample, i, scratch, nullptr, own) != cache::FOUND) ||
+            (i == from)) {
+          break;
+        }
+      }
+    }
+    // no state is built from here on, a missing one is the worker's own
+    void freeze() { frozen = true; }
+    bool is_frozen() const { return frozen; }
+    const program& compiled() const { return *code; }
+    // states in the tables now
+    uint32_t size() const {
+      uint32_t ret = 0;
+      for (const auto& g : current) {
+        const table& t = *g.load();
+        ret += std::min<uint32_t>(t.count.load(), t.states.size());
+      }
+      return ret;
+    }
+    // drops every state, walks in the old tables finish in them
+    void clear() {
+      for (uint32_t u = 0; u < 2; ++u) {
+        renew(u, nullptr);
+      }
+    }
+
+    // test's walk from s[i] (see cache::run) on the table of Unanchored,
+    // building and publishing missing states, FOUND with i just past the
+    // match, GAVE_UP where it can't go on (frozen, the table is full or
+    // every reader slot is taken) with i at the start of the code point and
+    // own the row of the state reached in scratch's own cache
+    template <bool Unanchored>
+    cache::outcome walk(std::string_view s, size_t& i, match_state& scratch,
+                        hybrid_set* hits, uint32_t& own) {
+      own = 0;
+      pin held(*this, &scratch);
+      if (!held.slot) {
+        return cache::GAVE_UP;
+      }
+      table& t = *current[Unanchored].load();
+      const program& c = *code;
+      const byte* str = reinterpret_cast<const byte*>(s.data());
+      const byte* classes = c.byte_class;
+      const size_t n = s.size();
+      const uint32_t row = c.byte_classes;
+      if (t.states[0].match && (!hits || c.collect(t.states[0].ops, *hits))) {
+        return cache::FOUND;
+      }
+      uint32_t cur = 0;
+      size_t idx = i;
+      if (Unanchored && t.skip_start) {
+        idx = c.next_candidate(s, idx);
+      }
+      for (; idx < n; ++idx) {
+        uint32_t nxt = t.trans[size_t(cur) * row + classes[str[idx]]].load(
+            std::memory_order_acquire);
+        if (nxt == unknown) [[unlikely]] {
+          nxt = build<Unanchored>(t, cur, str[idx], scratch);
+          if (nxt == unknown) {
+            i = idx - t.states[cur].prefix_len;
+            own = scratch.mem[Unanchored].adopt(t.states[cur].ops, c);
+            return cache::GAVE_UP;
+          }
+        }
+        if (nxt & special) [[unlikely]] {
+          if (nxt == invalid) {
+            error_invalid_utf8("simple_regex::nfa_vm::shared_dfa::walk");
+          }
+          cur = nxt & offset_mask;
+          const cache_element& e = t.states[cur];
+          if (e.match) {
+            if (!hits || c.collect(e.ops, *hits)) {
+              i = idx + 1;
+              return cache::FOUND;
+            }
+          } else if (cur == 0) {
+            // back at the start, jump to where a match could start
+            idx = c.next_candidate(s, idx + 1) - 1;
+          } else {
+            i = n;  // dead
+            return cache::NO_MATCH;
+          }
+          continue;
+        }
+        cur = nxt;
+      }
+      if (t.states[cur].pending) {
+        error_invalid_utf8("simple_regex::nfa_vm::shared_dfa::walk, truncated");
+      }
+      i = n;
+      return cache::NO_MATCH;
+    }
+
+   protected:
+    // states by id, written once (before their id is published) and then
+    // only read, transitions are ids (| special) by id * byte classes + class
+    // and the hash table slots hold id + 1 (0 empty)
+    struct table {
+      table(const program& code, uint32_t capacity, bool unanchored)
+          : states(capacity),
+            trans(new std::atomic<uint32_t>[size_t(capacity) *
+                                            code.byte_classes]),
+            mask(std::bit_ceil(2 * capacity) - 1),
+            slots(new std::atomic<uint32_t>[mask + 1]) {
+        skip_start = unanchored && (code.prefilter != program::NONE);
+        for (size_t k = 0; k < size_t(capacity) * code.byte_classes; ++k) {
+          trans[k].store(unknown, std::memory_order_relaxed);
+        }
+        for (uint32_t k = 0; k <= mask; ++k) {
+          slots[k].store(0, std::memory_order_relaxed);
+        }
+        hybrid_set work;
+        work.set_range(code.ruin_threads());
+        code.add_closure(work, code.prog_ruin_start);
+        cache_element& strt = states[0];
+        strt.ops = work.sparse.dense;
+        strt.finish(code.prog_ruin, false);
+        strt.key = strt.hash();
+        slots[strt.key & mask].store(1, std::memory_order_relaxed);
+      }
+      // the transition value of state id
+      uint32_t target(uint32_t id) const {
+        const cache_element& e = states[id];
+        const bool dead = (e.ops.size() == 0) && (e.pending == 0);
+        return (e.match || dead || ((id == 0) && skip_start)) ? id | special
+                                                              : id;
+      }
+
+      std::vector<cache_element> states;
+      std::unique_ptr<std::atomic<uint32_t>[]> trans;
+      uint32_t mask;
+      std::unique_ptr<std::atomic<uint32_t>[]> slots;
+      std::atomic<uint32_t> count{1};  // ids handed out, the start is 0
+      bool skip_start = false;
+    };
+
+    // a walk's hold on the tables: its reader slot holds the epoch it
+    // started in, 0 when free, no slot free and the walk runs on the
+    // worker's own cache
+    struct alignas(64) reader {
+      std::atomic<uint64_t> epoch{0};
+    };
+    struct pin {
+      pin(shared_dfa& d, const void* who) {
+        uint64_t e = d.epoch.load();
+        const uint32_t first = (reinterpret_cast<uintptr_t>(who) >> 6);
+        for (uint32_t k = 0; k < readers; ++k) {
+          uint64_t free = 0;
+          auto& r = d.pins[(first + k) % readers].epoch;
+          if (r.compare_exchange_strong(free, e)) {
+            slot = &r;
+            break;
+          }
+        }
+        // the epoch has to be the one the tables are loaded in
+        for (uint64_t now = d.epoch.load(); slot && (now != e);
+             now = d.epoch.load()) {
+          e = now;
+          (*slot).store(e);
+        }
+      }
+      ~pin() {
+        if (slot) {
+          (*slot).store(0, std::memory_order_release);
+        }
+      }
+      std::atomic<uint64_t>* slot = nullptr;
+    };
+
+    void configure(cache_config cfg) {
+      // warm's own cache, only adopted into when the table is full
+      cfg.min_bytes_per_state = 0;
+      scratch.config = cfg;
+      scratch.reset(*code);
+      const size_t per_state = (*code).byte_classes * sizeof(uint32_t) +
+                               sizeof(cache_element) + 64;
+      capacity = std::clamp<size_t>(cfg.budget / per_state, 64, 1 << 24);
+      for (uint32_t u = 0; u < 2; ++u) {
+        owned[u] = std::make_unique<table>(*code, capacity, u);
+        current[u].store(owned[u].get());
+      }
+    }
+
+    // the transition of state cur on byte b built, published and returned,
+    // unknown when frozen or t is full (t is then swapped for an empty one)
+    template <bool Unanchored>
+    uint32_t build(table& t, uint32_t cur, byte b, match_state& scratch) {
+      if (frozen) {
+        return unknown;
+      }
+      const program& c = *code;
+      const cache_element& e = t.states[cur];
+      uint32_t to = invalid;
+      if (!e.pending || utf_cont(b)) {
+        cache_element next = e.construct_next(
+            b, c, scratch.sim[0], Unanchored ? c.prog_ruin_start : op::none,
+            false);
+        next.key = next.hash();
+        const uint32_t id = publish(t, std::move(next));
+        if (id == unknown) {
+          renew(Unanchored, &t);
+          return unknown;
+        }
+        if constexpr (collect_stats) {
+          scratch.counted.states_built += 1;
+        }
+        to = t.target(id);
+      }
+      uint32_t was = unknown;
+      // losing the race means another worker linked the same state
+      t.trans[size_t(cur) * c.byte_classes + c.byte_class[b]]
+          .compare_exchange_strong(was, to, std::memory_order_acq_rel);
+      return (was == unknown) ? to : was;
+    }
+    // the id of the state in t the same as e, e's own once its slot is won,
+    // unknown once t is full (an id claimed by a worker losing the slot to
+    // the same state is left unused)
+    static uint32_t publish(table& t, cache_element&& e) {
+      uint32_t id = unknown;
+      for (uint32_t h = e.key & t.mask;; h = (h + 1) & t.mask) {
+        uint32_t v = t.slots[h].load(std::memory_order_acquire);
+        if (v == 0) {
+          if (id == unknown) {
+            id = t.count.fetch_add(1);
+            if (id >= t.states.size()) {
+              return unknown;
+            }
+            t.states[id] = std::move(e);
+          }
+          if (t.slots[h].compare_exchange_strong(v, id + 1,
+                                                 std::memory_order_acq_rel)) {
+            return id;
+          }
+        }
+        const cache_element& have = t.states[v - 1];
+        const cache_element& want = (id == unknown) ? e : t.states[id];
+        if ((have.key == want.key) && have.same_state(want)) {
+          return v - 1;
+        }
+      }
+    }
+    // swaps table u (when it's still full, always for nullptr) for an empty
+    // one and frees the retired tables no pinned walk can still be in
+    void renew(uint32_t u, const table* full) {
+      std::lock_guard<std::mutex> lock(retiring);
+      if (full && (current[u].load() != full)) {
+        return;  // another worker already did
+      }
+      auto fresh = std::make_unique<table>(*code, capacity, u);
+      current[u].store(fresh.get());
+      // walks pinned in this epoch or earlier may still be in the old table
+      retired.emplace_back(std::move(owned[u]), epoch.fetch_add(1));
+      owned[u] = std::move(fresh);
+      uint64_t oldest = -1;
+      for (const auto& r : pins) {
+        const uint64_t e = r.epoch.load();
+        oldest = (e && (e < oldest)) ? e : oldest;
+      }
+      std::erase_if(retired, [&](const auto& r) { return r.second < oldest; });
+    }
+
+    std::shared_ptr<const program> code;
+    match_state scratch;  // warm's
+    size_t capacity = 0;  // states a table holds
+    std::unique_ptr<table> owned[2];
+    std::atomic<table*> current[2];
+    std::atomic<uint64_t> epoch{1};
+    reader pins[readers];
+    std::mutex retiring;
+    // tables swapped out and the epoch they were swapped out in
+    std::vector<std::pair<std::unique_ptr<table>, uint64_t>> retired;
+    std::atomic<bool> frozen{false};
+  };
+
+  // test, test_set, test_batch and find_end (single threaded) look states up
+  // in dfa (built on this instance's program) ahead of the instance's own
+  // caches and build the missing ones there for every worker sharing it,
+  // nullptr stops sharing
+  void share(std::shared_ptr<shared_dfa> dfa) {
+    if (dfa && (&(*dfa).compiled() != code.get())) {
+      throw std::invalid_argument(
+          "simple_regex::nfa_vm::share, dfa of another program");
+    }
+    shared_states = std::move(dfa);
+    scratch.shared = shared_states.get();
+  }
+
+  // whether a stream fed in chunks holds a match, the unanchored lazy dfa runs
+  // from chunk to chunk (a code point split between chunks just leaves it in
+  // a pending state) so none of the input is kept, memory is the cache budget
+  struct test_stream {
+    test_stream(std::shared_ptr<const program> compiled)
+        : code(std::move(compiled)) {
+      configure(scratch.config);
+    }
+    test_stream(std::shared_ptr<const program> compiled,
+                const cache_config& cfg)
+        : code(std::move(compiled)) {
+      configure(cfg);
+    }
+    // drops the cached dfa states and restarts
+    void configure(cache_config cfg) {
+      // there's no input left to hand the nfa, evict instead of giving up
+      cfg.min_bytes_per_state = 0;
+      scratch.config = cfg;
+      scratch.reset(*code);
+      restart();
+    }
+    // true once the stream fed so far holds a match
+    bool feed(std::string_view chunk) {
+      if (found) {
+        return true;
+      }
+      auto& mem = scratch.mem[1];
+      mem.new_call();
+      size_t i = 0;
+      const std::vector<uint32_t>* last = nullptr;
+      found = mem.run<true>(chunk, i, *code, last, state);
+      end = fed + i;
+      fed += chunk.size();
+      return found;
+    }
+    // the stream is over, throws if it stopped part way into a code point
+    bool finish() {
+      if (!found && (fed == 0)) {
+        feed(std::string_view());  // nothing fed, a nullable regex matches
+      }
+      if (!found && scratch.mem[1].pending(state)) {
+        error_invalid_utf8("simple_regex::nfa_vm::test_stream::finish");
+      }
+      return found;
+    }
+    // back to an empty stream, cached dfa states are kept
+    void restart() {
+      state = 0;
+      fed = 0;
+      end = 0;
+      found = false;
+    }
+    bool matched() const { return found; }
+    // offset just past the end of the first match to end (when matched)
+    size_t match_end() const { return end; }
+    size_t offset() const { return fed; }  // bytes fed so far
+
+   protected:
+    std::shared_ptr<const program> code;
+    match_state scratch;
+    uint32_t state = 0;  // row offset of the dfa state reached
+    size_t fed = 0;
+    size_t end = 0;
+    bool found = false;
+  };
+
+  // the matches match<true, false> would find in the whole stream, fed in
+  // chunks, positions are offsets from the start of the stream, the pike vm
+  // threads carry over from chunk to chunk and the only input kept is a code
+  // point split between chunks and what has to be scanned again once a
+  // pending match is settled (nothing unless higher priority threads outlive
+  // a match, e.g. a.*z|a keeps everything after the a until it gives up)
+  struct match_stream {
+    match_stream(std::shared_ptr<const program> compiled)
+        : code(std::move(compiled)), scratch(*code) {
+      restart();
+    }
+    // settled matches are appended to matches(), clear it as they're handled
+    void feed(std::string_view chunk) {
+      if (carry.size()) {
+        // the rest of a code point cut off by the last chunk
+        const size_t need = utf_bytes(carry[0]) - carry.size();
+        if (chunk.size() < need) {
+          carry += chunk;
+          return;
+        }
+        carry += chunk.substr(0, need);
+        chunk.remove_prefix(need);
+        std::string cp;
+        swap(cp, carry);
+        consume(cp);
+      }
+      consume(chunk);
+    }
+    // the stream is over, settles what's pending, throws if it stopped part
+    // way into a code point
+    void finish() {
+      if (carry.size()) {
+        error_invalid_utf8("simple_regex::nfa_vm::match_stream::finish");
+      }
+      const program& c = *code;
+      auto& cur = scratch.cur;
+      while (true) {
+        if (!found) {
+          start_thread(c, scratch, cur, pos);
+        }
+        if (cur.size() == 0) {
+          if (!found) {
+            break;
+          }
+          settle();
+          continue;
+        }
+        if (step_end(c, scratch, skip_empty, best)) {
+          found = true;
+          replay.clear();
+        }
+      }
+    }
+    // back to an empty stream
+    void restart() {
+      scratch.clear_match_info();
+      ++scratch.gen_id;
+      best.clear();
+      replay.clear();
+      carry.clear();
+      pos = 0;
+      skip_empty = -1;
+      found = false;
+    }
+    std::vector<std::vector<size_t>>& matches() { return scratch.matches; }
+    size_t offset() const { return pos + carry.size(); }  // bytes fed so far
+
+   protected:
+    // data holds whole code points from pos on, bar maybe a cut off last one
+    void consume(std::string_view data) {
+      const program& c = *code;
+      auto& cur = scratch.cur;
+      size_t k = 0;
+      while (k < data.size()) {
+        if (!found) {
+          if ((cur.size() == 0) && (c.prefilter != program::NONE)) {
+            // nothing running, skip to where a match could start
+            const size_t skip = c.next_candidate(data, k);
+            if (skip != k) {
+              pos += skip - k;
+              k = skip;
+              ++scratch.gen_id;
+              if (k >= data.size()) {
+                break;
+              }
+            }
+          }
+          start_thread(c, scratch, cur, pos);
+        }
+        if ((cur.size() == 0) && found) {
+          settle();
+          continue;
+        }
+        const size_t len = utf_bytes(data[k]);
+        if (k + len > data.size()) {
+          carry = data.substr(k);
+          return;
+        }
+        size_t k_c = k;
+        uint32_t utf8 = get_utf8_n_inc(data, k_c);
+        if (step(c, scratch, utf8, pos + len, skip_empty, best)) {
+          // a better match ends here, anything before it is settled
+          found = true;
+          replay.clear();
+        }
+        if (found) {
+          replay += data.substr(k, len);
+        }
+        pos += len;
+        k += len;
+      }
+    }
+    // nothing can beat the pending match, hand it out and scan again from its
+    // end
+    void settle() {
+      found = false;
+      scratch.matches.emplace_back(std::move(best));
+      const auto& last = scratch.matches.back();
+      if (last[0] == last[1]) {
+        skip_empty = last[1];
+      }
+      pos = last[1];
+      ++scratch.gen_id;
+      std::string again;
+      swap(again, replay);
+      consume(again);
+    }
+
+    std::shared_ptr<const program> code;
+    match_state scratch;
+    std::vector<size_t> best;  // the pending match
+    std::string replay;        // input from the end of the pending match on
+    std::string carry;         // a code point cut off by the end of a chunk
+    size_t pos = 0;            // stream offset of the next code point
+    size_t skip_empty = -1;
+    bool found = false;  // a match is pending
+  };
+
+  // inputs per block a batch worker takes at once, whole words of out
+  static constexpr size_t batch_block = 64;
+
+ protected:
+  // f(state, k) for every k < n, on this instance's scratch alone or split
+  // into blocks taken off a shared counter by it and threads - 1 helpers
+  // (kept, warm, for the next batch), the first exception a worker throws
+  // stops the others and is rethrown here
+  template <typename F>
+  void for_batch(size_t n, uint32_t threads, F&& f) {
+    bind(*code, scratch);
+    const size_t blocks = (n + batch_block - 1) / batch_block;
+    if ((threads < 2) || (blocks < 2)) {
+      for (size_t k = 0; k < n; ++k) {
+        f(scratch, k);
+      }
+      return;
+    }
+    std::atomic<size_t> next{0};
+    on_workers(std::min<size_t>(threads, blocks), [&](match_state& st,
+                                                      uint32_t) {
+      try {
+        for (size_t b = next++; b < blocks; b = next++) {
+          const size_t end = std::min(n, (b + 1) * batch_block);
+          for (size_t k = b * batch_block; k < end; ++k) {
+            f(st, k);
+          }
+        }
+      } catch (...) {
+        next = blocks;
+        throw;
+      }
+    });
+  }
+  // f(state, t) for every t < threads at once, t = 0 on this instance's
+  // scratch and the rest on threads of their own with the helpers, the first
+  // exception a worker throws is rethrown here once all are done
+  template <typename F>
+  void on_workers(uint32_t threads, F&& f) {
+    while (helpers.size() < threads - 1) {
+      helpers.emplace_back();
+      helpers.back().config = scratch.config;
+    }
+    for (auto& h : helpers) {
+      h.shared = scratch.shared;
+    }
+    std::atomic<bool> failed{false};
+    std::exception_ptr error;
+    auto work = [&](match_state& st, uint32_t t) {
+      try {
+        bind(*code, st);
+        f(st, t);
+      } catch (...) {
+        if (!failed.exchange(true)) {
+          error = std::current_exception();
+        }
+      }
+    };
+    std::vector<std::thread> pool;
+    for (uint32_t t = 1; t < threads; ++t) {
+      pool.emplace_back(work, std::ref(helpers[t - 1]), t);
+    }
+    work(scratch, 0);
+    for (auto& t : pool) {
+      t.join();
+    }
+    if (error) {
+      std::rethrow_exception(error);
+    }
   }
 
-  template <bool Unanchored = false, bool Match_one = true>
-  bool match(const std::string& str, bool print_flag) {
-    bool m = match<Unanchored, Match_one>(str);
-    if (m) {
-      std::cout << "Regex matching successsful!" << "\n";
-      std::cout << str.substr(0, (str.size() > 1000) ? 1000 : str.size())
-                << ((str.size() > 1000) ? " ..." : "") << std::endl;
-      for (auto i = 0; i < save_points; i += 2) {
-        std::cout << "Matches for group [" << i / 2 << "]" << "\n";
-        for (auto j = 0; j < matches.size(); ++j) {
-          for (auto k = matches[j][i]; k < matches[j][i + 1]; ++k) {
-            std::cout << str[k];
+  // a scan isn't split into segments shorter than this
+  static constexpr size_t scan_min = 1 << 18;
+  // checkpoints are at least this far apart, at most this many a segment
+  static constexpr size_t scan_step = 1 << 16;
+  static constexpr size_t scan_cuts = 256;
+
+  // test (any) and find_end, unanchored with threads > 1 str is cut at code
+  // point boundaries into a segment per thread, each scanned from the start
+  // state by its thread's lazy dfa (finding every match starting in it) which
+  // publishes the ops of the states it reaches at checkpoints, then goes on
+  // into the next segments (a match starting in one can end in another)
+  // until it's back at the start state or its ops are a subset of the ones
+  // the segment's own scan had there, which from then on finds everything
+  // it would, so the first end found is test's and with any the first match
+  // found stops every thread, each thread checks its own segment's utf8
+  // before scanning so bad utf8 anywhere throws as test does
+  template <bool Unanchored>
+  size_t scan(std::string_view str, uint32_t threads, bool any) {
+    constexpr size_t npos = std::string_view::npos;
+    bind(*code, scratch);
+    const size_t n = str.size();
+    threads = std::min<size_t>(threads, n / scan_min);
+    if (!Unanchored || (threads < 2)) {
+      size_t end = npos;
+      search<Unanchored>(*code, scratch, str, nullptr, &end);
+      return end;
+    }
+    struct segment {
+      std::vector<size_t> cuts;  // checkpoints, from its start to its end
+      std::vector<std::vector<uint32_t>> ops;  // its own scan's at cuts[j + 1]
+      std::atomic<size_t> ready{0};  // ops published
+    };
+    auto boundary = [&](size_t p) {
+      while ((p < n) && utf_cont(str[p])) {
+        ++p;
+      }
+      return p;
+    };
+    std::vector<segment> seg(threads);
+    for (uint32_t k = 0; k < threads; ++k) {
+      const size_t from = boundary(n / threads * k);
+      const size_t to = (k + 1 < threads) ? boundary(n / threads * (k + 1)) : n;
+      const size_t step = std::max(scan_step, (to - from) / scan_cuts);
+      for (size_t p = from; p < to; p = boundary(p + step)) {
+        seg[k].cuts.push_back(p);
+      }
+      seg[k].cuts.push_back(to);
+      seg[k].ops.resize(seg[k].cuts.size() - 1);
+    }
+    auto lower = [](std::atomic<size_t>& a, size_t v) {
+      size_t c = a.load();
+      while ((v < c) && !a.compare_exchange_weak(c, v)) {
+      }
+    };
+    std::atomic<size_t> limit{npos};  // no checkpoint from here on is scanned
+    std::atomic<size_t> best{npos};
+    std::atomic<bool> bad{false};
+    on_workers(threads, [&](match_state& st, uint32_t k) {
+      const auto& own = seg[k].cuts;
+      const size_t len = own.back() - own.front();
+      if (utf8_error(str.substr(own.front(), len)) != len) {
+        bad = true;
+        limit = 0;
+        return;
+      }
+      auto& mem = st.mem[1];
+      // the states compared have to be the dfa's, evict rather than give up
+      struct keep {
+        cache& c;
+        uint32_t min_bytes;
+        ~keep() { c.cfg.min_bytes_per_state = min_bytes; }
+      } restore{mem, mem.cfg.min_bytes_per_state};
+      mem.cfg.min_bytes_per_state = 0;
+      mem.new_call();
+      uint32_t cur = 0;
+      for (uint32_t m = k; m < threads; ++m) {
+        auto& s = seg[m];
+        for (size_t j = 0; j + 1 < s.cuts.size(); ++j) {
+          const size_t from = s.cuts[j];
+          if (from >= limit.load(std::memory_order_relaxed)) {
+            return;
+          }
+          if ((m > k) &&
+              ((cur == 0) ||
+               ((j > 0) && (s.ready.load(std::memory_order_acquire) >= j) &&
+                !mem.pending(cur) &&
+                std::includes(s.ops[j - 1].begin(), s.ops[j - 1].end(),
+                              mem.ops_at(cur).begin(),
+                              mem.ops_at(cur).end())))) {
+            return;
+          }
+          size_t i = from;
+          const std::vector<uint32_t>* last = nullptr;
+          try {
+            if (mem.run<true>(str.substr(0, s.cuts[j + 1]), i, *code, last,
+                              cur)) {
+              lower(best, i);
+              lower(limit, any ? 0 : i);
+              return;
+            }
+          } catch (const std::invalid_argument&) {
+            return;  // in a later segment, its own thread reports it
+          }
+          if ((m == k) && !mem.pending(cur)) {
+            s.ops[j] = mem.ops_at(cur);
+            s.ready.store(j + 1, std::memory_order_release);
           }
-          std::cout << "\n";
         }
       }
-      std::cout << std::flush;
+    });
+    if (bad) {
+      error_invalid_utf8("simple_regex::nfa_vm::test");
     }
-    return m;
+    return best;
   }
-  bool multi_match(const std::string& str) { return match<true, true>(str); }
 
-  std::vector<std::vector<uint32_t>>& match_indices() { return matches; }
-  const std::vector<std::vector<uint32_t>>& match_indices() const {
-    return matches;
+  std::shared_ptr<const program> code;
+  match_state scratch;
+  std::vector<match_state> helpers;  // scratch of the batch workers
+  std::shared_ptr<shared_dfa> shared_states;  // see share
+};
+
+// compiled programs by pattern, shared and immutable so any number of nfa_vm
+// (nfa_vm(cache.get(p))) can match on one, the capacity most recently used
+// are kept and a miss is compiled outside the lock so a slow pattern doesn't
+// hold up lookups of others, safe to use from any number of threads
+struct regex_cache {
+  using program = nfa_vm::program;
+  regex_cache(size_t capacity = 256) : capacity(capacity ? capacity : 1) {}
+  // throws as program's constructor does, a bad pattern isn't cached
+  std::shared_ptr<const program> get(const std::string& regex) {
+    {
+      std::lock_guard<std::mutex> hold(lock);
+      auto it = index.find(regex);
+      if (it != index.end()) {
+        order.splice(order.begin(), order, it->second);
+        return it->second->second;
+      }
+    }
+    auto compiled = std::make_shared<const program>(regex);
+    std::lock_guard<std::mutex> hold(lock);
+    auto it = index.find(regex);
+    if (it != index.end()) {
+      // compiled by another thread meanwhile
+      order.splice(order.begin(), order, it->second);
+      return it->second->second;
+    }
+    order.emplace_front(regex, compiled);
+    index.emplace(order.front().first, order.begin());
+    if (order.size() > capacity) {
+      index.erase(order.back().first);
+      order.pop_back();
+    }
+    return compiled;
+  }
+  size_t size() const {
+    std::lock_guard<std::mutex> hold(lock);
+    return order.size();
+  }
+  // programs already handed out live on in their holders
+  void clear() {
+    std::lock_guard<std::mutex> hold(lock);
+    index.clear();
+    order.clear();
   }
 
-  void free_memory(bool free_prog_vec = false) {
-    if (free_prog_vec) {
-      prog = std::move(std::vector<op>(0));
-      classes = std::move(std::vector<utf8_bitmap>(0));
-      save_points = 0;  // for consistency sake
+ protected:
+  // most recently used first, index keys view the strings held here
+  std::list<std::pair<std::string, std::shared_ptr<const program>>> order;
+  std::unordered_map<std::string_view, decltype(order)::iterator> index;
+  mutable std::mutex lock;
+  size_t capacity;
+};
+
+// a pattern as a template argument, for static_regex<"f.*l ">
+template <size_t N>
+struct fixed_string {
+  constexpr fixed_string(const char (&s)[N]) {
+    for (size_t i = 0; i < N; ++i) {
+      data[i] = s[i];
     }
-    // matching will still work but might have a bit of warmup
-    f_stack = std::move(std::vector<nfa_frag>(0));
-    cur = std::move(std::vector<thread>(0));
-    nxt = std::move(std::vector<thread>(0));
-    matches = std::move(std::vector<std::vector<uint32_t>>(0));
   }
+  char data[N]{};
+};
 
-  // protected:
-  //  nfa related
-  std::vector<op> prog;
-  std::vector<op> prog_ruin;  // prog without save op
-  uint32_t prog_ruin_start;   // track where the first instruction should be
-  std::vector<utf8_bitmap> classes;
-  utf8_bitmap regex_chars;
-  uint32_t save_points = 0;
-  // compilation only
-  std::vector<nfa_frag> f_stack;
-  // matching related
-  uint64_t gen_id = 0;
-  std::vector<thread> cur{};
-  std::vector<thread> nxt{};
-  cache mem;
-  std::vector<std::vector<uint32_t>> matches;
+// a regex compiled with the program using it, same grammar as nfa_vm. the
+// pattern is parsed into a glushkov automaton (one position per CHAR, CLASS or
+// ANY op, follow sets in place of the SPLIT and SAVE ops between them) and
+// determinized in constexpr, so test() walks constant tables: nothing is
+// parsed or cached at runtime and each code point is one table lookup. a
+// pattern whose dfa would pass max_states simulates the position sets instead
+template <fixed_string Pattern>
+struct static_regex {
+  static constexpr size_t length = sizeof(Pattern.data) - 1;
+  // positions, counted repeats copy theirs once per repeat
+  static constexpr size_t capacity =
+      ops_bound(Pattern.data, length, false) + 1;
+  static constexpr size_t words = capacity / 64 + 1;
+  // key spans, the bytes of a class or literal hold at least one each
+  static constexpr size_t span_capacity = length + 1;
+  static constexpr uint32_t max_states = 256;
+
+  // what a multi byte code point (reverse packed) is classed by, its length
+  // over the index utf8_bitmap keeps it under, so keys of one length are in
+  // code point order and nfa_vm's classes are spans of them
+  static constexpr uint32_t key(uint32_t cp) {
+    return (static_cast<uint32_t>(utf_bytes(cp & 0xFF)) << 21) |
+           utf8_scalar(cp);
+  }
+  // the code point (reverse packed) of a key
+  static constexpr uint32_t code_point_of(uint32_t k) {
+    const uint32_t n = k >> 21;
+    const uint32_t x = k & 0x1FFFFF;
+    const uint32_t lead = (n == 2) ? 0xC0 : (n == 3) ? 0xE0 : 0xF0;
+    uint32_t cp = lead | (x >> (6 * (n - 1)));
+    for (uint32_t j = 1; j < n; ++j) {
+      cp |= (0x80 | ((x >> (6 * (n - 1 - j))) & 63)) << (8 * j);
+    }
+    return cp;
+  }
+
+  // a set of positions, one bit each
+  struct pos_set {
+    constexpr void insert(uint32_t p) { w[p / 64] |= uint64_t(1) << (p % 64); }
+    constexpr bool test(uint32_t p) const {
+      return (w[p / 64] >> (p % 64)) & 1;
+    }
+    constexpr bool any() const {
+      for (auto x : w) {
+        if (x) {
+          return true;
+        }
+      }
+      return false;
+    }
+    constexpr pos_set& operator|=(const pos_set& other) {
+      for (size_t i = 0; i < words; ++i) {
+        w[i] |= other.w[i];
+      }
+      return *this;
+    }
+    constexpr pos_set operator&(const pos_set& other) const {
+      pos_set ret = *this;
+      for (size_t i = 0; i < words; ++i) {
+        ret.w[i] &= other.w[i];
+      }
+      return ret;
+    }
+    constexpr bool operator==(const pos_set&) const = default;
+    uint64_t w[words]{};
+  };
+
+  // what one position consumes
+  struct position {
+    uint64_t single[3]{};  // one byte code points (below 192)
+    uint32_t members = 0;  // multi byte code points, the key spans
+    uint32_t members_end = 0;  // [members, members_end) of spans
+    bool any = false;
+  };
+
+  // recursive descent over the pattern, positions numbered left to right
+  struct automaton {
+    struct frag {
+      pos_set first;  // positions that can consume the first code point
+      pos_set last;   // positions that can consume the last
+      bool nullable = false;
+    };
+
+    constexpr automaton(const char* s) : src(s) {
+      frag f = alt();
+      if (at != length) {
+        throw std::invalid_argument("simple_regex::static_regex, stray )");
+      }
+      first = f.first;
+      last = f.last;
+      nullable = f.nullable;
+    }
+    constexpr byte peek() const { return (at < length) ? src[at] : 0; }
+    // one code point in reverse byte order, as get_utf8_n_inc
+    constexpr uint32_t code_point() {
+      const byte lead = src[at];
+      const uint32_t len = utf_bytes(lead);
+      if (at + len > length) {
+        throw std::invalid_argument("simple_regex::static_regex, bad utf8");
+      }
+      uint32_t cp = lead;
+      for (uint32_t k = 1; k < len; ++k) {
+        const byte b = src[at + k];
+        if (!utf_cont(b)) {
+          throw std::invalid_argument("simple_regex::static_regex, bad utf8");
+        }
+        cp |= static_cast<uint32_t>(b) << (8 * k);
+      }
+      at += len;
+      return cp;
+    }
+    // keys lo to hi (exclusive) into p, spans are added in key order
+    constexpr void add_span(position& p, uint32_t lo, uint32_t hi) {
+      spans[2 * p.members_end] = lo;
+      spans[2 * p.members_end + 1] = hi;
+      span_count = ++p.members_end;
+    }
+    constexpr void add_member(position& p, uint32_t cp) {
+      if (cp < 192) {
+        p.single[cp / 64] |= uint64_t(1) << (cp % 64);
+      } else {
+        add_span(p, key(cp), key(cp) + 1);
+      }
+    }
+    constexpr frag leaf(const position& p) {
+      frag f;
+      f.first.insert(positions);
+      f.last.insert(positions);
+      pos[positions++] = p;
+      return f;
+    }
+    // [abc], [a-z], [^...] as char_class: the ranges of code points sorted
+    // and merged, their multi byte parts kept as spans of keys
+    constexpr frag char_class() {
+      position p;
+      p.members = p.members_end = span_count;
+      const bool negated = (peek() == '^');
+      at += negated;
+      auto next = [&](bool& loose) {
+        const uint32_t cp = code_point();
+        loose = (cp >= 128) && (cp < 192);  // a lone continuation byte
+        return utf8_scalar(cp);
+      };
+      std::vector<std::pair<uint32_t, uint32_t>> ranges;
+      while (true) {
+        if (at == length) {
+          throw std::invalid_argument("simple_regex::static_regex, stray [");
+        }
+        if (src[at] == ']') {
+          break;
+        }
+        bool loose = false;
+        const uint32_t lo = next(loose);
+        if (loose) {
+          add_member(p, lo);
+          continue;
+        }
+        uint32_t hi = lo;
+        if ((at + 1 < length) && (src[at] == '-') && (src[at + 1] != ']')) {
+          ++at;
+          hi = next(loose);
+          if (loose || (hi < lo)) {
+            throw std::invalid_argument(
+                "simple_regex::static_regex, range out of order");
+          }
+        }
+        ranges.emplace_back(lo, hi);
+      }
+      ++at;
+      std::sort(ranges.begin(), ranges.end());
+      for (size_t k = 0; k < ranges.size();) {
+        uint32_t hi = ranges[k].second;
+        size_t j = k + 1;
+        for (; (j < ranges.size()) && (ranges[j].first <= hi + 1); ++j) {
+          hi = std::max(hi, ranges[j].second);
+        }
+        for (uint32_t c = ranges[k].first; (c <= hi) && (c < 0x80); ++c) {
+          add_member(p, c);
+        }
+        // the 2, 3 and 4 byte code points as keys
+        for (uint32_t n = 2; n <= 4; ++n) {
+          const uint32_t from = (n == 2) ? 0x80 : (n == 3) ? 0x800 : 0x10000;
+          const uint32_t to = (uint32_t(1) << (5 * n + 1)) - 1;
+          const uint32_t l = std::max(ranges[k].first, from);
+          const uint32_t h = std::min(hi, to);
+          if (l <= h) {
+            add_span(p, (n << 21) | l, ((n << 21) | h) + 1);
+          }
+        }
+        k = j;
+      }
+      if (negated) {
+        // every one byte code point and every key flipped
+        for (auto& w : p.single) {
+          w = ~w;
+        }
+        std::vector<uint32_t> in(spans + 2 * p.members,
+                                 spans + 2 * p.members_end);
+        in.push_back(5 << 21);
+        p.members_end = p.members;
+        span_count = p.members;
+        uint32_t from = 2 << 21;
+        for (size_t k = 0; k < in.size(); k += 2) {
+          if (from < in[k]) {
+            add_span(p, from, in[k]);
+          }
+          from = (k + 1 < in.size()) ? in[k + 1] : from;
+        }
+      }
+      return leaf(p);
+    }
+    constexpr frag atom() {
+      position p;
+      switch (peek()) {
+        case '(': {
+          ++at;
+          frag f = alt();
+          if (peek() != ')') {
+            throw std::invalid_argument("simple_regex::static_regex, stray (");
+          }
+          ++at;
+          return f;
+        }
+        case '[':
+          ++at;
+          return char_class();
+        case '.':
+          ++at;
+          p.any = true;
+          return leaf(p);
+        case '\\':
+          if (++at == length) {
+            throw std::invalid_argument("simple_regex::static_regex, stray \\");
+          }
+          break;
+        case 0:
+        case ')':
+        case ']':
+        case '|':
+        case '*':
+        case '+':
+        case '?':
+          throw std::invalid_argument(
+              "simple_regex::static_regex, operator without an operand");
+        default:
+          break;
+      }
+      p.members = p.members_end = span_count;
+      add_member(p, code_point());
+      return leaf(p);
+    }
+    constexpr frag repeat() {
+      const uint32_t from = positions;
+      frag f = atom();
+      while (true) {
+        switch (peek()) {
+          default:
+            return f;
+          case '*':
+          case '+':
+            loop(f);
+            f.nullable |= (peek() == '*');
+            break;
+          case '?':
+            f.nullable = true;
+            break;
+          case '{': {
+            uint32_t n = 0;
+            uint32_t m = 0;
+            bool inf = false;
+            if (!repeat_count(src, length, at, n, m, inf)) {
+              return f;
+            }
+            f = counted(f, from, n, m, inf);
+            continue;
+          }
+        }
+        ++at;
+      }
+    }
+    // f{n}, f{n,} or f{n,m} where f is positions [from, positions), copied
+    // as nfa_vm does, the copies past the n th optional
+    constexpr frag counted(const frag& f, uint32_t from, uint32_t n,
+                           uint32_t m, bool inf) {
+      const uint32_t copies = inf ? std::max(n, 1u) : m;
+      const uint32_t span = positions - from;
+      if (copies == 0) {
+        for (uint32_t l = from; l < positions; ++l) {
+          pos[l] = position{};
+          follow[l] = pos_set{};
+        }
+        positions = from;
+        return frag{pos_set{}, pos_set{}, true};
+      }
+      // every copy is taken before any is joined
+      for (uint32_t k = 1; k < copies; ++k) {
+        for (uint32_t l = from; l < from + span; ++l) {
+          pos[l + k * span] = pos[l];
+          follow[l + k * span] = moved(follow[l], from, span, k * span);
+        }
+      }
+      positions += (copies - 1) * span;
+      frag r = f;
+      r.nullable |= (n == 0);
+      for (uint32_t k = 1; k < copies; ++k) {
+        join(r, frag{moved(f.first, from, span, k * span),
+                     moved(f.last, from, span, k * span),
+                     f.nullable || (k >= n)});
+      }
+      if (inf) {
+        // the last copy loops
+        frag c{moved(f.first, from, span, (copies - 1) * span),
+               moved(f.last, from, span, (copies - 1) * span), false};
+        loop(c);
+      }
+      return r;
+    }
+    // s with positions [from, from + span) moved up by shift
+    constexpr pos_set moved(const pos_set& s, uint32_t from, uint32_t span,
+                            uint32_t shift) const {
+      pos_set ret{};
+      for (uint32_t p = from; p < from + span; ++p) {
+        if (s.test(p)) {
+          ret.insert(p + shift);
+        }
+      }
+      return ret;
+    }
+    // f+ without its nullable
+    constexpr void loop(const frag& f) {
+      for (uint32_t l = 0; l < positions; ++l) {
+        if (f.last.test(l)) {
+          follow[l] |= f.first;
+        }
+      }
+    }
+    // f followed by g
+    constexpr void join(frag& f, const frag& g) {
+      for (uint32_t l = 0; l < positions; ++l) {
+        if (f.last.test(l)) {
+          follow[l] |= g.first;
+        }
+      }
+      if (f.nullable) {
+        f.first |= g.first;
+      }
+      if (g.nullable) {
+        f.last |= g.last;
+      } else {
+        f.last = g.last;
+      }
+      f.nullable &= g.nullable;
+    }
+    constexpr frag concat() {
+      frag f = repeat();
+      while ((peek() != '|') && (peek() != ')') && (at != length)) {
+        join(f, repeat());
+      }
+      return f;
+    }
+    constexpr frag alt() {
+      frag f = concat();
+      while (peek() == '|') {
+        ++at;
+        const frag g = concat();
+        f.first |= g.first;
+        f.last |= g.last;
+        f.nullable |= g.nullable;
+      }
+      return f;
+    }
+
+    const char* src;
+    size_t at = 0;
+    position pos[capacity]{};
+    pos_set follow[capacity]{};  // positions that can come after each
+    uint32_t spans[2 * span_capacity]{};  // [lo, hi) key spans
+    uint32_t positions = 0;
+    uint32_t span_count = 0;
+    pos_set first{};
+    pos_set last{};
+    bool nullable = false;
+  };
+
+  // code points grouped by the positions that accept them, the dfa's symbols
+  struct alphabet {
+    constexpr alphabet(const automaton& a) {
+      for (uint32_t b = 0; b < 192; ++b) {
+        pos_set m{};
+        for (uint32_t p = 0; p < a.positions; ++p) {
+          if (a.pos[p].any || ((a.pos[p].single[b / 64] >> (b % 64)) & 1)) {
+            m.insert(p);
+          }
+        }
+        single[b] = intern(m);
+      }
+      for (uint32_t k = 0; k < 2 * a.span_count; ++k) {
+        bounds[k] = a.spans[k];
+      }
+      std::sort(bounds, bounds + 2 * a.span_count);
+      segments = std::unique(bounds, bounds + 2 * a.span_count) - bounds;
+      // the keys from one bound to the next are accepted by the same
+      // positions, those past the last by other's
+      for (uint32_t k = 0; k + 1 < segments; ++k) {
+        pos_set m{};
+        for (uint32_t p = 0; p < a.positions; ++p) {
+          const auto& o = a.pos[p];
+          bool in = o.any;
+          for (uint32_t j = o.members; !in && (j < o.members_end); ++j) {
+            in = (a.spans[2 * j] <= bounds[k]) &&
+                 (bounds[k] < a.spans[2 * j + 1]);
+          }
+          if (in) {
+            m.insert(p);
+          }
+        }
+        segment_sym[k] = intern(m);
+      }
+      pos_set m{};
+      for (uint32_t p = 0; p < a.positions; ++p) {
+        if (a.pos[p].any) {
+          m.insert(p);
+        }
+      }
+      other = intern(m);
+      if (segments) {
+        segment_sym[segments - 1] = other;
+      }
+    }
+    constexpr uint32_t intern(const pos_set& m) {
+      for (uint32_t s = 0; s < symbols; ++s) {
+        if (masks[s] == m) {
+          return s;
+        }
+      }
+      masks[symbols] = m;
+      return symbols++;
+    }
+
+    // positions accepting each symbol
+    pos_set masks[192 + 2 * span_capacity + 1]{};
+    uint16_t single[192]{};  // symbol of each one byte code point
+    uint32_t bounds[2 * span_capacity]{};  // sorted ends of the key spans
+    uint16_t segment_sym[2 * span_capacity]{};  // from bounds[k] on
+    uint32_t segments = 0;
+    uint16_t other = 0;  // any other multi byte code point
+    uint16_t symbols = 0;
+  };
+
+  static constexpr automaton nfa{Pattern.data};
+  static constexpr alphabet sigma{nfa};
+
+  // the positions a state reached (nothing consumed yet for the anchored
+  // start, which the initial flag tells apart from the dead state)
+  struct subset {
+    pos_set s;
+    bool initial;
+    constexpr bool operator==(const subset&) const = default;
+  };
+  struct subsets {
+    std::vector<subset> states;
+    std::vector<uint32_t> next;  // states x symbols
+    bool overflow = false;
+  };
+  template <bool Unanchored>
+  static constexpr subsets determinize() {
+    subsets d;
+    // unanchored the start is the empty set, first is added to every step
+    d.states.push_back({pos_set{}, !Unanchored});
+    for (size_t k = 0; k < d.states.size(); ++k) {
+      const subset cur = d.states[k];
+      pos_set reach{};
+      if (Unanchored || cur.initial) {
+        reach = nfa.first;
+      }
+      for (uint32_t p = 0; p < nfa.positions; ++p) {
+        if (cur.s.test(p)) {
+          reach |= nfa.follow[p];
+        }
+      }
+      for (uint32_t c = 0; c < sigma.symbols; ++c) {
+        const subset t{reach & sigma.masks[c], false};
+        uint32_t j = 0;
+        while ((j < d.states.size()) && !(d.states[j] == t)) {
+          ++j;
+        }
+        if (j == d.states.size()) {
+          if (j == max_states) {
+            d.overflow = true;
+            return d;
+          }
+          d.states.push_back(t);
+        }
+        d.next.push_back(j);
+      }
+    }
+    return d;
+  }
+
+  // next is premultiplied by the symbol count, special marks a target that
+  // matched or died so the walk needs no second lookup
+  static constexpr uint32_t special = 0x80000000;
+  template <bool Unanchored>
+  struct tables {
+    static constexpr uint32_t states = [] {
+      const auto d = determinize<Unanchored>();
+      return d.overflow ? 0 : d.states.size();
+    }();
+    static constexpr auto next = [] {
+      std::array<uint32_t, states * sigma.symbols> t{};
+      if constexpr (states != 0) {
+        const auto d = determinize<Unanchored>();
+        for (size_t i = 0; i < t.size(); ++i) {
+          const auto& st = d.states[d.next[i]];
+          const bool dead = !Unanchored && !st.initial && !st.s.any();
+          t[i] = d.next[i] * sigma.symbols;
+          if (dead || (st.s & nfa.last).any()) {
+            t[i] |= special;
+          }
+        }
+      }
+      return t;
+    }();
+    // the anchored dead state as it appears in next, never unanchored
+    static constexpr uint32_t dead = [] {
+      uint32_t ret = 0;
+      if constexpr (!Unanchored && (states != 0)) {
+        const auto d = determinize<Unanchored>();
+        for (uint32_t i = 0; i < states; ++i) {
+          if (!d.states[i].initial && !d.states[i].s.any()) {
+            ret = (i * sigma.symbols) | special;
+          }
+        }
+      }
+      return ret;
+    }();
+  };
+
+  // what an unanchored search skips ahead to from the start state, as
+  // program::create_prefilter: the literal every match starts with, else the
+  // one byte every match starts with (not a continuation byte)
+  struct prefilter_info {
+    constexpr prefilter_info() {
+      pos_set cur = nfa.first;
+      pos_set seen{};
+      while (true) {
+        uint32_t p = 0;
+        while ((p < nfa.positions) && !cur.test(p)) {
+          ++p;
+        }
+        if ((p == nfa.positions) || seen.test(p) || !(cur == one(p))) {
+          break;
+        }
+        const auto& o = nfa.pos[p];
+        uint32_t cp = 0;
+        uint32_t count = 0;
+        for (uint32_t k = o.members; k < o.members_end; ++k) {
+          const bool one = (nfa.spans[2 * k + 1] - nfa.spans[2 * k] == 1);
+          cp = code_point_of(nfa.spans[2 * k]);
+          count += one ? 1 : 2;
+        }
+        for (uint32_t b = 0; b < 192; ++b) {
+          if ((o.single[b / 64] >> (b % 64)) & 1) {
+            cp = b;
+            ++count;
+          }
+        }
+        if (o.any || (count != 1)) {
+          break;
+        }
+        for (; cp; cp >>= 8) {
+          prefix[prefix_len++] = cp & 0xFF;
+        }
+        if (nfa.last.test(p)) {
+          break;
+        }
+        seen.insert(p);
+        cur = nfa.follow[p];
+      }
+      if (prefix_len > 1) {
+        kind = nfa_vm::program::LITERAL;
+        return;
+      }
+      uint32_t found = 256;
+      uint32_t count = 0;
+      for (uint32_t b = 0; b < 256; ++b) {
+        bool starts = false;
+        if (b < 192) {
+          starts = (sigma.masks[sigma.single[b]] & nfa.first).any();
+        }
+        for (uint32_t p = 0; (b >= 192) && (p < nfa.positions); ++p) {
+          const auto& o = nfa.pos[p];
+          if (!nfa.first.test(p)) {
+            continue;
+          }
+          starts |= o.any;
+          for (uint32_t k = o.members; k < o.members_end; ++k) {
+            starts |= leads(nfa.spans[2 * k], nfa.spans[2 * k + 1], b);
+          }
+        }
+        if (starts) {
+          found = b;
+          ++count;
+        }
+      }
+      if ((count == 1) && !utf_cont(found)) {
+        kind = nfa_vm::program::BYTE;
+        first_byte = found;
+      }
+    }
+    // can a key in [lo, hi) start with the byte b, the leads of each length
+    // are its top bits over the length's base
+    static constexpr bool leads(uint32_t lo, uint32_t hi, uint32_t b) {
+      for (uint32_t n = 2; n <= 4; ++n) {
+        const uint32_t base = (n == 2) ? 0xC0 : (n == 3) ? 0xE0 : 0xF0;
+        const uint32_t l = std::max(lo, n << 21);
+        const uint32_t h =
+            std::min(hi, (n << 21) + (uint32_t(1) << (5 * n + 1)));
+        const uint32_t shift = 6 * (n - 1);
+        if ((l < h) && (b >= base) &&
+            (b - base >= ((l & 0x1FFFFF) >> shift)) &&
+            (b - base <= (((h - 1) & 0x1FFFFF) >> shift))) {
+          return true;
+        }
+      }
+      return false;
+    }
+    static constexpr pos_set one(uint32_t p) {
+      pos_set ret{};
+      ret.insert(p);
+      return ret;
+    }
+
+    nfa_vm::program::prefilter_kind kind = nfa_vm::program::NONE;
+    byte first_byte = 0;
+    // a position takes up to 4 bytes and is taken once, counted repeats
+    // make the literal longer than the pattern
+    char prefix[4 * capacity]{};
+    size_t prefix_len = 0;
+  };
+  static constexpr prefilter_info skip{};
+
+  // the symbol of the code point at str[i], i is left at its last byte
+  static uint32_t symbol(std::string_view str, size_t& i) {
+    const byte b = str[i];
+    if (b < 192) [[likely]] {
+      return sigma.single[b];
+    }
+    const uint32_t k = key(get_utf8_n_inc(str, i));
+    const uint32_t* it =
+        std::upper_bound(sigma.bounds, sigma.bounds + sigma.segments, k);
+    return (it == sigma.bounds) ? sigma.other
+                                : sigma.segment_sym[it - sigma.bounds - 1];
+  }
+
+  // for patterns past max_states, the position sets stepped at runtime
+  template <bool Unanchored>
+  static bool simulate(std::string_view str) {
+    pos_set cur{};
+    for (size_t i = 0; i < str.size(); ++i) {
+      pos_set reach{};
+      if (Unanchored || (i == 0)) {
+        reach = nfa.first;
+      }
+      for (size_t w = 0; w < words; ++w) {
+        for (uint64_t bits = cur.w[w]; bits; bits &= bits - 1) {
+          reach |= nfa.follow[64 * w + std::countr_zero(bits)];
+        }
+      }
+      cur = reach & sigma.masks[symbol(str, i)];
+      if ((cur & nfa.last).any()) {
+        return true;
+      }
+      if (!Unanchored && !cur.any()) {
+        return false;
+      }
+    }
+    return false;
+  }
+
+  // does a match exist (anchored: one starting at str[0])
+  template <bool Unanchored = false>
+  static bool test(std::string_view str) {
+    if constexpr (nfa.nullable) {
+      return true;
+    } else if constexpr (tables<Unanchored>::states == 0) {
+      return simulate<Unanchored>(str);
+    } else {
+      using t = tables<Unanchored>;
+      uint32_t s = 0;
+      for (size_t i = 0; i < str.size(); ++i) {
+        if constexpr (Unanchored && (skip.kind != nfa_vm::program::NONE)) {
+          if (s == 0) {
+            i = nfa_vm::program::next_candidate(
+                skip.kind, skip.first_byte,
+                std::string_view(skip.prefix, skip.prefix_len), str, i);
+            if (i == str.size()) {
+              return false;
+            }
+          }
+        }
+        s = t::next[s + symbol(str, i)];
+        if (s & special) {
+          return s != t::dead;
+        }
+      }
+      return false;
+    }
+  }
 };
 
 }  // namespace simple_regex
\ No newline at end of file
@@ -0,0 +1,244 @@
+// grep like scanner built on simple_regex::nfa_vm, memory maps the files a
+// batch at a time and splits them on line boundaries into chunks for one pool
+// of threads, each thread with its own scratch (and so its own warm dfa
+// caches, from one file to the next) over one shared compiled program
+//
+// build: g++ -std=c++20 -O2 -pthread -o simple_grep simple_grep.cpp
+// usage: simple_grep [-c | -l] [-j threads] pattern file...
+//   -c  print only the number of matching lines
+//   -l  print only the names of files with a matching line
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <barrier>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "regex.hpp"
+
+// a read only mapping of a whole file
+struct mapped_file {
+  mapped_file(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+      error = errno;
+      return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+      opened = true;
+      size = st.st_size;
+      if (size) {
+        void* p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+          error = errno;
+          opened = false;
+          size = 0;
+        } else {
+          madvise(p, size, MADV_SEQUENTIAL);
+          data = static_cast<const char*>(p);
+        }
+      }
+    } else {
+      error = errno;
+    }
+    close(fd);
+  }
+  ~mapped_file() {
+    if (data) {
+      munmap(const_cast<char*>(data), size);
+    }
+  }
+  mapped_file(const mapped_file&) = delete;
+  mapped_file& operator=(const mapped_file&) = delete;
+  std::string_view view() const { return std::string_view(data, size); }
+
+  const char* data = nullptr;
+  size_t size = 0;
+  bool opened = false;
+  int error = 0;  // errno when not opened
+};
+
+// a run of whole lines of one file and what scanning it found
+struct chunk {
+  uint32_t file = 0;  // index into the batch
+  std::string_view text;
+  std::vector<std::string_view> lines;  // matching lines (not for -c or -l)
+  size_t count = 0;                     // matching lines
+};
+
+// cuts text (of the batch's file) into chunks of about target bytes, each
+// ending after a newline
+void split_lines(std::string_view text, uint32_t file, size_t target,
+                 std::vector<chunk>& out) {
+  while (text.size()) {
+    size_t cut = text.size();
+    if (text.size() > target) {
+      const void* nl =
+          std::memchr(text.data() + target, '\n', text.size() - target);
+      if (nl) {
+        cut = static_cast<const char*>(nl) - text.data() + 1;
+      }
+    }
+    out.emplace_back();
+    out.back().file = file;
+    out.back().text = text.substr(0, cut);
+    text.remove_prefix(cut);
+  }
+}
+
+int main(int argc, char** argv) {
+  enum { LINES, COUNT, FILES } mode = LINES;
+  uint32_t jobs = std::thread::hardware_concurrency();
+  int arg = 1;
+  for (; arg < argc && argv[arg][0] == '-'; ++arg) {
+    if (!std::strcmp(argv[arg], "-c")) {
+      mode = COUNT;
+    } else if (!std::strcmp(argv[arg], "-l")) {
+      mode = FILES;
+    } else if (!std::strcmp(argv[arg], "-j") && arg + 1 < argc) {
+      jobs = std::atoi(argv[++arg]);
+    } else {
+      break;
+    }
+  }
+  if (argc - arg < 2) {
+    std::cerr << "usage: simple_grep [-c | -l] [-j threads] pattern file..."
+              << std::endl;
+    return 2;
+  }
+  jobs = jobs ? jobs : 1;
+  std::shared_ptr<const simple_regex::nfa_vm::program> code;
+  try {
+    code = std::make_shared<const simple_regex::nfa_vm::program>(argv[arg]);
+  } catch (const std::exception& e) {
+    std::cerr << "simple_grep: " << e.what() << std::endl;
+    return 2;
+  }
+  const int first_file = arg + 1;
+  const bool many = (argc - first_file) > 1;
+  bool any = false;
+  bool failed = false;
+  // a batch is mapped at once, up to this many files or about this many
+  // bytes, its chunks are the work items of every thread
+  constexpr uint32_t batch_files = 1024;
+  constexpr size_t batch_bytes = size_t(1) << 28;
+  std::vector<std::unique_ptr<mapped_file>> files;
+  std::vector<chunk> chunks;
+  std::atomic<size_t> next{0};
+  std::vector<std::atomic<bool>> stop(batch_files);  // -l needs one line
+  bool done = false;
+  // the pool scans a batch between these, the main thread with it
+  std::barrier start(jobs);
+  std::barrier finish(jobs);
+  auto scan = [&](simple_regex::nfa_vm& vm) {
+    for (size_t c = next++; c < chunks.size(); c = next++) {
+      auto& ch = chunks[c];
+      std::string_view text = ch.text;
+      while (text.size() && !stop[ch.file]) {
+        const void* nl = std::memchr(text.data(), '\n', text.size());
+        const size_t len =
+            nl ? static_cast<const char*>(nl) - text.data() : text.size();
+        std::string_view line = text.substr(0, len);
+        text.remove_prefix(nl ? len + 1 : len);
+        bool hit = false;
+        try {
+          hit = vm.test<true>(line);
+        } catch (const std::invalid_argument&) {
+          // not utf8, not a match
+        }
+        if (hit) {
+          ch.count += 1;
+          if (mode == LINES) {
+            ch.lines.emplace_back(line);
+          } else if (mode == FILES) {
+            stop[ch.file] = true;
+          }
+        }
+      }
+    }
+  };
+  std::vector<std::thread> pool;
+  for (uint32_t t = 1; t < jobs; ++t) {
+    pool.emplace_back([&] {
+      simple_regex::nfa_vm vm(code);
+      while (true) {
+        start.arrive_and_wait();
+        if (done) {
+          return;
+        }
+        scan(vm);
+        finish.arrive_and_wait();
+      }
+    });
+  }
+  simple_regex::nfa_vm vm(code);
+  for (int f = first_file; f < argc;) {
+    const int batch = f;
+    size_t bytes = 0;
+    files.clear();
+    chunks.clear();
+    for (; (f < argc) && (files.size() < batch_files) &&
+           (bytes < batch_bytes);
+         ++f) {
+      stop[files.size()] = false;
+      files.emplace_back(std::make_unique<mapped_file>(argv[f]));
+      const mapped_file& file = *files.back();
+      split_lines(file.view(), files.size() - 1, 1 << 20, chunks);
+      bytes += file.size;
+    }
+    next = 0;
+    start.arrive_and_wait();
+    scan(vm);
+    finish.arrive_and_wait();
+    // merge in file order, a file's chunks are together and in order
+    size_t c = 0;
+    for (uint32_t k = 0; k < files.size(); ++k) {
+      const char* name = argv[batch + k];
+      if (!(*files[k]).opened) {
+        std::cerr << "simple_grep: " << name << ": "
+                  << std::strerror((*files[k]).error) << std::endl;
+        failed = true;
+        continue;
+      }
+      size_t count = 0;
+      for (; (c < chunks.size()) && (chunks[c].file == k); ++c) {
+        const auto& ch = chunks[c];
+        count += ch.count;
+        if (mode == LINES) {
+          for (const auto& line : ch.lines) {
+            if (many) {
+              std::cout << name << ':';
+            }
+            std::cout << line << '\n';
+          }
+        }
+      }
+      any |= (count != 0);
+      if (mode == COUNT) {
+        if (many) {
+          std::cout << name << ':';
+        }
+        std::cout << count << '\n';
+      } else if ((mode == FILES) && count) {
+        std::cout << name << '\n';
+      }
+    }
+  }
+  done = true;
+  start.arrive_and_wait();
+  for (auto& t : pool) {
+    t.join();
+  }
+  std::cout << std::flush;
+  return failed ? 2 : (any ? 0 : 1);
+}
@@ -1,8 +1,11 @@
 #include <bit>
 #include <chrono>
 #include <iostream>
+#include <random>
 #include <regex>
 
+// the checks below read nfa_vm::stats
+#define SIMPLE_REGEX_STATS
 #include "regex.hpp"
 // uint32_t utf8_codepoint(){}
 uint32_t roughie_mac_toughie(uint32_t x) {
@@ -34,7 +37,61 @@ uint32_t roughie_mac_toughie(uint32_t x) {
   return n - x;
 }
 
+// static_regex against nfa_vm, counted literals are longer than their
+// pattern text (a{6} is six bytes of prefix from four)
+template <simple_regex::fixed_string Pattern>
+int check_static(const std::vector<std::string>& inputs) {
+  simple_regex::nfa_vm vm(Pattern.data);
+  int failed = 0;
+  for (const auto& s : inputs) {
+    if (simple_regex::static_regex<Pattern>::template test<true>(s) !=
+        vm.test<true>(s)) {
+      std::cout << "static_regex " << Pattern.data << " differs on " << s
+                << std::endl;
+      ++failed;
+    }
+  }
+  return failed;
+}
+
+// match_all on a cache that keeps giving up: the fallback counts what it
+// read, not the rest of the input on every match, and an input too long for
+// the backtracker (see nfa_vm::can_backtrack) goes through the pike vm
+int check_stats() {
+  std::mt19937 rng(3);
+  int failed = 0;
+  for (size_t size : {size_t(100000), size_t(400000)}) {
+    std::string str;
+    for (size_t i = 0; i < size; ++i) {
+      str += "abcd"[rng() % 4];
+    }
+    simple_regex::nfa_vm vm("a[bc].{0,3}dd[ab]c");
+    vm.set_cache_config(
+        {1024, simple_regex::nfa_vm::cache_config::FIFO, 10, 4});
+    vm.match<true, false>(str);
+    const auto s = vm.stats();
+    if (s.dfa_bytes + s.nfa_bytes > 4 * size) {
+      std::cout << "stats read " << s.dfa_bytes + s.nfa_bytes << " of "
+                << size << " bytes" << std::endl;
+      ++failed;
+    }
+    if ((size == 400000) && (s.peak_threads == 0)) {
+      std::cout << "stats no pike vm threads" << std::endl;
+      ++failed;
+    }
+  }
+  return failed;
+}
+
 int main() {
+  const std::vector<std::string> counted = {
+      "", "aaaaa", "xaaaaaay", "cccccccc", "ccccccc", "abababababééé"};
+  int failed = check_static<"a{6}">(counted) + check_static<"c{8,}">(counted) +
+               check_static<"x{0,2}a{5}y">(counted) +
+               check_static<"(ab){5}é{3}">(counted) + check_stats();
+  if (failed) {
+    return 1;
+  }
   std::string regex = "f.*l ";
   simple_regex::nfa_vm oh(regex);
   std::regex re(regex, std::regex::optimize);  // compilation should happen here